@@ -5,6 +5,7 @@
 
 require 'mkmf'
 require 'timeout'
+require_relative '../../lib/rugged/version'
 
 RbConfig::MAKEFILE_CONFIG['CC'] = ENV['CC'] if ENV['CC']
 
@@ -139,10 +140,78 @@ else
   # $DEFLIBPATH, we can ensure that our bundled version is always used.
   $DEFLIBPATH.unshift("#{LIBGIT2_DIR}/build")
   dir_config('git2', "#{LIBGIT2_DIR}/include", "#{LIBGIT2_DIR}/build")
+
+  # libgit2 doesn't export its pack window counters, but since the vendored
+  # copy is linked statically we can read them; see Settings.pack_stats.
+  # rugged_mwindow.c is built against libgit2's private mwindow.h for that;
+  # -iquote keeps those headers from shadowing any <system> ones.
+  $defs.push("-DRUGGED_MWINDOW_STATS")
+  # The same goes for rugged_pack_stream.c, which lets Repository#read_stream
+  # inflate packed objects incrementally through libgit2's private pack.h,
+  # hashing them on the way since that bypasses the ODB's own checks.
+  $defs.push("-DRUGGED_PACK_STREAM")
+  # And for rugged_object_cache.c, which tells the "odb.read" event whether
+  # an object came from the object cache.
+  $defs.push("-DRUGGED_OBJECT_CACHE")
+  %w[src/libgit2 src/util build/src/util].each do |dir|
+    $CFLAGS << " -iquote #{File.join(LIBGIT2_DIR, dir)}"
+  end
 end
 
 unless have_library 'git2' and have_header 'git2.h'
   abort "ERROR: Failed to build libgit2"
 end
 
+# The files built against libgit2's private headers depend on internals
+# that any vendor bump may change. Each one is checked here: its fields
+# must exist with the types it reads them as, in the libgit2 series it
+# was written for, so that a change fails the build with a clear message
+# instead of reading the wrong memory.
+def check_libgit2_internals(feature, headers, body)
+  major, minor = Rugged::Version.split(".")
+
+  try_compile(<<-SRC, "", {werror: true}) or abort "ERROR: #{feature} needs libgit2 internals that have changed; update it for the vendored libgit2"
+#include <git2/version.h>
+#include "common.h"
+#{headers.map { |header| %(#include "#{header}") }.join("\n")}
+
+#if LIBGIT2_VERSION_MAJOR != #{major} || LIBGIT2_VERSION_MINOR != #{minor}
+#error only checked against libgit2 #{major}.#{minor}
+#endif
+
+int main(void)
+{
+#{body}
+	return 0;
+}
+  SRC
+end
+
+if $defs.include?("-DRUGGED_MWINDOW_STATS")
+  check_libgit2_internals("rugged_mwindow.c", %w[mwindow.h], <<-BODY)
+	extern git_mwindow_ctl git_mwindow__mem_ctl;
+	git_mwindow_ctl *ctl = &git_mwindow__mem_ctl;
+	size_t *sizes[] = { &ctl->mapped, &ctl->peak_mapped, &ctl->windowfiles.length, &ctl->used_ctr };
+	unsigned int *counts[] = { &ctl->open_windows, &ctl->peak_open_windows, &ctl->mmap_calls };
+	git_mutex *lock = &git__mwindow_mutex;
+	(void)sizes; (void)counts; (void)lock;
+  BODY
+end
+
+if $defs.include?("-DRUGGED_OBJECT_CACHE")
+  check_libgit2_internals("rugged_object_cache.c", %w[cache.h repository.h], <<-BODY)
+	git_repository repo;
+	git_cache *cache = &repo.objects;
+	ssize_t *used = &repo.objects.used_memory;
+	git_rwlock *lock = &repo.objects.lock;
+	void *(*get_raw)(git_cache *, const git_oid *) = git_cache_get_raw;
+	void *(*get_any)(git_cache *, const git_oid *) = git_cache_get_any;
+	void (*decref)(void *) = git_cached_obj_decref;
+	(void)cache; (void)used; (void)lock; (void)get_raw; (void)get_any; (void)decref;
+  BODY
+end
+
+# Zero-copy reads (buffer: true) hand out IO::Buffer views, new in Ruby 3.1
+have_header 'ruby/io/buffer.h'
+
 create_makefile("rugged/rugged")
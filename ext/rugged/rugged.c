@@ -7,6 +7,10 @@
 
 #include "rugged.h"
 
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
+
 const char *RUGGED_ERROR_NAMES[] = {
 	"None",            /* GIT_ERROR_NONE */
 	"NoMemError",      /* GIT_ERROR_NOMEMORY */
@@ -52,6 +56,7 @@ VALUE rb_eRuggedError;
 VALUE rb_eRuggedErrors[RUGGED_ERROR_COUNT];
 
 static VALUE rb_mShutdownHook;
+static ID id_borrowed_owner;
 
 /*
  *  call-seq:
@@ -144,8 +149,8 @@ static VALUE rb_git_valid_full_oid(VALUE self, VALUE hex)
  *  call-seq:
  *    Rugged.hex_to_raw(oid) -> raw_buffer
  *
- *  Turn a string of 40 hexadecimal characters into the buffer of
- *  20 bytes it represents.
+ *  Turn a string of 40 hexadecimal characters, or a Rugged::Oid, into
+ *  the buffer of 20 bytes it represents.
  *
  *    Rugged.hex_to_raw('d8786bfc97485e8d7b19b21fb88c8ef1f199fc3f')
  *    #=> "\330xk\374\227H^\215{\031\262\037\270\214\216\361\361\231\374?"
@@ -154,8 +159,7 @@ static VALUE rb_git_hex_to_raw(VALUE self, VALUE hex)
 {
 	git_oid oid;
 
-	Check_Type(hex, T_STRING);
-	rugged_exception_check(git_oid_fromstr(&oid, StringValueCStr(hex)));
+	rugged_exception_check(rugged_oid_from_value(&oid, hex));
 
 	return rb_str_new((const char *)oid.id, 20);
 }
@@ -333,6 +337,7 @@ static VALUE rb_git_minimize_oid(int argc, VALUE *argv, VALUE self)
 static void cleanup_cb(void *unused)
 {
 	(void)unused;
+	rugged_prefetch_shutdown();
 	git_libgit2_shutdown();
 }
 
@@ -357,6 +362,25 @@ void rugged_exception_raise(void)
 	rb_exc_raise(err_obj);
 }
 
+static VALUE rugged_check_ints_cb(VALUE unused)
+{
+	rb_thread_check_ints();
+	return Qnil;
+}
+
+/*
+ * rb_thread_check_ints() under rb_protect, for callers that hold native
+ * resources after a call without the GVL and must release them before a
+ * pending interrupt raises. Returns the state to pass to rb_jump_tag().
+ */
+int rugged_check_ints_protect(void)
+{
+	int exception = 0;
+
+	rb_protect(rugged_check_ints_cb, Qnil, &exception);
+	return exception;
+}
+
 VALUE rugged__block_yield_splat(VALUE args) {
 	VALUE block = rb_ary_shift(args);
 	int n = RARRAY_LENINT(args);
@@ -413,6 +437,26 @@ static VALUE rb_git_signature_from_buffer(int argc, VALUE *argv, VALUE self)
 	return rugged_signature_from_buffer(buffer, encoding_name);
 }
 
+VALUE rugged_buffer_new_borrowed(VALUE rb_owner, const char *ptr, size_t len)
+{
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	VALUE rb_buffer = rb_io_buffer_new((void *)ptr, len, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+
+	/*
+	 * Unlike a String, which Ruby may share or intern without its ivars,
+	 * a buffer and its slices always reference this object, so the ivar
+	 * keeps the owner alive. Locking it means it can't be freed or have
+	 * its memory transferred to another buffer either.
+	 */
+	rb_ivar_set(rb_buffer, id_borrowed_owner, rb_owner);
+	rb_io_buffer_lock(rb_buffer);
+
+	return rb_buffer;
+#else
+	rb_raise(rb_eNotImpError, "buffer: true requires IO::Buffer, new in Ruby 3.1");
+#endif
+}
+
 VALUE rugged_strarray_to_rb_ary(git_strarray *str_array)
 {
 	VALUE rb_array = rb_ary_new2(str_array->count);
@@ -592,6 +636,8 @@ void Init_rugged(void)
 {
 	rb_mRugged = rb_define_module("Rugged");
 
+	id_borrowed_owner = rb_intern("__rugged_borrowed_owner__");
+
 	/* Initialize the Error classes */
 	{
 		int i;
@@ -622,6 +668,9 @@ void Init_rugged(void)
 	rb_define_module_function(rb_mRugged, "dotgit_ignore?", rb_git_path_is_dotgit_ignore, 1);
 	rb_define_module_function(rb_mRugged, "dotgit_attributes?", rb_git_path_is_dotgit_attributes, 1);
 
+	Init_rugged_oid();
+	Init_rugged_allocator();
+	Init_rugged_instrument();
 	Init_rugged_reference();
 	Init_rugged_reference_collection();
 
@@ -634,6 +683,8 @@ void Init_rugged(void)
 
 	Init_rugged_index();
 	Init_rugged_repo();
+	Init_rugged_prefetch();
+	Init_rugged_diff_many();
 	Init_rugged_revwalk();
 	Init_rugged_branch();
 	Init_rugged_branch_collection();
@@ -683,6 +734,13 @@ void Init_rugged(void)
 
 	/* Set the allocator and initialize libgit2 */
 	rugged_set_allocator();
+
+	/*
+	 * fork() runs prepare handlers in the reverse order of registration.
+	 * The fork gate must come after the pool allocator's, so that it drains
+	 * our threads before the allocator locks the memory they may still need.
+	 */
+	Init_rugged_parallel();
 	git_libgit2_init();
 
 	/* Hook a global object to cleanup the library
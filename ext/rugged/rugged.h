@@ -62,6 +62,12 @@ void Init_rugged_blame(void);
 void Init_rugged_cred(void);
 void Init_rugged_backend(void);
 void Init_rugged_rebase(void);
+void Init_rugged_oid(void);
+void Init_rugged_allocator(void);
+void Init_rugged_parallel(void);
+void Init_rugged_instrument(void);
+void Init_rugged_prefetch(void);
+void Init_rugged_diff_many(void);
 
 VALUE rb_git_object_init(git_otype type, int argc, VALUE *argv, VALUE self);
 
@@ -85,6 +91,25 @@ VALUE rb_git_delta_file_fromC(const git_diff_file *file);
 VALUE rb_merge_file_result_fromC(const git_merge_file_result *results);
 
 void rugged_parse_diff_options(git_diff_options *opts, VALUE rb_options);
+
+/*
+ * Limits on the work spent on a diff: the :max_files, :max_lines,
+ * :max_total_bytes and :deadline_ms diff options. Unset limits are
+ * SIZE_MAX (or a zero deadline).
+ */
+struct rugged_diff_budget {
+	int enabled;
+	size_t max_files, max_lines, max_total_bytes;
+	long deadline_ms;
+	uint64_t deadline;
+
+	size_t files, lines, bytes;
+	int truncated;
+};
+
+void rugged_parse_diff_budget(struct rugged_diff_budget *budget, git_diff_options *opts, VALUE rb_options);
+VALUE rugged_diff_budget_attach(VALUE rb_diff, const struct rugged_diff_budget *budget);
+void rugged_diff_load_drivers(git_repository *repo, git_diff *diff, size_t offset, size_t count, VALUE rb_drivers);
 void rugged_parse_merge_options(git_merge_options *opts, VALUE rb_options);
 void rugged_parse_checkout_options(git_checkout_options *opts, VALUE rb_options);
 void rugged_parse_merge_file_options(git_merge_file_options *opts, VALUE rb_options);
@@ -124,6 +149,15 @@ void rugged_strarray_dispose(git_strarray *str_array);
 
 VALUE rugged_strarray_to_rb_ary(git_strarray *str_array);
 
+/**
+ * Create a read-only IO::Buffer pointing directly at +ptr+, without copying.
+ *
+ * The memory pointed to by +ptr+ must be owned by the object wrapped by
+ * +rb_owner+, which will be kept alive for as long as the buffer, or any
+ * slice of it, is. Raises NotImplementedError if IO::Buffer is missing.
+ */
+VALUE rugged_buffer_new_borrowed(VALUE rb_owner, const char *ptr, size_t len);
+
 #define CALLABLE_OR_RAISE(ret, name) \
 	do { \
 		if (!rb_respond_to(ret, rb_intern("call"))) \
@@ -148,6 +182,10 @@ static inline void rugged_exception_check(int errorcode)
 		rugged_exception_raise();
 }
 
+int rugged_check_ints_protect(void);
+void rugged_prefetch_shutdown(void);
+void rugged_prefetch_stop(git_repository *repo);
+
 static inline int rugged_parse_bool(VALUE boolean)
 {
 	if (TYPE(boolean) != T_TRUE && TYPE(boolean) != T_FALSE)
@@ -156,6 +194,99 @@ static inline int rugged_parse_bool(VALUE boolean)
 	return boolean ? 1 : 0;
 }
 
+#define RUGGED_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Read the +size+ option used by the chunked readers and writers,
+ * falling back to +RUGGED_DEFAULT_CHUNK_SIZE+.
+ */
+static inline size_t rugged_chunk_size_get(VALUE rb_options)
+{
+	VALUE rb_size;
+
+	if (NIL_P(rb_options))
+		return RUGGED_DEFAULT_CHUNK_SIZE;
+
+	rb_size = rb_hash_aref(rb_options, CSTR2SYM("size"));
+	if (NIL_P(rb_size))
+		return RUGGED_DEFAULT_CHUNK_SIZE;
+
+	Check_Type(rb_size, T_FIXNUM);
+	if (FIX2LONG(rb_size) <= 0)
+		rb_raise(rb_eArgError, "chunk size must be a positive integer");
+
+	return FIX2ULONG(rb_size);
+}
+
+/*
+ * Work items for rugged_parallel_run; called without the GVL, possibly
+ * from several threads at once.
+ */
+typedef int (*rugged_parallel_cb)(size_t index, void *payload);
+
+int rugged_parallel_run(rugged_parallel_cb cb, void *payload, size_t count, int threads);
+int rugged_parallel_threads_get(VALUE rb_threads);
+
+/*
+ * Bracket each unit of libgit2 work done by Rugged's own native threads,
+ * so that fork() can wait for it and the child inherits no libgit2 locks.
+ * Never from a Ruby thread: fork() waits here with the GVL held.
+ */
+void rugged_fork_gate_enter(void);
+void rugged_fork_gate_leave(void);
+
+/*
+ * Columnar export of patches, for Patch#to_columns and Diff#to_columns:
+ * every hunk header and line becomes one row, spread over a few packed
+ * Strings instead of a Ruby object per line.
+ */
+struct rugged_columns {
+	VALUE origins, old_lines, new_lines, offsets, content;
+};
+
+void rugged_columns_init(struct rugged_columns *columns);
+int rugged_columns_add_patch(struct rugged_columns *columns, git_patch *patch);
+VALUE rugged_columns_finish(struct rugged_columns *columns);
+
+/*
+ * Instrumentation: take a timestamp with rugged_instrument_start() before
+ * an operation and, if it returned non-zero, report it afterwards with
+ * rugged_instrument_emit(). Both must be called with the GVL held.
+ */
+extern int rugged_instrument_enabled;
+
+uint64_t rugged_instrument_clock(void);
+void rugged_instrument_publish(const char *event, uint64_t duration, VALUE rb_payload);
+
+static inline uint64_t rugged_instrument_start(void)
+{
+	return rugged_instrument_enabled ? rugged_instrument_clock() : 0;
+}
+
+static inline void rugged_instrument_emit(const char *event, uint64_t started, VALUE rb_payload)
+{
+	rugged_instrument_publish(event, rugged_instrument_clock() - started, rb_payload);
+}
+
+VALUE rugged_diff_instrument(const char *event, uint64_t started, VALUE rb_diff);
+
+/*
+ * An "odb.read" event. +cached+ must be sampled with rugged_odb_cached()
+ * before the read, which fills the cache; +type+ and +bytes+ only matter
+ * if the object was found, and +bytes+ is SIZE_MAX when it isn't known.
+ */
+struct rugged_odb_read_event {
+	uint64_t duration;
+	const git_oid *oid;
+	int cached;
+	int found;
+	git_otype type;
+	size_t bytes;
+};
+
+int rugged_odb_cached(git_repository *repo, const git_oid *oid, int raw);
+int rugged_odb_read_publish(const struct rugged_odb_read_event *event);
+
 extern VALUE rb_cRuggedRepo;
 
 VALUE rugged__block_yield_splat(VALUE args);
@@ -202,9 +333,30 @@ static inline void rugged_check_repo(VALUE rb_repo)
 		rb_raise(rb_eTypeError, "Expecting a Rugged Repository");
 }
 
+extern VALUE rb_cRuggedOid;
+extern int rugged_oid_format_object;
+
+VALUE rugged_oid_new(const git_oid *oid);
+
+/*
+ * Read a Rugged::Oid or a 40-character hex string into +oid+. Raises a
+ * TypeError for anything else; returns an error for invalid hex.
+ */
+int rugged_oid_from_value(git_oid *oid, VALUE rb_value);
+
+/*
+ * Copy +rb_value+ into +oid+ and return 1 if it is a Rugged::Oid,
+ * otherwise return 0.
+ */
+int rugged_oid_extract(git_oid *oid, VALUE rb_value);
+
 static inline VALUE rugged_create_oid(const git_oid *oid)
 {
 	char out[40];
+
+	if (rugged_oid_format_object)
+		return rugged_oid_new(oid);
+
 	git_oid_fmt(out, oid);
 	return rb_usascii_str_new(out, 40);
 }
@@ -216,5 +368,8 @@ typedef struct _rugged_backend {
 } rugged_backend;
 
 extern void rugged_set_allocator(void);
+extern void rugged_allocator_mode_set(VALUE rb_mode);
+extern VALUE rugged_allocator_mode_get(void);
+extern size_t rugged_allocator_pool_size(void);
 
 #endif
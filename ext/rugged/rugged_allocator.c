@@ -7,18 +7,451 @@
 
 #include "rugged.h"
 #include <git2/sys/alloc.h>
+#include <ruby/atomic.h>
+
+/* Only Ruby 3.3 and later have an atomic pointer load; a no-op CAS is one */
+#ifndef RUBY_ATOMIC_PTR_LOAD
+# define RUBY_ATOMIC_PTR_LOAD(var) RUBY_ATOMIC_PTR_CAS(var, NULL, NULL)
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+extern VALUE rb_mRugged;
+
+/*
+ * With RUGGED_ALLOCATOR=accounting or pool in the environment at startup,
+ * every block handed to libgit2 is prefixed with a small header recording
+ * its size and the call site it was accounted to, so that accounting can
+ * be switched on and off while allocations are live. Otherwise libgit2
+ * allocates straight through xmalloc, without the 16 bytes per block.
+ */
+struct rugged_alloc_header {
+	size_t size;
+	unsigned int site;
+	unsigned int pool_class;
+};
+
+#define RUGGED_ALLOC_HEADER_SIZE 16
+#define RUGGED_ALLOC_MAX_SITES 512
+
+struct rugged_alloc_site {
+	const char *file;
+	size_t live_bytes;
+	size_t live_count;
+	size_t allocations;
+	size_t allocated_bytes;
+	size_t peak_bytes;
+};
+
+static struct rugged_alloc_site alloc_sites[RUGGED_ALLOC_MAX_SITES];
+static int alloc_headers = 0;
+static volatile int alloc_tracking = 0;
+static volatile int alloc_pool = 0;
+
+static inline struct rugged_alloc_header *rugged_alloc_header(void *ptr)
+{
+	return (struct rugged_alloc_header *)((char *)ptr - RUGGED_ALLOC_HEADER_SIZE);
+}
+
+/*
+ * Find or claim the slot for +file+. libgit2 passes __FILE__, so the
+ * pointer itself is a good enough key. Slots are never released; once
+ * the table is full, new files are accounted to the last slot.
+ */
+static unsigned int rugged_alloc_site_get(const char *file)
+{
+	size_t i, start = ((size_t)file >> 4) % (RUGGED_ALLOC_MAX_SITES - 1);
+
+	for (i = 0; i < RUGGED_ALLOC_MAX_SITES - 1; ++i) {
+		size_t idx = (start + i) % (RUGGED_ALLOC_MAX_SITES - 1);
+		struct rugged_alloc_site *site = &alloc_sites[idx];
+		const char *current = RUBY_ATOMIC_PTR_LOAD(site->file);
+
+		if (current == NULL)
+			current = RUBY_ATOMIC_PTR_CAS(site->file, NULL, file);
+
+		if (current == NULL || current == file)
+			return (unsigned int)idx + 1;
+	}
+
+	alloc_sites[RUGGED_ALLOC_MAX_SITES - 1].file = "(other)";
+	return RUGGED_ALLOC_MAX_SITES;
+}
+
+static void rugged_alloc_site_grow(unsigned int site_id, size_t bytes, int new_block)
+{
+	struct rugged_alloc_site *site = &alloc_sites[site_id - 1];
+	size_t live, peak;
+
+	if (new_block) {
+		RUBY_ATOMIC_SIZE_INC(site->live_count);
+		RUBY_ATOMIC_SIZE_INC(site->allocations);
+	}
+
+	RUBY_ATOMIC_SIZE_ADD(site->allocated_bytes, bytes);
+	RUBY_ATOMIC_SIZE_ADD(site->live_bytes, bytes);
+
+	live = site->live_bytes;
+	while ((peak = site->peak_bytes) < live) {
+		if (RUBY_ATOMIC_SIZE_CAS(site->peak_bytes, peak, live) == peak)
+			break;
+	}
+}
+
+static void rugged_alloc_site_shrink(unsigned int site_id, size_t bytes, int freed_block)
+{
+	struct rugged_alloc_site *site = &alloc_sites[site_id - 1];
+
+	if (freed_block)
+		RUBY_ATOMIC_SIZE_DEC(site->live_count);
+
+	RUBY_ATOMIC_SIZE_SUB(site->live_bytes, bytes);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ * The pool allocator serves small blocks (header included) from per-thread
+ * free lists, carved out of slabs obtained straight from malloc. Only slab
+ * growth is reported to Ruby's GC, instead of every single allocation.
+ *
+ * Slabs are never returned to the system. Blocks freed from a thread other
+ * than the one that allocated them simply join the freeing thread's lists;
+ * lists that grow too long, and those of exiting threads, are handed over
+ * to a shared depot.
+ */
+#define RUGGED_POOL_SLAB_SIZE (256 * 1024)
+#define RUGGED_POOL_CACHE_LIMIT 1024
+#define RUGGED_POOL_BATCH 128
+
+static const size_t pool_class_sizes[] = { 32, 64, 96, 128, 192, 256, 384, 512 };
+
+#define RUGGED_POOL_CLASSES (sizeof(pool_class_sizes) / sizeof(pool_class_sizes[0]))
+#define RUGGED_POOL_MAX_SIZE 512
+
+struct rugged_pool_block {
+	struct rugged_pool_block *next;
+};
+
+struct rugged_pool_cache {
+	struct rugged_pool_block *free[RUGGED_POOL_CLASSES];
+	size_t count[RUGGED_POOL_CLASSES];
+	char *slab;
+	size_t slab_left;
+};
+
+static pthread_key_t pool_cache_key;
+static pthread_mutex_t pool_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rugged_pool_block *pool_depot[RUGGED_POOL_CLASSES];
+static size_t pool_slab_bytes;
+
+static unsigned int rugged_pool_class(size_t total)
+{
+	unsigned int cls = 0;
+
+	while (pool_class_sizes[cls] < total)
+		cls++;
+
+	return cls;
+}
+
+static void rugged_pool_depot_push(unsigned int cls, struct rugged_pool_block *head, struct rugged_pool_block *tail)
+{
+	pthread_mutex_lock(&pool_depot_lock);
+	tail->next = pool_depot[cls];
+	pool_depot[cls] = head;
+	pthread_mutex_unlock(&pool_depot_lock);
+}
+
+static void rugged_pool_cache_release(void *_cache)
+{
+	struct rugged_pool_cache *cache = (struct rugged_pool_cache *)_cache;
+	unsigned int cls;
+
+	for (cls = 0; cls < RUGGED_POOL_CLASSES; ++cls) {
+		struct rugged_pool_block *tail = cache->free[cls];
+
+		if (tail == NULL)
+			continue;
+
+		while (tail->next)
+			tail = tail->next;
+
+		rugged_pool_depot_push(cls, cache->free[cls], tail);
+	}
+
+	/* Don't lose what's left of the current slab */
+	cls = RUGGED_POOL_CLASSES;
+	while (cls-- > 0) {
+		while (cache->slab_left >= pool_class_sizes[cls]) {
+			struct rugged_pool_block *block = (struct rugged_pool_block *)cache->slab;
+
+			cache->slab += pool_class_sizes[cls];
+			cache->slab_left -= pool_class_sizes[cls];
+			rugged_pool_depot_push(cls, block, block);
+		}
+	}
+
+	free(cache);
+}
+
+static struct rugged_pool_cache *rugged_pool_cache_get(void)
+{
+	struct rugged_pool_cache *cache = pthread_getspecific(pool_cache_key);
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct rugged_pool_cache));
+		if (cache != NULL && pthread_setspecific(pool_cache_key, cache) != 0) {
+			free(cache);
+			cache = NULL;
+		}
+	}
+
+	return cache;
+}
+
+static struct rugged_pool_block *rugged_pool_refill(struct rugged_pool_cache *cache, unsigned int cls)
+{
+	struct rugged_pool_block *head, *tail;
+	size_t n = 1;
+
+	pthread_mutex_lock(&pool_depot_lock);
+
+	if ((head = pool_depot[cls]) != NULL) {
+		for (tail = head; tail->next && n < RUGGED_POOL_BATCH; tail = tail->next)
+			n++;
+
+		pool_depot[cls] = tail->next;
+		tail->next = NULL;
+	}
+
+	pthread_mutex_unlock(&pool_depot_lock);
+
+	if (head) {
+		cache->free[cls] = head->next;
+		cache->count[cls] = n - 1;
+		return head;
+	}
+
+	if (cache->slab_left < pool_class_sizes[cls]) {
+		char *slab = malloc(RUGGED_POOL_SLAB_SIZE);
+
+		if (slab == NULL)
+			return NULL;
+
+		/* The tail of the previous slab is small; it's not worth keeping */
+		cache->slab = slab;
+		cache->slab_left = RUGGED_POOL_SLAB_SIZE;
+
+		RUBY_ATOMIC_SIZE_ADD(pool_slab_bytes, RUGGED_POOL_SLAB_SIZE);
+		rb_gc_adjust_memory_usage(RUGGED_POOL_SLAB_SIZE);
+	}
+
+	head = (struct rugged_pool_block *)cache->slab;
+	cache->slab += pool_class_sizes[cls];
+	cache->slab_left -= pool_class_sizes[cls];
+
+	return head;
+}
+
+static struct rugged_alloc_header *rugged_pool_alloc(size_t total)
+{
+	struct rugged_pool_cache *cache = rugged_pool_cache_get();
+	struct rugged_pool_block *block;
+	struct rugged_alloc_header *header;
+	unsigned int cls = rugged_pool_class(total);
+
+	if (cache == NULL)
+		return NULL;
+
+	if ((block = cache->free[cls]) != NULL) {
+		cache->free[cls] = block->next;
+		cache->count[cls]--;
+	} else if ((block = rugged_pool_refill(cache, cls)) == NULL) {
+		return NULL;
+	}
+
+	header = (struct rugged_alloc_header *)block;
+	header->pool_class = cls + 1;
+
+	return header;
+}
+
+static void rugged_pool_free(struct rugged_alloc_header *header)
+{
+	struct rugged_pool_cache *cache = rugged_pool_cache_get();
+	struct rugged_pool_block *block = (struct rugged_pool_block *)header;
+	unsigned int cls = header->pool_class - 1;
+
+	if (cache == NULL) {
+		rugged_pool_depot_push(cls, block, block);
+		return;
+	}
+
+	block->next = cache->free[cls];
+	cache->free[cls] = block;
+
+	if (++cache->count[cls] > RUGGED_POOL_CACHE_LIMIT) {
+		struct rugged_pool_block *tail = block;
+		size_t n;
+
+		for (n = 1; n < RUGGED_POOL_CACHE_LIMIT / 2; ++n)
+			tail = tail->next;
+
+		cache->free[cls] = tail->next;
+		cache->count[cls] -= n;
+		rugged_pool_depot_push(cls, block, tail);
+	}
+}
+
+/*
+ * Keep the depot consistent across fork(): the child only inherits the
+ * forking thread, so a lock held by any other thread would never be
+ * released. The free lists of those threads are lost to the child.
+ */
+static void rugged_pool_atfork_prepare(void)
+{
+	pthread_mutex_lock(&pool_depot_lock);
+}
+
+static void rugged_pool_atfork_parent(void)
+{
+	pthread_mutex_unlock(&pool_depot_lock);
+}
+
+static void rugged_pool_atfork_child(void)
+{
+	pthread_mutex_init(&pool_depot_lock, NULL);
+}
+
+#endif
+
+static struct rugged_alloc_header *rugged_block_alloc(size_t total)
+{
+	struct rugged_alloc_header *header;
+
+#ifdef HAVE_PTHREAD_H
+	if (alloc_pool && total <= RUGGED_POOL_MAX_SIZE &&
+		(header = rugged_pool_alloc(total)) != NULL)
+		return header;
+#endif
+
+	header = xmalloc(total);
+	header->pool_class = 0;
+
+	return header;
+}
+
+static void rugged_block_free(struct rugged_alloc_header *header)
+{
+#ifdef HAVE_PTHREAD_H
+	if (header->pool_class) {
+		rugged_pool_free(header);
+		return;
+	}
+#endif
+
+	xfree(header);
+}
+
+static struct rugged_alloc_header *rugged_block_realloc(struct rugged_alloc_header *header, size_t total)
+{
+#ifdef HAVE_PTHREAD_H
+	if (header->pool_class) {
+		struct rugged_alloc_header *new_header;
+		size_t capacity = pool_class_sizes[header->pool_class - 1];
+		unsigned int pool_class;
+
+		if (total <= capacity)
+			return header;
+
+		new_header = rugged_block_alloc(total);
+		pool_class = new_header->pool_class;
+
+		memcpy(new_header, header, capacity);
+		new_header->pool_class = pool_class;
+
+		rugged_pool_free(header);
+		return new_header;
+	}
+#endif
+
+	return xrealloc(header, total);
+}
 
 static void *rugged_gmalloc(size_t n, const char *file, int line)
 {
-	return xmalloc(n);
+	struct rugged_alloc_header *header;
+
+	if (n > SIZE_MAX - RUGGED_ALLOC_HEADER_SIZE)
+		return NULL;
+
+	header = rugged_block_alloc(n + RUGGED_ALLOC_HEADER_SIZE);
+	header->size = n;
+	header->site = 0;
+
+	if (alloc_tracking && file) {
+		header->site = rugged_alloc_site_get(file);
+		rugged_alloc_site_grow(header->site, n, 1);
+	}
+
+	return (char *)header + RUGGED_ALLOC_HEADER_SIZE;
 }
 
 static void *rugged_grealloc(void *ptr, size_t size, const char *file, int line)
 {
-	return xrealloc(ptr, size);
+	struct rugged_alloc_header *header;
+	size_t old_size;
+
+	if (ptr == NULL)
+		return rugged_gmalloc(size, file, line);
+
+	if (size > SIZE_MAX - RUGGED_ALLOC_HEADER_SIZE)
+		return NULL;
+
+	old_size = rugged_alloc_header(ptr)->size;
+	header = rugged_block_realloc(rugged_alloc_header(ptr), size + RUGGED_ALLOC_HEADER_SIZE);
+	header->size = size;
+
+	/* Reallocated blocks stay accounted to the site that created them */
+	if (header->site) {
+		if (size > old_size)
+			rugged_alloc_site_grow(header->site, size - old_size, 0);
+		else
+			rugged_alloc_site_shrink(header->site, old_size - size, 0);
+	}
+
+	return (char *)header + RUGGED_ALLOC_HEADER_SIZE;
 }
 
 static void rugged_gfree(void *ptr)
+{
+	struct rugged_alloc_header *header;
+
+	if (ptr == NULL)
+		return;
+
+	header = rugged_alloc_header(ptr);
+
+	if (header->site)
+		rugged_alloc_site_shrink(header->site, header->size, 1);
+
+	rugged_block_free(header);
+}
+
+static void *rugged_plain_gmalloc(size_t n, const char *file, int line)
+{
+	return xmalloc(n);
+}
+
+static void *rugged_plain_grealloc(void *ptr, size_t size, const char *file, int line)
+{
+	return xrealloc(ptr, size);
+}
+
+static void rugged_plain_gfree(void *ptr)
 {
 	xfree(ptr);
 }
@@ -26,6 +459,28 @@ static void rugged_gfree(void *ptr)
 void rugged_set_allocator(void)
 {
 	git_allocator allocator;
+	const char *mode = getenv("RUGGED_ALLOCATOR");
+
+	assert(sizeof(struct rugged_alloc_header) <= RUGGED_ALLOC_HEADER_SIZE);
+
+	if (mode && (strcmp(mode, "accounting") == 0 || strcmp(mode, "pool") == 0))
+		alloc_headers = 1;
+
+	if (!alloc_headers) {
+		allocator.gmalloc = rugged_plain_gmalloc;
+		allocator.grealloc = rugged_plain_grealloc;
+		allocator.gfree = rugged_plain_gfree;
+
+		git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &allocator);
+		return;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_key_create(&pool_cache_key, rugged_pool_cache_release);
+	pthread_atfork(rugged_pool_atfork_prepare, rugged_pool_atfork_parent, rugged_pool_atfork_child);
+
+	alloc_pool = strcmp(mode, "pool") == 0;
+#endif
 
 	allocator.gmalloc = rugged_gmalloc;
 	allocator.grealloc = rugged_grealloc;
@@ -33,3 +488,190 @@ void rugged_set_allocator(void)
 
 	git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &allocator);
 }
+
+/*
+ * Switch between the allocator modes selectable through
+ * Rugged::Settings['allocator']. Blocks remember where they came from,
+ * so the mode can be changed at any time, provided that blocks have
+ * headers at all.
+ */
+void rugged_allocator_mode_set(VALUE rb_mode)
+{
+	if (rb_mode == CSTR2SYM("ruby")) {
+		alloc_pool = 0;
+	} else if (rb_mode == CSTR2SYM("pool")) {
+#ifdef HAVE_PTHREAD_H
+		if (!alloc_headers)
+			rb_raise(rb_eNotImpError, "the pool allocator must be enabled at startup with RUGGED_ALLOCATOR=pool");
+
+		alloc_pool = 1;
+#else
+		rb_raise(rb_eNotImpError, "the pool allocator is not supported on this platform");
+#endif
+	} else {
+		rb_raise(rb_eArgError, "Invalid allocator. Expected `:ruby` or `:pool`");
+	}
+}
+
+VALUE rugged_allocator_mode_get(void)
+{
+	return alloc_pool ? CSTR2SYM("pool") : CSTR2SYM("ruby");
+}
+
+size_t rugged_allocator_pool_size(void)
+{
+#ifdef HAVE_PTHREAD_H
+	return pool_slab_bytes;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * libgit2 reports absolute build paths; keep them relative to its
+ * source tree when we can.
+ */
+static VALUE rugged_alloc_site_name(const char *file)
+{
+	const char *src = strstr(file, "src/");
+	const char *next;
+
+	while (src && (next = strstr(src + 1, "src/")) != NULL)
+		src = next;
+
+	return rb_str_new_utf8(src ? src : file);
+}
+
+/*
+ *  call-seq:
+ *    Rugged.allocation_tracking = true or false
+ *
+ *  Enable or disable accounting of the memory libgit2 allocates. While
+ *  enabled, every allocation is attributed to the libgit2 source file that
+ *  requested it; see Rugged.allocation_stats.
+ *
+ *  Allocations made while tracking was disabled are never accounted for,
+ *  even after it gets enabled again.
+ *
+ *  Tracking needs every allocation to carry a small header, which is only
+ *  the case when the process was started with +RUGGED_ALLOCATOR+ set to
+ *  +accounting+ (or +pool+) in its environment. Otherwise enabling it
+ *  raises NotImplementedError.
+ */
+static VALUE rb_git_set_allocation_tracking(VALUE self, VALUE rb_enabled)
+{
+	if (RTEST(rb_enabled) && !alloc_headers)
+		rb_raise(rb_eNotImpError, "allocation tracking must be enabled at startup with RUGGED_ALLOCATOR=accounting");
+
+	alloc_tracking = RTEST(rb_enabled) ? 1 : 0;
+	return rb_enabled;
+}
+
+/*
+ *  call-seq:
+ *    Rugged.allocation_tracking? -> true or false
+ *
+ *  Return whether libgit2 allocations are currently being accounted for.
+ */
+static VALUE rb_git_get_allocation_tracking(VALUE self)
+{
+	return alloc_tracking ? Qtrue : Qfalse;
+}
+
+static void rugged_alloc_stats_add(VALUE rb_stats, const char *key, size_t value)
+{
+	VALUE rb_key = CSTR2SYM(key);
+	VALUE rb_value = rb_hash_lookup2(rb_stats, rb_key, INT2FIX(0));
+
+	rb_hash_aset(rb_stats, rb_key, SIZET2NUM(NUM2SIZET(rb_value) + value));
+}
+
+/*
+ *  call-seq:
+ *    Rugged.allocation_stats -> hash
+ *
+ *  Return the memory accounted to each libgit2 source file since tracking
+ *  was enabled, as a Hash keyed by path. Each value is a Hash with:
+ *
+ *  :live_bytes ::
+ *    Bytes currently allocated.
+ *
+ *  :live_count ::
+ *    Number of blocks currently allocated.
+ *
+ *  :allocations ::
+ *    Total number of allocations.
+ *
+ *  :allocated_bytes ::
+ *    Total number of bytes allocated, including growth through realloc.
+ *
+ *  :peak_bytes ::
+ *    High-water mark of +:live_bytes+.
+ *
+ *    Rugged.allocation_tracking = true
+ *    repo.diff("HEAD~", "HEAD").patch
+ *    Rugged.allocation_stats["src/libgit2/diff_generate.c"]
+ *    #=> {:live_bytes=>0, :live_count=>0, :allocations=>812, ...}
+ */
+static VALUE rb_git_allocation_stats(VALUE self)
+{
+	VALUE rb_result = rb_hash_new();
+	size_t i;
+
+	for (i = 0; i < RUGGED_ALLOC_MAX_SITES; ++i) {
+		struct rugged_alloc_site *site = &alloc_sites[i];
+		const char *file = RUBY_ATOMIC_PTR_LOAD(site->file);
+		VALUE rb_name, rb_stats;
+
+		if (file == NULL || (site->allocations == 0 && site->live_count == 0))
+			continue;
+
+		/* The same file may have been seen through different pointers */
+		rb_name = rugged_alloc_site_name(file);
+		rb_stats = rb_hash_lookup(rb_result, rb_name);
+
+		if (NIL_P(rb_stats)) {
+			rb_stats = rb_hash_new();
+			rb_hash_aset(rb_result, rb_name, rb_stats);
+		}
+
+		rugged_alloc_stats_add(rb_stats, "live_bytes", site->live_bytes);
+		rugged_alloc_stats_add(rb_stats, "live_count", site->live_count);
+		rugged_alloc_stats_add(rb_stats, "allocations", site->allocations);
+		rugged_alloc_stats_add(rb_stats, "allocated_bytes", site->allocated_bytes);
+		rugged_alloc_stats_add(rb_stats, "peak_bytes", site->peak_bytes);
+	}
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    Rugged.reset_allocation_stats -> nil
+ *
+ *  Reset the allocation counters and bring every high-water mark down to
+ *  the current live size. Live bytes and blocks are left untouched, so
+ *  memory freed after the reset is still accounted correctly.
+ */
+static VALUE rb_git_reset_allocation_stats(VALUE self)
+{
+	size_t i;
+
+	for (i = 0; i < RUGGED_ALLOC_MAX_SITES; ++i) {
+		struct rugged_alloc_site *site = &alloc_sites[i];
+
+		RUBY_ATOMIC_SIZE_EXCHANGE(site->allocations, 0);
+		RUBY_ATOMIC_SIZE_EXCHANGE(site->allocated_bytes, 0);
+		RUBY_ATOMIC_SIZE_EXCHANGE(site->peak_bytes, site->live_bytes);
+	}
+
+	return Qnil;
+}
+
+void Init_rugged_allocator(void)
+{
+	rb_define_module_function(rb_mRugged, "allocation_tracking=", rb_git_set_allocation_tracking, 1);
+	rb_define_module_function(rb_mRugged, "allocation_tracking?", rb_git_get_allocation_tracking, 0);
+	rb_define_module_function(rb_mRugged, "allocation_stats", rb_git_allocation_stats, 0);
+	rb_define_module_function(rb_mRugged, "reset_allocation_stats", rb_git_reset_allocation_stats, 0);
+}
@@ -90,10 +90,19 @@ static void rb_git_blame__free(void *data)
 	git_blame_free(blame);
 }
 
+static size_t rb_git_blame__size(const void *data)
+{
+	git_blame *blame = (git_blame *) data;
+
+	/* Each hunk owns its signatures and path on top of the struct itself */
+	return git_blame_get_hunk_count(blame) * (sizeof(git_blame_hunk) + 128);
+}
+
 const rb_data_type_t rugged_blame_type = {
 	.wrap_struct_name = "Rugged::Blame",
 	.function = {
 		.dfree = rb_git_blame__free,
+		.dsize = rb_git_blame__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -143,10 +152,11 @@ const rb_data_type_t rugged_blame_type = {
  */
 static VALUE rb_git_blame_new(int argc, VALUE *argv, VALUE klass)
 {
-	VALUE rb_repo, rb_path, rb_options;
+	VALUE rb_repo, rb_path, rb_options, rb_blame;
 	git_repository *repo;
 	git_blame *blame;
 	git_blame_options opts = GIT_BLAME_OPTIONS_INIT;
+	uint64_t started = rugged_instrument_start();
 
 	rb_scan_args(argc, argv, "20:", &rb_repo, &rb_path, &rb_options);
 
@@ -161,7 +171,16 @@ static VALUE rb_git_blame_new(int argc, VALUE *argv, VALUE klass)
 		&blame, repo, StringValueCStr(rb_path), &opts
 	));
 
-	return TypedData_Wrap_Struct(klass, &rugged_blame_type, blame);
+	rb_blame = TypedData_Wrap_Struct(klass, &rugged_blame_type, blame);
+
+	if (started) {
+		VALUE rb_payload = rb_hash_new();
+		rb_hash_aset(rb_payload, CSTR2SYM("path"), rb_path);
+		rb_hash_aset(rb_payload, CSTR2SYM("hunks"), UINT2NUM(git_blame_get_hunk_count(blame)));
+		rugged_instrument_emit("blame", started, rb_payload);
+	}
+
+	return rb_blame;
 }
 
 /*
@@ -7,7 +7,14 @@
 
 #include "rugged.h"
 #include <ctype.h>
+#include <errno.h>
 #include <git2/sys/hashsig.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 extern VALUE rb_mRugged;
 extern VALUE rb_cRuggedObject;
@@ -74,22 +81,29 @@ static VALUE rb_git_blob_text_GET(int argc, VALUE *argv, VALUE self)
 /*
  *  call-seq:
  *    blob.content(max_bytes=-1) -> string
+ *    blob.content(max_bytes=-1, buffer: true) -> io_buffer
  *
  *  Return up to +max_bytes+ from the contents of a blob as bytes +String+.
  *  If +max_bytes+ is less than 0, the full string is returned.
  *
  *  This string is tagged with the ASCII-8BIT encoding: the bytes are
  *  returned as-is, since Git is encoding agnostic.
+ *
+ *  If +buffer+ is +true+, a read-only IO::Buffer pointing directly at the
+ *  blob's contents is returned instead of a String, which would have to be
+ *  a copy; +blob+ is kept alive for as long as the buffer, or any slice of
+ *  it, is. This requires Ruby 3.1 or later, and raises NotImplementedError
+ *  otherwise.
  */
 static VALUE rb_git_blob_content_GET(int argc, VALUE *argv, VALUE self)
 {
 	git_blob *blob;
 	size_t size;
 	const char *content;
-	VALUE rb_max_bytes;
+	VALUE rb_max_bytes, rb_options;
 
 	TypedData_Get_Struct(self, git_blob, &rugged_object_type, blob);
-	rb_scan_args(argc, argv, "01", &rb_max_bytes);
+	rb_scan_args(argc, argv, "01:", &rb_max_bytes, &rb_options);
 
 	content = git_blob_rawcontent(blob);
 	size = git_blob_rawsize(blob);
@@ -104,6 +118,9 @@ static VALUE rb_git_blob_content_GET(int argc, VALUE *argv, VALUE self)
 			size = (size_t)maxbytes;
 	}
 
+	if (!NIL_P(rb_options) && RTEST(rb_hash_aref(rb_options, CSTR2SYM("buffer"))))
+		return rugged_buffer_new_borrowed(self, content, size);
+
 	/*
 	 * since we don't really ever know the encoding of a blob
 	 * lets default to the binary encoding (ascii-8bit)
@@ -111,6 +128,46 @@ static VALUE rb_git_blob_content_GET(int argc, VALUE *argv, VALUE self)
 	return rb_str_new(content, size);
 }
 
+/*
+ *  call-seq:
+ *    blob.each_chunk(size: 65536) { |chunk| block } -> nil
+ *    blob.each_chunk(size: 65536) -> Enumerator
+ *
+ *  Yield the contents of the blob to +block+ in binary Strings of
+ *  at most +size+ bytes, so that it can be written out without building
+ *  a single String for the whole blob.
+ *
+ *  This does not bound memory use: a Blob always holds its whole contents,
+ *  which libgit2 inflated when it was looked up. Rugged::Repository#read_stream
+ *  avoids that for objects not stored as deltas.
+ */
+static VALUE rb_git_blob_each_chunk(int argc, VALUE *argv, VALUE self)
+{
+	git_blob *blob;
+	const char *content;
+	size_t offset, size, chunk_size;
+	VALUE rb_options;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "00:", &rb_options);
+
+	TypedData_Get_Struct(self, git_blob, &rugged_object_type, blob);
+	chunk_size = rugged_chunk_size_get(rb_options);
+
+	content = git_blob_rawcontent(blob);
+	size = git_blob_rawsize(blob);
+
+	for (offset = 0; offset < size; offset += chunk_size) {
+		size_t len = size - offset;
+		if (len > chunk_size)
+			len = chunk_size;
+
+		rb_yield(rb_str_new(content + offset, len));
+	}
+
+	return Qnil;
+}
+
 /*
  *  call-seq:
  *    blob.rawsize -> int
@@ -217,6 +274,119 @@ static VALUE rb_read_check(VALUE pointer) {
 	return rb_buffer;
 }
 
+struct nogvl_blob_from_fd_args {
+	git_writestream *stream;
+	int fd;
+	char *buffer;
+	size_t buffer_size;
+	int eof;
+	int read_errno;
+	int error;
+};
+
+/*
+ * Pump data from the file descriptor into the blob stream until EOF,
+ * a libgit2 error, or a failed read(2). Runs without the GVL.
+ */
+static void *rb_git_blob_from_fd_nogvl(void *_args)
+{
+	struct nogvl_blob_from_fd_args *args = (struct nogvl_blob_from_fd_args *)_args;
+
+	args->read_errno = 0;
+	args->error = 0;
+
+	for (;;) {
+		ssize_t n = read(args->fd, args->buffer, args->buffer_size);
+
+		if (n < 0) {
+			args->read_errno = errno;
+			break;
+		}
+
+		if (n == 0) {
+			args->eof = 1;
+			break;
+		}
+
+		args->error = args->stream->write(args->stream, args->buffer, (size_t)n);
+		if (args->error < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static VALUE rb_git_blob_wait_readable(VALUE rb_fd)
+{
+	rb_thread_wait_fd(FIX2INT(rb_fd));
+	return Qnil;
+}
+
+/*
+ * Write a blob from +fd+, which must be a descriptor of our own: it is read
+ * without the GVL, and closed once done.
+ */
+static VALUE rb_git_blob_from_fd(git_repository *repo, int fd, const char *hint_path)
+{
+	struct nogvl_blob_from_fd_args args;
+	git_oid oid;
+	int error, exception = 0;
+
+	error = git_blob_create_fromstream(&args.stream, repo, hint_path);
+	if (error < 0) {
+		close(fd);
+		rugged_exception_check(error);
+	}
+
+	args.fd = fd;
+	args.buffer_size = RUGGED_DEFAULT_CHUNK_SIZE;
+	args.buffer = xmalloc(args.buffer_size);
+	args.eof = 0;
+	args.read_errno = 0;
+	args.error = 0;
+
+	while (!args.eof) {
+		/* Nothing is read if the call is skipped for a pending interrupt */
+		args.read_errno = 0;
+		rb_thread_call_without_gvl2(rb_git_blob_from_fd_nogvl, &args, RUBY_UBF_IO, NULL);
+
+		if (args.error < 0)
+			break;
+
+		/* A pending interrupt may raise; the stream must be freed first */
+		if ((exception = rugged_check_ints_protect()) != 0)
+			break;
+
+		if (args.read_errno == EAGAIN || args.read_errno == EWOULDBLOCK) {
+			rb_protect(rb_git_blob_wait_readable, INT2FIX(fd), &exception);
+			if (exception)
+				break;
+		} else if (args.read_errno && args.read_errno != EINTR) {
+			break;
+		}
+	}
+
+	xfree(args.buffer);
+	close(fd);
+
+	if (!args.eof) {
+		args.stream->free(args.stream);
+
+		if (exception)
+			rb_jump_tag(exception);
+
+		if (args.read_errno)
+			rb_syserr_fail(args.read_errno, "read");
+
+		rugged_exception_check(args.error);
+	}
+
+	error = git_blob_create_fromstream_commit(&oid, args.stream);
+	rugged_exception_check(error);
+
+	return rugged_create_oid(&oid);
+}
+
 /*
  *  call-seq:
  *    Blob.from_io(repository, io [, hint_path]) -> oid
@@ -238,6 +408,11 @@ static VALUE rb_read_check(VALUE pointer) {
  *  will help to determine what git filters should be applied
  *  to the object before it can be placed to the object database.
  *
+ *  If +io+ is a real +IO+ (ex. a +File+ or a socket) with no data
+ *  buffered on the Ruby side, its file descriptor is read directly
+ *  without holding the GVL, and no Ruby Strings are allocated for the
+ *  data.
+ *
  *    File.open('/path/to/file') do |file|
  *      Blob.from_io(repo, file, 'hint/blob.h') #=> '42cab3c0cde61e2b5a2392e1eadbeffa20ffa171'
  *    end
@@ -261,6 +436,26 @@ static VALUE rb_git_blob_from_io(int argc, VALUE *argv, VALUE klass)
 		hint_path = StringValueCStr(rb_hint_path);
 	}
 
+	if (RB_TYPE_P(rb_io, T_FILE)) {
+		rb_io_t *fptr;
+
+		GetOpenFile(rb_io, fptr);
+		rb_io_check_readable(fptr);
+
+		if (fptr->rbuf.len == 0) {
+			/*
+			 * Read from a duplicate descriptor, so that closing +io+
+			 * meanwhile can't leave us reading a reused one
+			 */
+			int fd = rb_cloexec_dup(fptr->fd);
+
+			if (fd < 0)
+				rb_sys_fail("dup");
+
+			return rb_git_blob_from_fd(repo, fd, hint_path);
+		}
+	}
+
 	error = git_blob_create_fromstream(&stream, repo, hint_path);
 	if (error)
 		goto cleanup;
@@ -558,7 +753,7 @@ static void rugged_parse_merge_file_input(rugged_merge_file_input *input, git_re
 		if (!repo)
 			rb_raise(rb_eArgError, "Rugged repository is required when file input is `:oid`.");
 
-		rugged_exception_check(git_oid_fromstr(&input->id, RSTRING_PTR(rb_value)));
+		rugged_exception_check(rugged_oid_from_value(&input->id, rb_value));
 		input->has_id = 1;
 	} else {
 		rb_raise(rb_eArgError, "File input must have `:content` or `:oid`.");
@@ -645,10 +840,17 @@ static void rb_git_hashsig__free(void *data)
 	git_hashsig_free(sig);
 }
 
+static size_t rb_git_hashsig__size(const void *data)
+{
+	/* Two fixed-size heaps of 128 hash values plus bookkeeping */
+	return 2 * 128 * sizeof(uint32_t) + 64;
+}
+
 const rb_data_type_t rugged_hashsig_type = {
 	.wrap_struct_name = "Rugged::Blob::HashSignature",
 	.function = {
 		.dfree = rb_git_hashsig__free,
+		.dsize = rb_git_hashsig__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -713,6 +915,7 @@ void Init_rugged_blob(void)
 
 	rb_define_method(rb_cRuggedBlob, "size", rb_git_blob_rawsize, 0);
 	rb_define_method(rb_cRuggedBlob, "content", rb_git_blob_content_GET, -1);
+	rb_define_method(rb_cRuggedBlob, "each_chunk", rb_git_blob_each_chunk, -1);
 	rb_define_method(rb_cRuggedBlob, "text", rb_git_blob_text_GET, -1);
 	rb_define_method(rb_cRuggedBlob, "sloc", rb_git_blob_sloc, 0);
 	rb_define_method(rb_cRuggedBlob, "loc", rb_git_blob_loc, 0);
@@ -466,10 +466,10 @@ static int parse_commit_options(struct commit_data *out, git_repository *repo, V
 		if (NIL_P(p))
 			continue;
 
-		if (TYPE(p) == T_STRING) {
+		if (TYPE(p) == T_STRING || rb_obj_is_kind_of(p, rb_cRuggedOid)) {
 			git_oid oid;
 
-			error = git_oid_fromstr(&oid, StringValueCStr(p));
+			error = rugged_oid_from_value(&oid, p);
 			if (error < GIT_OK)
 				goto out;
 
@@ -738,7 +738,7 @@ static VALUE rb_git_commit_extract_signature(int argc, VALUE *argv, VALUE self)
 	rugged_check_repo(rb_repo);
 	TypedData_Get_Struct(rb_repo, git_repository, &rugged_repository_type, repo);
 
-	error = git_oid_fromstr(&commit_id, StringValueCStr(rb_commit));
+	error = rugged_oid_from_value(&commit_id, rb_commit);
 	rugged_exception_check(error);
 
 	field = NIL_P(rb_field) ? NULL : StringValueCStr(rb_field);
@@ -16,10 +16,20 @@ void rb_git_config__free(void *data)
 	git_config_free(config);
 }
 
+static size_t rb_git_config__size(const void *data)
+{
+	/*
+	 * A placeholder, not an estimate: backends and parsed entries are
+	 * opaque, so this is what a small config takes.
+	 */
+	return 4096;
+}
+
 const rb_data_type_t rugged_config_type = {
 	.wrap_struct_name = "Rugged::config",
 	.function = {
 		.dfree = rb_git_config__free,
+		.dsize = rb_git_config__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
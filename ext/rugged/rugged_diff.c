@@ -6,8 +6,14 @@
  */
 
 #include "rugged.h"
+#include <ruby/thread.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 extern VALUE rb_mRugged;
+extern const rb_data_type_t rugged_repository_type;
 VALUE rb_cRuggedDiff;
 
 static void rb_git_diff__free(void *data)
@@ -16,10 +22,19 @@ static void rb_git_diff__free(void *data)
 	git_diff_free(diff);
 }
 
+static size_t rb_git_diff__size(const void *data)
+{
+	git_diff *diff = (git_diff *) data;
+
+	/* Every delta also owns (on average) short old and new paths */
+	return git_diff_num_deltas(diff) * (sizeof(git_diff_delta) + 64);
+}
+
 const rb_data_type_t rugged_diff_type = {
 	.wrap_struct_name = "Rugged::Diff",
 	.function = {
 		.dfree = rb_git_diff__free,
+		.dsize = rb_git_diff__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -31,6 +46,36 @@ VALUE rugged_diff_new(VALUE klass, VALUE owner, git_diff *diff)
 	return rb_diff;
 }
 
+/*
+ * Report the generation of +rb_diff+ to instrumentation subscribers, if
+ * +started+ says there were any when it began. Returns +rb_diff+.
+ */
+VALUE rugged_diff_instrument(const char *event, uint64_t started, VALUE rb_diff)
+{
+	git_diff *diff;
+	size_t i, ndeltas;
+	uint64_t bytes = 0;
+	VALUE rb_payload;
+
+	if (!started)
+		return rb_diff;
+
+	TypedData_Get_Struct(rb_diff, git_diff, &rugged_diff_type, diff);
+
+	ndeltas = git_diff_num_deltas(diff);
+	for (i = 0; i < ndeltas; ++i) {
+		const git_diff_delta *delta = git_diff_get_delta(diff, i);
+		bytes += delta->old_file.size + delta->new_file.size;
+	}
+
+	rb_payload = rb_hash_new();
+	rb_hash_aset(rb_payload, CSTR2SYM("deltas"), SIZET2NUM(ndeltas));
+	rb_hash_aset(rb_payload, CSTR2SYM("bytes"), ULL2NUM(bytes));
+
+	rugged_instrument_emit(event, started, rb_payload);
+	return rb_diff;
+}
+
 /**
  * The caller has to free the returned git_diff_options pathspec strings array.
  */
@@ -184,6 +229,235 @@ void rugged_parse_diff_options(git_diff_options *opts, VALUE rb_options)
 	}
 }
 
+static size_t rugged_diff_budget_limit(VALUE rb_options, const char *key)
+{
+	VALUE rb_value = rb_hash_aref(rb_options, CSTR2SYM(key));
+
+	if (NIL_P(rb_value))
+		return SIZE_MAX;
+
+	Check_Type(rb_value, T_FIXNUM);
+	if (FIX2LONG(rb_value) < 0)
+		rb_raise(rb_eArgError, "%s must not be negative", key);
+
+	return FIX2ULONG(rb_value);
+}
+
+/*
+ * Generation only stops adding deltas once the budget is spent, rather
+ * than aborting, so that the caller gets back everything found so far:
+ * libgit2 frees the whole diff when a notify callback fails. The price is
+ * that libgit2 still walks the rest of the trees or workdir, checking and
+ * skipping each remaining change, so neither limit bounds that walk.
+ */
+static int rugged_diff_budget_notify_cb(
+	const git_diff *diff,
+	const git_diff_delta *delta,
+	const char *matched_pathspec,
+	void *payload)
+{
+	struct rugged_diff_budget *budget = payload;
+
+	if (budget->truncated || budget->files >= budget->max_files ||
+		(budget->deadline && rugged_instrument_clock() >= budget->deadline)) {
+		budget->truncated = 1;
+		return 1;
+	}
+
+	budget->files++;
+	return 0;
+}
+
+/*
+ * Parse the budget options out of +rb_options+. The deadline starts now.
+ * If +opts+ is given, the file count and deadline also bound the
+ * generation of the diff itself.
+ */
+void rugged_parse_diff_budget(struct rugged_diff_budget *budget, git_diff_options *opts, VALUE rb_options)
+{
+	VALUE rb_value;
+
+	memset(budget, 0, sizeof(*budget));
+	budget->max_files = budget->max_lines = budget->max_total_bytes = SIZE_MAX;
+
+	if (NIL_P(rb_options))
+		return;
+
+	Check_Type(rb_options, T_HASH);
+
+	budget->max_files = rugged_diff_budget_limit(rb_options, "max_files");
+	budget->max_lines = rugged_diff_budget_limit(rb_options, "max_lines");
+	budget->max_total_bytes = rugged_diff_budget_limit(rb_options, "max_total_bytes");
+
+	rb_value = rb_hash_aref(rb_options, CSTR2SYM("deadline_ms"));
+	if (!NIL_P(rb_value)) {
+		Check_Type(rb_value, T_FIXNUM);
+		if (FIX2LONG(rb_value) < 0)
+			rb_raise(rb_eArgError, "deadline_ms must not be negative");
+
+		budget->deadline_ms = FIX2LONG(rb_value);
+		budget->deadline = rugged_instrument_clock() + (uint64_t)budget->deadline_ms * 1000000;
+	}
+
+	budget->enabled = budget->max_files != SIZE_MAX || budget->max_lines != SIZE_MAX ||
+		budget->max_total_bytes != SIZE_MAX || budget->deadline != 0;
+
+	if (opts && (budget->max_files != SIZE_MAX || budget->deadline)) {
+		opts->notify_cb = rugged_diff_budget_notify_cb;
+		opts->payload = budget;
+	}
+}
+
+/*
+ * Mark every delta of +rb_diff+ from +index+ on as having been left out
+ * of the current #each_patch. This only lasts until the next iteration;
+ * @truncated, on the other hand, records that the diff itself is
+ * incomplete, which never changes.
+ */
+static void rugged_diff_truncate(VALUE rb_diff, size_t index)
+{
+	VALUE rb_truncated = rb_attr_get(rb_diff, rb_intern("@patches_truncated"));
+
+	if (NIL_P(rb_truncated) || NUM2SIZET(rb_truncated) > index)
+		rb_iv_set(rb_diff, "@patches_truncated", SIZET2NUM(index));
+}
+
+/*
+ * Remember the limits of +budget+ on a newly generated +rb_diff+, so that
+ * they also apply to its patches, and whether generation was cut short.
+ * Returns +rb_diff+.
+ */
+VALUE rugged_diff_budget_attach(VALUE rb_diff, const struct rugged_diff_budget *budget)
+{
+	VALUE rb_budget;
+	git_diff *diff;
+
+	if (!budget->enabled)
+		return rb_diff;
+
+	rb_budget = rb_hash_new();
+
+	if (budget->max_files != SIZE_MAX)
+		rb_hash_aset(rb_budget, CSTR2SYM("max_files"), SIZET2NUM(budget->max_files));
+	if (budget->max_lines != SIZE_MAX)
+		rb_hash_aset(rb_budget, CSTR2SYM("max_lines"), SIZET2NUM(budget->max_lines));
+	if (budget->max_total_bytes != SIZE_MAX)
+		rb_hash_aset(rb_budget, CSTR2SYM("max_total_bytes"), SIZET2NUM(budget->max_total_bytes));
+	if (budget->deadline)
+		rb_hash_aset(rb_budget, CSTR2SYM("deadline_ms"), LONG2NUM(budget->deadline_ms));
+
+	rb_iv_set(rb_diff, "@budget", rb_budget);
+
+	/* The deltas that were left out don't exist; only the diff itself is incomplete */
+	if (budget->truncated) {
+		TypedData_Get_Struct(rb_diff, git_diff, &rugged_diff_type, diff);
+		rb_iv_set(rb_diff, "@truncated", SIZET2NUM(git_diff_num_deltas(diff)));
+	}
+
+	return rb_diff;
+}
+
+/*
+ * The budget for generating the patches of +self+: the one it was created
+ * with, overridden by any limits in +rb_options+.
+ */
+static void rugged_diff_patch_budget(struct rugged_diff_budget *budget, VALUE self, VALUE rb_options)
+{
+	VALUE rb_budget = rb_attr_get(self, rb_intern("@budget"));
+
+	if (!NIL_P(rb_budget) && !NIL_P(rb_options))
+		rb_budget = rb_funcall(rb_budget, rb_intern("merge"), 1, rb_options);
+	else if (NIL_P(rb_budget))
+		rb_budget = rb_options;
+
+	rugged_parse_diff_budget(budget, NULL, rb_budget);
+}
+
+/* Whether the patch for the next delta should not even be generated */
+static int rugged_diff_budget_spent(const struct rugged_diff_budget *budget)
+{
+	return budget->files >= budget->max_files ||
+		(budget->deadline && rugged_instrument_clock() >= budget->deadline);
+}
+
+/* What is left of the byte budget, or SIZE_MAX if there is none */
+static size_t rugged_diff_budget_bytes_left(const struct rugged_diff_budget *budget)
+{
+	if (budget->max_total_bytes == SIZE_MAX)
+		return SIZE_MAX;
+
+	return budget->max_total_bytes - budget->bytes;
+}
+
+/*
+ * Whether a side of +delta+ is larger than +bytes_left+, in which case its
+ * patch would likely go over the byte budget. This is checked before the
+ * patch is generated, so that a huge file isn't loaded and diffed only to
+ * be thrown away. Safe to call without the GVL.
+ */
+static int rugged_diff_delta_oversized(git_repository *repo, const git_diff_delta *delta, size_t bytes_left)
+{
+	const git_diff_file *files[2];
+	git_odb *odb = NULL;
+	int i, oversized = 0;
+
+	/* Binary patches don't include the contents */
+	if (bytes_left == SIZE_MAX || (delta->flags & GIT_DIFF_FLAG_BINARY))
+		return 0;
+
+	files[0] = &delta->old_file;
+	files[1] = &delta->new_file;
+
+	for (i = 0; i < 2 && !oversized; ++i) {
+		uint64_t size = files[i]->size;
+
+		/* Blobs of tree diffs don't come with their size */
+		if (size == 0 && repo && !git_oid_iszero(&files[i]->id)) {
+			size_t len;
+			git_otype type;
+
+			if (!odb && git_repository_odb(&odb, repo) < 0)
+				break;
+
+			if (git_odb_read_header(&len, &type, odb, &files[i]->id) == 0)
+				size = len;
+		}
+
+		oversized = size > bytes_left;
+	}
+
+	git_odb_free(odb);
+	giterr_clear();
+
+	return oversized;
+}
+
+/* Account for +patch+ against +budget+; returns 1 if it doesn't fit */
+static int rugged_diff_budget_consume(struct rugged_diff_budget *budget, git_patch *patch)
+{
+	size_t context = 0, additions = 0, deletions = 0, lines, bytes = 0;
+
+	if (budget->files >= budget->max_files)
+		return 1;
+
+	if (patch) {
+		git_patch_line_stats(&context, &additions, &deletions, patch);
+		bytes = git_patch_size(patch, 1, 1, 1);
+	}
+
+	lines = context + additions + deletions;
+
+	if (lines > budget->max_lines - budget->lines ||
+		bytes > budget->max_total_bytes - budget->bytes)
+		return 1;
+
+	budget->files++;
+	budget->lines += lines;
+	budget->bytes += bytes;
+
+	return 0;
+}
+
 static int diff_print_cb(
 	const git_diff_delta *delta,
 	const git_diff_hunk *hunk,
@@ -277,6 +551,30 @@ static VALUE rb_git_diff_write_patch(int argc, VALUE *argv, VALUE self)
 	return Qnil;
 }
 
+/*
+ * Work on the deltas of a diff that runs without the GVL marks the diff
+ * busy, so that merge! and find_similar!, which rebuild its delta list,
+ * can't pull it out from under that work from another Ruby thread.
+ */
+static void rugged_diff_busy_enter(VALUE rb_diff)
+{
+	VALUE rb_busy = rb_attr_get(rb_diff, rb_intern("@busy"));
+	rb_iv_set(rb_diff, "@busy", INT2FIX(NIL_P(rb_busy) ? 1 : FIX2INT(rb_busy) + 1));
+}
+
+static VALUE rugged_diff_busy_leave(VALUE rb_diff)
+{
+	int busy = FIX2INT(rb_attr_get(rb_diff, rb_intern("@busy"))) - 1;
+	rb_iv_set(rb_diff, "@busy", busy ? INT2FIX(busy) : Qnil);
+	return Qnil;
+}
+
+static void rugged_diff_check_idle(VALUE rb_diff)
+{
+	if (!NIL_P(rb_attr_get(rb_diff, rb_intern("@busy"))))
+		rb_raise(rb_eRuntimeError, "can't modify a diff while another thread is generating its patches");
+}
+
 /*
  *  call-seq:
  *    diff.merge!(other_diff) -> self
@@ -292,12 +590,20 @@ static VALUE rb_git_diff_merge(VALUE self, VALUE rb_other)
 	if (!rb_obj_is_kind_of(rb_other, rb_cRuggedDiff))
 		rb_raise(rb_eTypeError, "A Rugged::Diff instance is required");
 
+	rugged_diff_check_idle(self);
+
 	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
 	TypedData_Get_Struct(rb_other, git_diff, &rugged_diff_type, other);
 
 	error = git_diff_merge(diff, other);
 	rugged_exception_check(error);
 
+	/* Deltas get interleaved, so only the diff as a whole remains truncated */
+	if (!NIL_P(rb_attr_get(self, rb_intern("@truncated"))) ||
+		!NIL_P(rb_attr_get(rb_other, rb_intern("@truncated"))))
+		rb_iv_set(self, "@truncated", SIZET2NUM(git_diff_num_deltas(diff)));
+	rb_iv_set(self, "@patches_truncated", Qnil);
+
 	return self;
 }
 
@@ -365,6 +671,7 @@ static VALUE rb_git_diff_find_similar(int argc, VALUE *argv, VALUE self)
 	VALUE rb_options;
 	int error;
 
+	rugged_diff_check_idle(self);
 	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
 
 	rb_scan_args(argc, argv, "00:", &rb_options);
@@ -436,32 +743,426 @@ static VALUE rb_git_diff_find_similar(int argc, VALUE *argv, VALUE self)
 	error = git_diff_find_similar(diff, &opts);
 	rugged_exception_check(error);
 
+	/* Renames and copies may merge deltas and shift the rest */
+	if (!NIL_P(rb_attr_get(self, rb_intern("@truncated"))))
+		rb_iv_set(self, "@truncated", SIZET2NUM(git_diff_num_deltas(diff)));
+	rb_iv_set(self, "@patches_truncated", Qnil);
+
 	return self;
 }
 
+/*
+ * libgit2 loads the diff driver named by a `diff=<name>` attribute into a
+ * per-repository registry, which isn't safe to fill from several threads
+ * at once. Generate one patch per driver on this thread first, so that
+ * worker threads only ever find drivers that are already loaded.
+ *
+ * +rb_drivers+ is a Hash of the driver names that were already loaded.
+ */
+void rugged_diff_load_drivers(git_repository *repo, git_diff *diff, size_t offset, size_t count, VALUE rb_drivers)
+{
+	size_t i;
+
+	if (!repo)
+		return;
+
+	for (i = offset; i < offset + count; ++i) {
+		const git_diff_delta *delta = git_diff_get_delta(diff, i);
+		const char *paths[2] = { delta->old_file.path, delta->new_file.path };
+		int p;
+
+		for (p = 0; p < 2; ++p) {
+			const char *value;
+			VALUE rb_name;
+			git_patch *patch;
+
+			if (!paths[p] || git_attr_get(&value, repo, GIT_ATTR_CHECK_FILE_THEN_INDEX, paths[p], "diff") < 0) {
+				giterr_clear();
+				continue;
+			}
+
+			if (git_attr_value(value) != GIT_ATTR_VALUE_T)
+				continue;
+
+			rb_name = rb_str_new_cstr(value);
+			if (RTEST(rb_hash_aref(rb_drivers, rb_name)))
+				continue;
+
+			rb_hash_aset(rb_drivers, rb_name, Qtrue);
+
+			/* Errors will be reported when the workers get to this delta */
+			if (git_patch_from_diff(&patch, diff, i) < 0)
+				giterr_clear();
+			else
+				git_patch_free(patch);
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Workers run at most this many deltas per thread ahead of the patch being
+ * yielded, so that a huge diff never has more than a few patches waiting.
+ */
+#define RUGGED_DIFF_PATCH_QUEUE 16
+
+#define RUGGED_PATCH_PENDING 0
+#define RUGGED_PATCH_READY 1
+#define RUGGED_PATCH_SKIPPED 2
+#define RUGGED_PATCH_FAILED 3
+
+/*
+ * A pool of native threads generating the patches of a diff in delta
+ * order, into a ring of slots that the Ruby thread drains in the same
+ * order. Workers wait for a free slot, the Ruby thread for a filled one.
+ */
+struct rugged_patch_pool {
+	VALUE self;
+	git_diff *diff;
+	git_repository *repo;
+	struct rugged_diff_budget *budget;
+	uint64_t deadline;
+	size_t bytes_left;
+
+	size_t limit, capacity;
+	size_t next, yielded;
+	git_patch **slots;
+	char *states;
+
+	int stopped;
+	int interrupted;
+	int error;
+	int error_klass;
+	char error_message[512];
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready, space;
+	pthread_t *workers;
+	int threads, started;
+};
+
+static void *rugged_patch_pool_worker(void *_pool)
+{
+	struct rugged_patch_pool *pool = _pool;
+
+	for (;;) {
+		git_patch *patch = NULL;
+		size_t index, bytes_left;
+		int error = 0, state;
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stopped && pool->next < pool->limit &&
+			pool->next - pool->yielded >= pool->capacity)
+			pthread_cond_wait(&pool->space, &pool->lock);
+
+		if (pool->stopped || pool->next >= pool->limit) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		index = pool->next++;
+		bytes_left = pool->bytes_left;
+		pthread_mutex_unlock(&pool->lock);
+
+		rugged_fork_gate_enter();
+
+		/* Left undone, which truncates the iteration from here on */
+		if ((pool->deadline && rugged_instrument_clock() >= pool->deadline) ||
+			rugged_diff_delta_oversized(pool->repo, git_diff_get_delta(pool->diff, index), bytes_left)) {
+			state = RUGGED_PATCH_SKIPPED;
+		} else {
+			error = git_patch_from_diff(&patch, pool->diff, index);
+			state = error < 0 ? RUGGED_PATCH_FAILED : RUGGED_PATCH_READY;
+		}
+
+		rugged_fork_gate_leave();
+
+		pthread_mutex_lock(&pool->lock);
+		if (error < 0) {
+			/* libgit2 keeps its error state per thread */
+			const git_error *last = giterr_last();
+
+			pool->error = error;
+			if (last && last->message) {
+				pool->error_klass = last->klass;
+				strncpy(pool->error_message, last->message, sizeof(pool->error_message) - 1);
+			}
+		}
+
+		/* Deltas before this one were all claimed already, and will finish */
+		if (state != RUGGED_PATCH_READY) {
+			pool->stopped = 1;
+			pthread_cond_broadcast(&pool->space);
+		}
+
+		pool->slots[index % pool->capacity] = patch;
+		pool->states[index % pool->capacity] = state;
+		pthread_cond_broadcast(&pool->ready);
+		pthread_mutex_unlock(&pool->lock);
+
+		giterr_clear();
+	}
+
+	return NULL;
+}
+
+static void *rugged_patch_pool_wait_nogvl(void *_pool)
+{
+	struct rugged_patch_pool *pool = _pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->states[pool->yielded % pool->capacity] == RUGGED_PATCH_PENDING && !pool->interrupted)
+		pthread_cond_wait(&pool->ready, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void rugged_patch_pool_wait_ubf(void *_pool)
+{
+	struct rugged_patch_pool *pool = _pool;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->interrupted = 1;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the patch of the next delta and take it out of its slot,
+ * freeing the slot for a worker. Returns the state the patch was left in.
+ */
+static int rugged_patch_pool_take(struct rugged_patch_pool *pool, git_patch **out)
+{
+	size_t slot = pool->yielded % pool->capacity;
+	int state;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		state = pool->states[slot];
+		pool->interrupted = 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (state != RUGGED_PATCH_PENDING)
+			break;
+
+		rb_thread_call_without_gvl2(rugged_patch_pool_wait_nogvl, pool, rugged_patch_pool_wait_ubf, pool);
+		rb_thread_check_ints();
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	*out = pool->slots[slot];
+	pool->slots[slot] = NULL;
+	pool->states[slot] = RUGGED_PATCH_PENDING;
+	pool->yielded++;
+	pthread_cond_broadcast(&pool->space);
+	pthread_mutex_unlock(&pool->lock);
+
+	return state;
+}
+
+static VALUE rugged_diff_each_patch_pooled(VALUE _pool)
+{
+	struct rugged_patch_pool *pool = (struct rugged_patch_pool *)_pool;
+
+	for (; pool->started < pool->threads; pool->started++) {
+		if (pthread_create(&pool->workers[pool->started], NULL, rugged_patch_pool_worker, pool) != 0)
+			break;
+	}
+
+	if (pool->started == 0)
+		rb_raise(rb_eRuntimeError, "failed to start patch threads");
+
+	while (pool->yielded < pool->limit) {
+		size_t index = pool->yielded;
+		git_patch *patch;
+
+		switch (rugged_patch_pool_take(pool, &patch)) {
+		case RUGGED_PATCH_SKIPPED:
+			rugged_diff_truncate(pool->self, index);
+			return Qnil;
+
+		case RUGGED_PATCH_FAILED:
+			if (pool->error_message[0])
+				giterr_set_str(pool->error_klass, pool->error_message);
+			rugged_exception_check(pool->error);
+			return Qnil;
+
+		default:
+			if (pool->budget && rugged_diff_budget_consume(pool->budget, patch)) {
+				git_patch_free(patch);
+				rugged_diff_truncate(pool->self, index);
+				return Qnil;
+			}
+
+			/* Workers check the deltas they claim from now on against this */
+			if (pool->budget && pool->bytes_left != SIZE_MAX) {
+				pthread_mutex_lock(&pool->lock);
+				pool->bytes_left = rugged_diff_budget_bytes_left(pool->budget);
+				pthread_mutex_unlock(&pool->lock);
+			}
+
+			rb_yield(rugged_patch_new(pool->self, patch));
+		}
+	}
+
+	return Qnil;
+}
+
+static VALUE rugged_diff_each_patch_cleanup(VALUE _pool)
+{
+	struct rugged_patch_pool *pool = (struct rugged_patch_pool *)_pool;
+	size_t i;
+	int t;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopped = 1;
+	pthread_cond_broadcast(&pool->space);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (t = 0; t < pool->started; ++t)
+		pthread_join(pool->workers[t], NULL);
+
+	/* Patches that were never handed out to Ruby */
+	for (i = pool->yielded; i < pool->next; ++i)
+		git_patch_free(pool->slots[i % pool->capacity]);
+
+	pthread_cond_destroy(&pool->space);
+	pthread_cond_destroy(&pool->ready);
+	pthread_mutex_destroy(&pool->lock);
+
+	xfree(pool->workers);
+	xfree(pool->slots);
+	xfree(pool->states);
+
+	rugged_diff_busy_leave(pool->self);
+
+	return Qnil;
+}
+#endif
+
 /*
  *  call-seq:
- *    diff.each_patch { |patch| } -> self
- *    diff.each_patch -> enumerator
+ *    diff.each_patch(threads: nil) { |patch| } -> self
+ *    diff.each_patch(threads: nil) -> enumerator
  *
  *  If given a block, yields each patch that is part of the diff.
  *  If no block is given, an enumerator will be returned.
+ *
+ *  If the +:threads+ option is given, patches are generated on that many
+ *  native threads (or one per CPU, if +nil+), without holding the GVL:
+ *  loading blobs and computing the line changes of different files then
+ *  happens in parallel. The threads keep working ahead while the block
+ *  runs, up to a few patches per thread, and patches are still yielded in
+ *  delta order. The threads share the repository's object database, which
+ *  is safe for concurrent reads. While they run, #merge! and #find_similar!
+ *  raise a RuntimeError.
+ *
+ *    diff.each_patch(threads: 4) { |patch| render(patch) }
+ *
+ *  The +:max_files+, +:max_lines+, +:max_total_bytes+ and +:deadline_ms+
+ *  options bound the work done, on top of any budget the diff was created
+ *  with (see Tree.diff). Once a patch would go over the budget, or the
+ *  deadline has passed, no more patches are generated: the remaining
+ *  deltas are marked as truncated (see Diff#truncated? and
+ *  Diff::Delta#truncated?) and the iteration ends normally. These marks
+ *  only describe the latest iteration, and are cleared when the next one
+ *  starts.
+ *
+ *  Lines can only be counted once a patch has been generated, but sizes
+ *  are known up front: a file with a side larger than what is left of
+ *  +:max_total_bytes+ truncates the iteration before it is diffed.
  */
-static VALUE rb_git_diff_each_patch(VALUE self)
+static VALUE rb_git_diff_each_patch(int argc, VALUE *argv, VALUE self)
 {
 	git_diff *diff;
 	git_patch *patch;
 	int error = 0;
 	size_t d, delta_count;
+	VALUE rb_options, rb_threads = Qundef, owner;
+	struct rugged_diff_budget budget;
+	git_repository *repo = NULL;
 
-	RETURN_ENUMERATOR(self, 0, 0);
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "00:", &rb_options);
 	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
 
+	owner = rugged_owner(self);
+	if (rb_obj_is_kind_of(owner, rb_cRuggedRepo))
+		TypedData_Get_Struct(owner, git_repository, &rugged_repository_type, repo);
+
 	delta_count = git_diff_num_deltas(diff);
+	rugged_diff_patch_budget(&budget, self, rb_options);
+	rb_iv_set(self, "@patches_truncated", Qnil);
+
+	if (!NIL_P(rb_options))
+		rb_threads = rb_hash_lookup2(rb_options, CSTR2SYM("threads"), Qundef);
+
+	if (rb_threads != Qundef) {
+		int threads = rugged_parallel_threads_get(rb_threads);
+#ifdef HAVE_PTHREAD_H
+		struct rugged_patch_pool pool;
+		VALUE rb_drivers = rb_hash_new();
+
+		memset(&pool, 0, sizeof(pool));
+		pool.self = self;
+		pool.diff = diff;
+		pool.repo = repo;
+		pool.bytes_left = SIZE_MAX;
+		pool.limit = delta_count;
+		pool.threads = threads;
+		pool.capacity = (size_t)threads * RUGGED_DIFF_PATCH_QUEUE;
+
+		if (budget.enabled) {
+			pool.budget = &budget;
+			pool.deadline = budget.deadline;
+			pool.bytes_left = budget.max_total_bytes;
+
+			if (pool.limit > budget.max_files)
+				pool.limit = budget.max_files;
+		}
+
+		/* Workers must only ever find drivers that are already loaded */
+		rugged_diff_load_drivers(repo, diff, 0, pool.limit, rb_drivers);
+
+		pool.workers = xcalloc(threads, sizeof(pthread_t));
+		pool.slots = xcalloc(pool.capacity, sizeof(git_patch *));
+		pool.states = xcalloc(pool.capacity, 1);
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.ready, NULL);
+		pthread_cond_init(&pool.space, NULL);
+
+		rugged_diff_busy_enter(self);
+		rb_ensure(rugged_diff_each_patch_pooled, (VALUE)&pool, rugged_diff_each_patch_cleanup, (VALUE)&pool);
+		RB_GC_GUARD(rb_drivers);
+
+		/* Ran out of files, rather than of time or lines */
+		if (pool.yielded == pool.limit && pool.limit < delta_count)
+			rugged_diff_truncate(self, pool.limit);
+
+		return self;
+#else
+		/* No native threads: generate the patches on this one */
+		(void)threads;
+#endif
+	}
+
 	for (d = 0; d < delta_count; ++d) {
+		if (budget.enabled && (rugged_diff_budget_spent(&budget) ||
+			rugged_diff_delta_oversized(repo, git_diff_get_delta(diff, d), rugged_diff_budget_bytes_left(&budget)))) {
+			rugged_diff_truncate(self, d);
+			break;
+		}
+
 		error = git_patch_from_diff(&patch, diff, d);
 		if (error) break;
 
+		if (budget.enabled && rugged_diff_budget_consume(&budget, patch)) {
+			git_patch_free(patch);
+			rugged_diff_truncate(self, d);
+			break;
+		}
+
 		rb_yield(rugged_patch_new(self, patch));
 	}
 
@@ -485,15 +1186,31 @@ static VALUE rb_git_diff_each_delta(VALUE self)
 {
 	git_diff *diff;
 	const git_diff_delta *delta;
-	size_t d, delta_count;
+	size_t d, delta_count, truncated = SIZE_MAX;
+	VALUE rb_truncated;
 
 	RETURN_ENUMERATOR(self, 0, 0);
 	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
 
+	rb_truncated = rb_attr_get(self, rb_intern("@truncated"));
+	if (!NIL_P(rb_truncated))
+		truncated = NUM2SIZET(rb_truncated);
+
+	rb_truncated = rb_attr_get(self, rb_intern("@patches_truncated"));
+	if (!NIL_P(rb_truncated) && NUM2SIZET(rb_truncated) < truncated)
+		truncated = NUM2SIZET(rb_truncated);
+
 	delta_count = git_diff_num_deltas(diff);
 	for (d = 0; d < delta_count; ++d) {
+		VALUE rb_delta;
+
 		delta = git_diff_get_delta(diff, d);
-		rb_yield(rugged_diff_delta_new(self, delta));
+		rb_delta = rugged_diff_delta_new(self, delta);
+
+		if (d >= truncated)
+			rb_iv_set(rb_delta, "@truncated", Qtrue);
+
+		rb_yield(rb_delta);
 	}
 
 	return self;
@@ -569,17 +1286,21 @@ static VALUE rb_git_diff_size(VALUE self)
 	return INT2FIX(git_diff_num_deltas(diff));
 }
 
-struct diff_stats {
+struct nogvl_diff_stats_args {
+	git_diff *diff;
+	size_t next, ndeltas;
 	size_t files, adds, dels;
+
+	/* Per-delta counts, only collected for numstat */
+	size_t *delta_adds, *delta_dels;
+	char *delta_binary;
+
+	volatile int cancelled;
+	int error;
 };
 
-static int diff_file_stats_cb(
-	const git_diff_delta *delta,
-	float progress,
-	void *payload)
+static int diff_delta_counts(const git_diff_delta *delta)
 {
-	struct diff_stats *stats = payload;
-
 	switch (delta->status) {
 	case GIT_DELTA_ADDED:
 	case GIT_DELTA_DELETED:
@@ -587,49 +1308,223 @@ static int diff_file_stats_cb(
 	case GIT_DELTA_RENAMED:
 	case GIT_DELTA_COPIED:
 	case GIT_DELTA_TYPECHANGE:
-		stats->files++;
-		break;
+		return 1;
 	default:
 		/* unmodified, ignored, and untracked files don't count */
-		break;
+		return 0;
 	}
-	return GIT_OK;
 }
 
-static int diff_line_stats_cb(
-	const git_diff_delta *delta,
-	const git_diff_hunk *hunk,
-	const git_diff_line *line,
-	void *payload)
+/*
+ * Count the lines of each patch with git_patch_line_stats rather than a
+ * callback per line. Resumes from +args->next+, so that it can be called
+ * again after being interrupted.
+ */
+static void *rb_git_diff_stats_nogvl(void *_args)
 {
-	struct diff_stats *stats = payload;
+	struct nogvl_diff_stats_args *args = _args;
 
-	switch (line->origin) {
-	case GIT_DIFF_LINE_ADDITION: stats->adds++; break;
-	case GIT_DIFF_LINE_DELETION: stats->dels++; break;
-	default: break;
+	for (; args->next < args->ndeltas && !args->cancelled; args->next++) {
+		size_t i = args->next, adds = 0, dels = 0;
+		const git_diff_delta *delta = git_diff_get_delta(args->diff, i);
+		git_patch *patch = NULL;
+
+		if ((args->error = git_patch_from_diff(&patch, args->diff, i)) < 0)
+			break;
+
+		if (patch) {
+			git_patch_line_stats(NULL, &adds, &dels, patch);
+			delta = git_patch_get_delta(patch);
+		}
+
+		if (diff_delta_counts(delta))
+			args->files++;
+
+		args->adds += adds;
+		args->dels += dels;
+
+		if (args->delta_adds) {
+			args->delta_adds[i] = adds;
+			args->delta_dels[i] = dels;
+			args->delta_binary[i] = (delta->flags & GIT_DIFF_FLAG_BINARY) != 0;
+		}
+
+		git_patch_free(patch);
 	}
 
-	return GIT_OK;
+	return NULL;
+}
+
+static void rb_git_diff_stats_cancel(void *_args)
+{
+	((struct nogvl_diff_stats_args *)_args)->cancelled = 1;
+}
+
+static VALUE rugged_diff_stats_run(VALUE _args)
+{
+	struct nogvl_diff_stats_args *args = (struct nogvl_diff_stats_args *)_args;
+
+	while (args->next < args->ndeltas && !args->error) {
+		args->cancelled = 0;
+		rb_thread_call_without_gvl2(rb_git_diff_stats_nogvl, args, rb_git_diff_stats_cancel, args);
+		rb_thread_check_ints();
+	}
+
+	return Qnil;
+}
+
+static void rugged_diff_stats(VALUE self, struct nogvl_diff_stats_args *args)
+{
+	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, args->diff);
+	args->ndeltas = git_diff_num_deltas(args->diff);
+
+	rugged_diff_busy_enter(self);
+	rb_ensure(rugged_diff_stats_run, (VALUE)args, rugged_diff_busy_leave, self);
+
+	RB_GC_GUARD(self);
+	rugged_exception_check(args->error);
 }
 
 /*
  *  call-seq: diff.stat -> int, int, int
  *
  *  Returns the number of files/additions/deletions in this diff.
+ *
+ *  The patches are generated and counted without holding the GVL. Meanwhile,
+ *  other threads calling #merge! or #find_similar! on this diff get a
+ *  RuntimeError.
  */
 static VALUE rb_git_diff_stat(VALUE self)
 {
+	struct nogvl_diff_stats_args args;
+
+	memset(&args, 0, sizeof(args));
+	rugged_diff_stats(self, &args);
+
+	return rb_ary_new3(
+		3, SIZET2NUM(args.files), SIZET2NUM(args.adds), SIZET2NUM(args.dels));
+}
+
+/*
+ *  call-seq: diff.numstat -> [paths, additions, deletions, binary]
+ *
+ *  Returns the per-file statistics of this diff as four Arrays, with one
+ *  element per delta in diff order: the new path of each file, the number
+ *  of added and of deleted lines, and whether the file is binary (which
+ *  makes both counts zero).
+ *
+ *    paths, adds, dels, binary = diff.numstat
+ *    paths.each_index { |i| puts "#{adds[i]}\t#{dels[i]}\t#{paths[i]}" unless binary[i] }
+ *
+ *  Like #stat, this is computed without holding the GVL, and without
+ *  creating any Patch, Hunk or Line objects.
+ */
+static VALUE rb_git_diff_numstat(VALUE self)
+{
+	struct nogvl_diff_stats_args args;
+	VALUE rb_paths, rb_adds, rb_dels, rb_binary, counts_v;
+	size_t i, ndeltas;
 	git_diff *diff;
-	struct diff_stats stats = { 0, 0, 0 };
 
 	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
+	ndeltas = git_diff_num_deltas(diff);
 
-	git_diff_foreach(
-		diff, diff_file_stats_cb, NULL, NULL, diff_line_stats_cb, &stats);
+	/* One buffer for the additions, the deletions and the binary flags */
+	memset(&args, 0, sizeof(args));
+	args.delta_adds = ALLOCV_N(size_t, counts_v, ndeltas * 2 + ndeltas / sizeof(size_t) + 1);
+	args.delta_dels = args.delta_adds + ndeltas;
+	args.delta_binary = (char *)(args.delta_dels + ndeltas);
 
-	return rb_ary_new3(
-		3, INT2FIX(stats.files), INT2FIX(stats.adds), INT2FIX(stats.dels));
+	rugged_diff_stats(self, &args);
+
+	rb_paths = rb_ary_new_capa(ndeltas);
+	rb_adds = rb_ary_new_capa(ndeltas);
+	rb_dels = rb_ary_new_capa(ndeltas);
+	rb_binary = rb_ary_new_capa(ndeltas);
+
+	for (i = 0; i < ndeltas; ++i) {
+		const git_diff_delta *delta = git_diff_get_delta(diff, i);
+
+		rb_ary_push(rb_paths, rb_str_new_utf8(delta->new_file.path));
+		rb_ary_push(rb_adds, SIZET2NUM(args.delta_adds[i]));
+		rb_ary_push(rb_dels, SIZET2NUM(args.delta_dels[i]));
+		rb_ary_push(rb_binary, args.delta_binary[i] ? Qtrue : Qfalse);
+	}
+
+	ALLOCV_END(counts_v);
+
+	return rb_ary_new3(4, rb_paths, rb_adds, rb_dels, rb_binary);
+}
+
+/*
+ *  call-seq:
+ *    diff.to_columns -> hash
+ *
+ *  Returns the hunks and lines of every patch in the diff as parallel
+ *  columns, like Patch#to_columns but in one pass over the whole diff and
+ *  without creating a Patch object per file.
+ *
+ *  In addition to the keys described in Patch#to_columns, the Hash has
+ *  +:files+: the index of the first row of each delta, in diff order, packed
+ *  as native unsigned 32-bit integers (<tt>unpack("L*")</tt>). It has one
+ *  more entry than there are deltas, so that the rows of delta +i+ are
+ *  <tt>files[i]...files[i + 1]</tt>; deltas without content have no rows.
+ */
+static VALUE rb_git_diff_to_columns(VALUE self)
+{
+	struct rugged_columns columns;
+	VALUE rb_files, rb_result;
+	size_t d, delta_count;
+	git_diff *diff;
+	int error = 0;
+
+	TypedData_Get_Struct(self, git_diff, &rugged_diff_type, diff);
+
+	delta_count = git_diff_num_deltas(diff);
+	rb_files = rb_str_buf_new((delta_count + 1) * sizeof(uint32_t));
+	rugged_columns_init(&columns);
+
+	for (d = 0; d < delta_count; ++d) {
+		uint32_t first_row = (uint32_t)RSTRING_LEN(columns.origins);
+		git_patch *patch;
+
+		rb_str_cat(rb_files, (const char *)&first_row, sizeof(first_row));
+
+		if ((error = git_patch_from_diff(&patch, diff, d)) < 0)
+			break;
+
+		if (patch) {
+			error = rugged_columns_add_patch(&columns, patch);
+			git_patch_free(patch);
+
+			if (error < 0)
+				break;
+		}
+	}
+
+	rugged_exception_check(error);
+
+	{
+		uint32_t rows = (uint32_t)RSTRING_LEN(columns.origins);
+		rb_str_cat(rb_files, (const char *)&rows, sizeof(rows));
+	}
+
+	rb_result = rugged_columns_finish(&columns);
+	rb_hash_aset(rb_result, CSTR2SYM("files"), rb_files);
+
+	return rb_result;
+}
+
+/*
+ *  call-seq: diff.truncated? -> true or false
+ *
+ *  Returns true if a budget stopped the generation of this diff, or the
+ *  latest #each_patch, before it was complete. See Diff#each_patch.
+ */
+static VALUE rb_git_diff_truncated_p(VALUE self)
+{
+	return NIL_P(rb_attr_get(self, rb_intern("@truncated"))) &&
+		NIL_P(rb_attr_get(self, rb_intern("@patches_truncated"))) ? Qfalse : Qtrue;
 }
 
 /*
@@ -657,10 +1552,13 @@ void Init_rugged_diff(void)
 
 	rb_define_method(rb_cRuggedDiff, "size", rb_git_diff_size, 0);
 	rb_define_method(rb_cRuggedDiff, "stat", rb_git_diff_stat, 0);
+	rb_define_method(rb_cRuggedDiff, "numstat", rb_git_diff_numstat, 0);
+	rb_define_method(rb_cRuggedDiff, "to_columns", rb_git_diff_to_columns, 0);
 
 	rb_define_method(rb_cRuggedDiff, "sorted_icase?", rb_git_diff_sorted_icase_p, 0);
+	rb_define_method(rb_cRuggedDiff, "truncated?", rb_git_diff_truncated_p, 0);
 
-	rb_define_method(rb_cRuggedDiff, "each_patch", rb_git_diff_each_patch, 0);
+	rb_define_method(rb_cRuggedDiff, "each_patch", rb_git_diff_each_patch, -1);
 	rb_define_method(rb_cRuggedDiff, "each_delta", rb_git_diff_each_delta, 0);
 	rb_define_method(rb_cRuggedDiff, "each_line", rb_git_diff_each_line, -1);
 }
@@ -78,6 +78,7 @@ VALUE rugged_diff_delta_new(VALUE owner, const git_diff_delta *delta)
 		(!(delta->flags & GIT_DIFF_FLAG_NOT_BINARY) &&
 		 (delta->flags & GIT_DIFF_FLAG_BINARY)) ? Qtrue : Qfalse
 	);
+	rb_iv_set(rb_delta, "@truncated", Qfalse);
 
 	return rb_delta;
 }
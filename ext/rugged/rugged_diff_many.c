@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#include "rugged.h"
+
+extern VALUE rb_cRuggedRepo;
+extern VALUE rb_cRuggedDiff;
+extern const rb_data_type_t rugged_repository_type;
+
+struct rugged_diff_many {
+	VALUE rb_repo;
+	VALUE rb_pairs;
+	git_repository *repo;
+	git_diff_options opts;
+	int threads;
+	int stats;
+
+	size_t count;
+	git_oid *oids;
+	char *sides;
+	git_diff **diffs;
+	size_t *adds, *dels;
+};
+
+static int rugged_diff_many_tree(git_tree **out, git_repository *repo, const git_oid *oid)
+{
+	git_object *object;
+	int error;
+
+	if ((error = git_object_lookup(&object, repo, oid, GIT_OBJ_ANY)) < 0)
+		return error;
+
+	error = git_object_peel((git_object **)out, object, GIT_OBJ_TREE);
+	git_object_free(object);
+
+	return error;
+}
+
+/*
+ * Every worker looks objects up through the same git_repository. That is
+ * safe: libgit2 loads the repository's ODB and other components with
+ * atomic swaps and guards its object cache with a read-write lock, and
+ * diffing trees of a shared repository from several threads is what its
+ * own thread tests do. (Repository#prefetch sticks to the ODB for a
+ * different reason: its thread outlives the call, so it only touches what
+ * it can keep alive and stop when the repository is closed.) The one thing that isn't safe to fill concurrently is the
+ * registry of diff drivers, which only patches need; see
+ * rugged_diff_load_drivers.
+ */
+static int rugged_diff_many_diff_cb(size_t i, void *payload)
+{
+	struct rugged_diff_many *m = payload;
+	git_tree *trees[2] = { NULL, NULL };
+	int error = 0, side;
+
+	for (side = 0; side < 2 && !error; ++side) {
+		if (m->sides[2 * i + side])
+			error = rugged_diff_many_tree(&trees[side], m->repo, &m->oids[2 * i + side]);
+	}
+
+	if (!error)
+		error = git_diff_tree_to_tree(&m->diffs[i], m->repo, trees[0], trees[1], &m->opts);
+
+	git_tree_free(trees[0]);
+	git_tree_free(trees[1]);
+
+	return error;
+}
+
+static int rugged_diff_many_stats_cb(size_t i, void *payload)
+{
+	struct rugged_diff_many *m = payload;
+	size_t d, ndeltas = git_diff_num_deltas(m->diffs[i]);
+	int error;
+
+	for (d = 0; d < ndeltas; ++d) {
+		size_t adds = 0, dels = 0;
+		git_patch *patch = NULL;
+
+		if ((error = git_patch_from_diff(&patch, m->diffs[i], d)) < 0)
+			return error;
+
+		if (patch) {
+			git_patch_line_stats(NULL, &adds, &dels, patch);
+			git_patch_free(patch);
+		}
+
+		m->adds[i] += adds;
+		m->dels[i] += dels;
+	}
+
+	return 0;
+}
+
+static VALUE rugged_diff_many_result(struct rugged_diff_many *m, size_t i)
+{
+	VALUE rb_result = rb_hash_new(), rb_deltas, rb_diff;
+	git_diff *diff = m->diffs[i];
+	size_t d, files = 0, ndeltas = git_diff_num_deltas(diff);
+
+	/* The deltas belong to a Rugged::Diff, like those of Diff#deltas */
+	rb_diff = rugged_diff_new(rb_cRuggedDiff, m->rb_repo, diff);
+	m->diffs[i] = NULL;
+
+	rb_deltas = rb_ary_new2(ndeltas);
+	for (d = 0; d < ndeltas; ++d) {
+		const git_diff_delta *delta = git_diff_get_delta(diff, d);
+
+		if (delta->status != GIT_DELTA_UNMODIFIED)
+			files++;
+
+		rb_ary_push(rb_deltas, rugged_diff_delta_new(rb_diff, delta));
+	}
+
+	rb_hash_aset(rb_result, CSTR2SYM("files"), SIZET2NUM(files));
+	rb_hash_aset(rb_result, CSTR2SYM("deltas"), rb_deltas);
+
+	if (m->stats) {
+		rb_hash_aset(rb_result, CSTR2SYM("additions"), SIZET2NUM(m->adds[i]));
+		rb_hash_aset(rb_result, CSTR2SYM("deletions"), SIZET2NUM(m->dels[i]));
+	}
+
+	return rb_result;
+}
+
+static VALUE rugged_diff_many_run(VALUE _m)
+{
+	struct rugged_diff_many *m = (struct rugged_diff_many *)_m;
+	VALUE rb_result;
+	size_t i;
+	int error;
+
+	m->count = RARRAY_LEN(m->rb_pairs);
+	m->oids = xcalloc(m->count * 2, sizeof(git_oid));
+	m->sides = xcalloc(m->count * 2, sizeof(char));
+	m->diffs = xcalloc(m->count, sizeof(git_diff *));
+
+	/* Resolve every side up front, so that the workers only see OIDs */
+	for (i = 0; i < m->count; ++i) {
+		VALUE rb_pair = rb_ary_entry(m->rb_pairs, i);
+		int side;
+
+		if (!RB_TYPE_P(rb_pair, T_ARRAY) || RARRAY_LEN(rb_pair) != 2)
+			rb_raise(rb_eArgError, "expected an [old, new] pair at index %ld", (long)i);
+
+		for (side = 0; side < 2; ++side) {
+			VALUE rb_side = rb_ary_entry(rb_pair, side);
+
+			if (NIL_P(rb_side))
+				continue;
+
+			rugged_exception_check(rugged_oid_get(&m->oids[2 * i + side], m->repo, rb_side));
+			m->sides[2 * i + side] = 1;
+		}
+	}
+
+	error = rugged_parallel_run(rugged_diff_many_diff_cb, m, m->count, m->threads);
+
+	for (i = 0; !error && i < m->count; ++i) {
+		if (m->diffs[i] == NULL)
+			rb_raise(rb_eRuntimeError, "pair %ld was not diffed", (long)i);
+	}
+
+	if (!error && m->stats) {
+		VALUE rb_drivers = rb_hash_new();
+
+		for (i = 0; i < m->count; ++i)
+			rugged_diff_load_drivers(m->repo, m->diffs[i], 0, git_diff_num_deltas(m->diffs[i]), rb_drivers);
+
+		m->adds = xcalloc(m->count, sizeof(size_t));
+		m->dels = xcalloc(m->count, sizeof(size_t));
+
+		error = rugged_parallel_run(rugged_diff_many_stats_cb, m, m->count, m->threads);
+		RB_GC_GUARD(rb_drivers);
+	}
+
+	rugged_exception_check(error);
+
+	rb_result = rb_ary_new2(m->count);
+	for (i = 0; i < m->count; ++i)
+		rb_ary_push(rb_result, rugged_diff_many_result(m, i));
+
+	return rb_result;
+}
+
+static VALUE rugged_diff_many_cleanup(VALUE _m)
+{
+	struct rugged_diff_many *m = (struct rugged_diff_many *)_m;
+	size_t i;
+
+	if (m->diffs) {
+		for (i = 0; i < m->count; ++i)
+			git_diff_free(m->diffs[i]);
+	}
+
+	xfree(m->oids);
+	xfree(m->sides);
+	xfree(m->diffs);
+	xfree(m->adds);
+	xfree(m->dels);
+
+	rugged_strarray_dispose(&m->opts.pathspec);
+
+	return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    repo.diff_many(pairs, options = {}) -> [result, ...]
+ *
+ *  Compute the tree-to-tree diffs of many +[old, new]+ pairs in a single
+ *  call, on a pool of native threads and without holding the GVL, and
+ *  return one result per pair in the same order.
+ *
+ *  Each side of a pair can be a Rugged::Commit or Rugged::Tree, an OID or
+ *  revision string, or +nil+ for an empty tree. Commits are diffed through
+ *  their trees, so listing the files changed by each commit of a history
+ *  could pass +[commit.parent_ids.first, commit.oid]+ for every commit.
+ *
+ *  Each result is a Hash with the +:deltas+ of the diff, as an Array of
+ *  Rugged::Diff::Delta whose Delta#diff is a Rugged::Diff of the pair, and
+ *  the number of changed +:files+. With the
+ *  +:stats+ option, it also has the number of +:additions+ and
+ *  +:deletions+, like Diff#stat.
+ *
+ *  Accepts the options of Tree.diff, and:
+ *
+ *  :stats ::
+ *    If true, also count the lines added and deleted by every diff. This
+ *    generates all their patches, so it is a lot more work.
+ *
+ *  :threads ::
+ *    The number of threads to use. Defaults to the number of online CPUs.
+ *
+ *  The budget options of Tree.diff (+:max_files+, +:max_lines+,
+ *  +:max_total_bytes+ and +:deadline_ms+) are not supported, and raise an
+ *  ArgumentError.
+ *
+ *    repo.diff_many(commits.map { |c| [c.parent_ids.first, c.oid] }, stats: true)
+ *    #=> [{ files: 2, deltas: [...], additions: 12, deletions: 3 }, ...]
+ */
+static VALUE rb_git_repo_diff_many(int argc, VALUE *argv, VALUE self)
+{
+	struct rugged_diff_many m;
+	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	VALUE rb_pairs, rb_options, rb_result, rb_payload;
+	uint64_t started = rugged_instrument_start();
+	size_t i, ndeltas = 0;
+
+	rb_scan_args(argc, argv, "10:", &rb_pairs, &rb_options);
+	Check_Type(rb_pairs, T_ARRAY);
+
+	if (!NIL_P(rb_options)) {
+		static const char *budget_keys[] = { "max_files", "max_lines", "max_total_bytes", "deadline_ms" };
+
+		for (i = 0; i < sizeof(budget_keys) / sizeof(budget_keys[0]); ++i) {
+			if (rb_hash_lookup2(rb_options, CSTR2SYM(budget_keys[i]), Qundef) != Qundef)
+				rb_raise(rb_eArgError, "diff_many does not support the :%s option", budget_keys[i]);
+		}
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.rb_repo = self;
+	m.rb_pairs = rb_pairs;
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, m.repo);
+
+	m.threads = rugged_parallel_threads_get(NIL_P(rb_options) ? Qnil :
+		rb_hash_aref(rb_options, CSTR2SYM("threads")));
+	m.stats = !NIL_P(rb_options) && RTEST(rb_hash_aref(rb_options, CSTR2SYM("stats")));
+
+	m.opts = opts;
+	rugged_parse_diff_options(&m.opts, rb_options);
+
+	rb_result = rb_ensure(rugged_diff_many_run, (VALUE)&m, rugged_diff_many_cleanup, (VALUE)&m);
+	RB_GC_GUARD(rb_options);
+
+	if (!started)
+		return rb_result;
+
+	for (i = 0; i < (size_t)RARRAY_LEN(rb_result); ++i)
+		ndeltas += RARRAY_LEN(rb_hash_aref(rb_ary_entry(rb_result, i), CSTR2SYM("deltas")));
+
+	rb_payload = rb_hash_new();
+	rb_hash_aset(rb_payload, CSTR2SYM("pairs"), LONG2NUM(RARRAY_LEN(rb_result)));
+	rb_hash_aset(rb_payload, CSTR2SYM("deltas"), SIZET2NUM(ndeltas));
+
+	rugged_instrument_emit("diff.many", started, rb_payload);
+	return rb_result;
+}
+
+void Init_rugged_diff_many(void)
+{
+	rb_define_method(rb_cRuggedRepo, "diff_many", rb_git_repo_diff_many, -1);
+}
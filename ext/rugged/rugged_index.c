@@ -29,10 +29,19 @@ static void rb_git_index__free(void *data)
 	git_index_free(index);
 }
 
+static size_t rb_git_index__size(const void *data)
+{
+	git_index *index = (git_index *) data;
+
+	/* Entries are stored alongside their path, plus a map slot */
+	return git_index_entrycount(index) * (sizeof(git_index_entry) + 64);
+}
+
 const rb_data_type_t rugged_index_type = {
 	.wrap_struct_name = "Rugged::Index",
 	.function = {
 		.dfree = rb_git_index__free,
+		.dsize = rb_git_index__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -570,9 +579,8 @@ static void rb_git_indexentry_toC(git_index_entry *entry, VALUE rb_entry)
 	entry->path = StringValueCStr(val);
 
 	val = rb_hash_aref(rb_entry, CSTR2SYM("oid"));
-	Check_Type(val, T_STRING);
 	rugged_exception_check(
-		git_oid_fromstr(&entry->id, StringValueCStr(val))
+		rugged_oid_from_value(&entry->id, val)
 	);
 
 	entry->dev = default_entry_value(rb_entry, "dev");
@@ -686,12 +694,15 @@ static VALUE rb_git_diff_tree_to_index(VALUE self, VALUE rb_other, VALUE rb_opti
 {
 	git_index *index;
 	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	struct rugged_diff_budget budget;
 	git_repository *repo;
 	git_diff *diff = NULL;
 	VALUE owner;
+	uint64_t started = rugged_instrument_start();
 	int error;
 	git_tree *other_tree;
 
+	rugged_parse_diff_budget(&budget, &opts, rb_options);
 	rugged_parse_diff_options(&opts, rb_options);
 
 	TypedData_Get_Struct(self, git_index, &rugged_index_type, index);
@@ -708,18 +719,22 @@ static VALUE rb_git_diff_tree_to_index(VALUE self, VALUE rb_other, VALUE rb_opti
 	rugged_strarray_dispose(&opts.pathspec);
 	rugged_exception_check(error);
 
-	return rugged_diff_new(rb_cRuggedDiff, owner, diff);
+	return rugged_diff_instrument("diff.tree_to_index", started,
+		rugged_diff_budget_attach(rugged_diff_new(rb_cRuggedDiff, owner, diff), &budget));
 }
 
 static VALUE rb_git_diff_index_to_workdir(VALUE self, VALUE rb_options)
 {
 	git_index *index;
 	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	struct rugged_diff_budget budget;
 	git_repository *repo;
 	git_diff *diff = NULL;
 	VALUE owner;
+	uint64_t started = rugged_instrument_start();
 	int error;
 
+	rugged_parse_diff_budget(&budget, &opts, rb_options);
 	rugged_parse_diff_options(&opts, rb_options);
 
 	TypedData_Get_Struct(self, git_index, &rugged_index_type, index);
@@ -731,7 +746,8 @@ static VALUE rb_git_diff_index_to_workdir(VALUE self, VALUE rb_options)
 	rugged_strarray_dispose(&opts.pathspec);
 	rugged_exception_check(error);
 
-	return rugged_diff_new(rb_cRuggedDiff, owner, diff);
+	return rugged_diff_instrument("diff.index_to_workdir", started,
+		rugged_diff_budget_attach(rugged_diff_new(rb_cRuggedDiff, owner, diff), &budget));
 }
 
 /*
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#include "rugged.h"
+#include <time.h>
+#include <sys/time.h>
+
+extern VALUE rb_mRugged;
+
+/*
+ * Non-zero while any subscriber is registered. Instrumented call sites
+ * check this (through rugged_instrument_start) before doing any extra
+ * work, so an unobserved process only pays for a single branch per
+ * operation.
+ */
+int rugged_instrument_enabled = 0;
+
+static VALUE rb_subscribers = Qnil;
+
+uint64_t rugged_instrument_clock(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+void rugged_instrument_publish(const char *event, uint64_t duration, VALUE rb_payload)
+{
+	VALUE rb_event, rb_duration, rb_subs;
+	long i;
+
+	if (!rugged_instrument_enabled)
+		return;
+
+	rb_event = rb_obj_freeze(rb_str_new_cstr(event));
+	rb_duration = ULL2NUM(duration);
+
+	if (NIL_P(rb_payload))
+		rb_payload = rb_hash_new();
+
+	/* Subscribers may unsubscribe themselves while we iterate */
+	rb_subs = rb_ary_dup(rb_subscribers);
+
+	for (i = 0; i < RARRAY_LEN(rb_subs); ++i)
+		rb_funcall(rb_ary_entry(rb_subs, i), rb_intern("call"), 3,
+			rb_event, rb_duration, rb_payload);
+}
+
+/*
+ *  call-seq:
+ *    Rugged.subscribe { |event, duration_ns, payload| } -> subscriber
+ *    Rugged.subscribe(callable) -> subscriber
+ *
+ *  Register a subscriber for Rugged's instrumentation events. It is called
+ *  on the calling thread after each instrumented operation completes, with
+ *  the event name, the time taken in nanoseconds and a Hash of details.
+ *
+ *  The following events are emitted:
+ *
+ *  "odb.read" ::
+ *    An object was read or looked up, by Repository#read, #read_many
+ *    (once per object), #read_stream, #lookup, Object.lookup or any
+ *    method taking an OID in place of an object. Payload keys: +:oid+,
+ *    +:found+, +:cached+, +:type+ and +:bytes+ (the inflated size, which
+ *    is not known for commits, trees and tags that were looked up).
+ *    +:cached+ tells whether the object came from the repository's object
+ *    cache, and is +nil+ when Rugged isn't built against its vendored
+ *    libgit2, the only one whose cache can be looked into.
+ *  "odb.read_header" ::
+ *    An object header was read. Payload keys: +:oid+, +:found+, +:type+
+ *    and +:bytes+.
+ *  "revwalk.batch" ::
+ *    Walker#each_batch collected a batch. Payload keys: +:count+.
+ *  "diff.tree_to_tree", "diff.tree_to_index", "diff.tree_to_workdir",
+ *  "diff.index_to_workdir" ::
+ *    A diff was generated. Payload keys: +:deltas+ and +:bytes+ (the
+ *    combined size of both sides of every delta, where known).
+ *  "blame" ::
+ *    A file was blamed. Payload keys: +:path+ and +:hunks+.
+ *  "status" ::
+ *    The working directory status was computed. Payload keys: +:path+
+ *    (for a single file) or +:entries+.
+ *  "checkout" ::
+ *    A checkout finished. Payload keys: +:source+ (+:tree+, +:index+ or
+ *    +:head+).
+ *  "remote.fetch" ::
+ *    A fetch finished. The payload has the same keys as the Hash returned
+ *    by Remote#fetch, plus +:remote+. The duration covers the whole fetch:
+ *    libgit2 runs connecting, downloading and updating the tips in a
+ *    single call, so they aren't reported separately.
+ *
+ *  Events are emitted once the operation has finished; ODB lookups for
+ *  missing objects are reported with +:found+ set to false before the
+ *  error is raised. When no subscriber is registered they cost nothing.
+ *
+ *  Returns the subscriber, which can be passed to Rugged.unsubscribe.
+ */
+static VALUE rb_git_subscribe(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_subscriber, rb_block;
+
+	rb_scan_args(argc, argv, "01&", &rb_subscriber, &rb_block);
+
+	if (NIL_P(rb_subscriber))
+		rb_subscriber = rb_block;
+
+	if (NIL_P(rb_subscriber))
+		rb_raise(rb_eArgError, "Expected a block or an object that responds to #call");
+
+	CALLABLE_OR_RAISE(rb_subscriber, "subscriber");
+
+	rb_ary_push(rb_subscribers, rb_subscriber);
+	rugged_instrument_enabled = 1;
+
+	return rb_subscriber;
+}
+
+/*
+ *  call-seq:
+ *    Rugged.unsubscribe(subscriber) -> subscriber or nil
+ *
+ *  Remove a subscriber previously registered with Rugged.subscribe.
+ */
+static VALUE rb_git_unsubscribe(VALUE self, VALUE rb_subscriber)
+{
+	VALUE rb_removed = rb_ary_delete(rb_subscribers, rb_subscriber);
+
+	rugged_instrument_enabled = RARRAY_LEN(rb_subscribers) > 0;
+
+	return rb_removed;
+}
+
+void Init_rugged_instrument(void)
+{
+	rb_subscribers = rb_ary_new();
+	rb_gc_register_address(&rb_subscribers);
+
+	rb_define_module_function(rb_mRugged, "subscribe", rb_git_subscribe, -1);
+	rb_define_module_function(rb_mRugged, "unsubscribe", rb_git_unsubscribe, 1);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+/*
+ * libgit2 doesn't export its pack window counters, but the vendored copy
+ * is linked statically, so they can be read through its private mwindow.h.
+ * This is kept apart from the rest of the extension so that libgit2's
+ * internal headers never meet ruby.h.
+ */
+#ifdef RUGGED_MWINDOW_STATS
+
+#include "common.h"
+#include "mwindow.h"
+
+#include "rugged_mwindow.h"
+
+extern git_mwindow_ctl git_mwindow__mem_ctl;
+
+int rugged_mwindow_stats_get(struct rugged_mwindow_stats *out)
+{
+	const git_mwindow_ctl *ctl = &git_mwindow__mem_ctl;
+
+	if (git_mutex_lock(&git__mwindow_mutex) < 0)
+		return -1;
+
+	out->mapped = ctl->mapped;
+	out->peak_mapped = ctl->peak_mapped;
+	out->open_windows = ctl->open_windows;
+	out->peak_open_windows = ctl->peak_open_windows;
+	out->open_files = ctl->windowfiles.length;
+	out->used = ctl->used_ctr;
+	out->mmap_calls = ctl->mmap_calls;
+
+	git_mutex_unlock(&git__mwindow_mutex);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#ifndef __H_RUGGED_MWINDOW__
+#define __H_RUGGED_MWINDOW__
+
+#include <stddef.h>
+
+/*
+ * Snapshot of libgit2's pack window counters. Filled in by
+ * rugged_mwindow.c, which is built against the vendored libgit2's
+ * private headers and so must not include ruby.h or rugged.h.
+ */
+struct rugged_mwindow_stats {
+	size_t mapped;
+	size_t peak_mapped;
+	unsigned int open_windows;
+	unsigned int peak_open_windows;
+	size_t open_files;
+	size_t used;
+	size_t mmap_calls;
+};
+
+int rugged_mwindow_stats_get(struct rugged_mwindow_stats *out);
+
+#endif
@@ -79,7 +79,7 @@ int rugged_oid_get(git_oid *oid, git_repository *repo, VALUE p)
 	if (rb_obj_is_kind_of(p, rb_cRuggedObject)) {
 		TypedData_Get_Struct(p, git_object, &rugged_object_type, object);
 		git_oid_cpy(oid, git_object_id(object));
-	} else {
+	} else if (!rugged_oid_extract(oid, p)) {
 		Check_Type(p, T_STRING);
 
 		/* Fast path: see if the 40-char string is an OID */
@@ -97,6 +97,45 @@ int rugged_oid_get(git_oid *oid, git_repository *repo, VALUE p)
 	return GIT_OK;
 }
 
+/*
+ * git_object_lookup_prefix(), reported as an "odb.read" event. Subscribers
+ * run before the object is handed back, so it is freed if one raises.
+ */
+static int rugged_object_lookup(git_object **object, git_repository *repo, const git_oid *oid, size_t len, git_otype type)
+{
+	uint64_t started = rugged_instrument_start();
+	struct rugged_odb_read_event event;
+	int error, exception;
+
+	/* Objects are only looked up in the cache by their full id */
+	event.cached = 0;
+	if (started && len >= GIT_OID_HEXSZ)
+		event.cached = rugged_odb_cached(repo, oid, 0);
+
+	error = git_object_lookup_prefix(object, repo, oid, len, type);
+
+	if (!started)
+		return error;
+
+	event.duration = rugged_instrument_clock() - started;
+	event.oid = error ? oid : git_object_id(*object);
+	event.found = !error;
+	event.type = error ? GIT_OBJ_BAD : git_object_type(*object);
+	event.bytes = SIZE_MAX;
+
+	/* Only blobs keep their raw data around once parsed */
+	if (!error && event.type == GIT_OBJ_BLOB)
+		event.bytes = (size_t)git_blob_rawsize((git_blob *)*object);
+
+	if ((exception = rugged_odb_read_publish(&event)) != 0) {
+		if (!error)
+			git_object_free(*object);
+		rb_jump_tag(exception);
+	}
+
+	return error;
+}
+
 git_object *rugged_object_get(git_repository *repo, VALUE object_value, git_otype type)
 {
 	git_object *object = NULL;
@@ -106,17 +145,22 @@ git_object *rugged_object_get(git_repository *repo, VALUE object_value, git_otyp
 		TypedData_Get_Struct(object_value, git_object, &rugged_object_type, owned_obj);
 		git_object_dup(&object, owned_obj);
 	} else {
+		git_oid oid;
 		int error;
 
+		if (rugged_oid_extract(&oid, object_value)) {
+			error = rugged_object_lookup(&object, repo, &oid, GIT_OID_HEXSZ, type);
+			rugged_exception_check(error);
+			return object;
+		}
+
 		Check_Type(object_value, T_STRING);
 
 		/* Fast path: if we have a 40-char string, just perform the lookup directly */
 		if (RSTRING_LEN(object_value) == 40) {
-			git_oid oid;
-
 			/* If it's not an OID, we can still try the revparse */
 			if (git_oid_fromstr(&oid, RSTRING_PTR(object_value)) == 0) {
-				error = git_object_lookup(&object, repo, &oid, type);
+				error = rugged_object_lookup(&object, repo, &oid, GIT_OID_HEXSZ, type);
 				rugged_exception_check(error);
 				return object;
 			}
@@ -260,24 +304,23 @@ VALUE rb_git_object_lookup(VALUE klass, VALUE rb_repo, VALUE rb_hex)
 	if (type == GIT_OBJ_BAD)
 		type = GIT_OBJ_ANY;
 
-	Check_Type(rb_hex, T_STRING);
-	oid_length = (int)RSTRING_LEN(rb_hex);
-
 	rugged_check_repo(rb_repo);
-
-	if (oid_length > GIT_OID_HEXSZ)
-		rb_raise(rb_eTypeError, "The given OID is too long");
-
 	TypedData_Get_Struct(rb_repo, git_repository, &rugged_repository_type, repo);
 
-	error = git_oid_fromstrn(&oid, RSTRING_PTR(rb_hex), oid_length);
-	rugged_exception_check(error);
+	if (rugged_oid_extract(&oid, rb_hex)) {
+		oid_length = GIT_OID_HEXSZ;
+	} else {
+		Check_Type(rb_hex, T_STRING);
+		oid_length = (int)RSTRING_LEN(rb_hex);
+
+		if (oid_length > GIT_OID_HEXSZ)
+			rb_raise(rb_eTypeError, "The given OID is too long");
 
-	if (oid_length < GIT_OID_HEXSZ)
-		error = git_object_lookup_prefix(&object, repo, &oid, oid_length, type);
-	else
-		error = git_object_lookup(&object, repo, &oid, type);
+		error = git_oid_fromstrn(&oid, RSTRING_PTR(rb_hex), oid_length);
+		rugged_exception_check(error);
+	}
 
+	error = rugged_object_lookup(&object, repo, &oid, oid_length, type);
 	rugged_exception_check(error);
 
 	return rugged_object_new(rb_repo, object);
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+/*
+ * libgit2 doesn't tell whether a read was served from the repository's
+ * object cache, nor how much memory the cache holds, but both can be found
+ * through the private cache.h of the statically linked vendored copy. Like rugged_mwindow.c,
+ * this is kept apart from the rest of the extension so that libgit2's
+ * internal headers never meet ruby.h.
+ */
+#ifdef RUGGED_OBJECT_CACHE
+
+#include "common.h"
+#include "cache.h"
+#include "repository.h"
+
+#include "rugged_object_cache.h"
+
+int rugged_object_cache_contains(git_repository *repo, const git_oid *oid, int raw)
+{
+	/* The ODB of a repository shares the repository's cache */
+	void *cached = raw ?
+		git_cache_get_raw(&repo->objects, oid) :
+		git_cache_get_any(&repo->objects, oid);
+
+	if (!cached)
+		return 0;
+
+	git_cached_obj_decref(cached);
+	return 1;
+}
+
+size_t rugged_object_cache_used(git_repository *repo)
+{
+	ssize_t used;
+
+	if (git_rwlock_rdlock(&repo->objects.lock) < 0)
+		return 0;
+
+	used = repo->objects.used_memory;
+	git_rwlock_rdunlock(&repo->objects.lock);
+
+	return used > 0 ? (size_t)used : 0;
+}
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#ifndef __H_RUGGED_OBJECT_CACHE__
+#define __H_RUGGED_OBJECT_CACHE__
+
+#include <git2.h>
+
+/*
+ * Whether +oid+ is in +repo+'s object cache. With +raw+ set, only the
+ * entries git_odb_read() can be served from count; object lookups can
+ * use parsed objects as well. Implemented by rugged_object_cache.c, which
+ * is built against the vendored libgit2's private headers and so must not
+ * include ruby.h or rugged.h.
+ */
+int rugged_object_cache_contains(git_repository *repo, const git_oid *oid, int raw);
+
+/* Bytes of objects held in +repo+'s object cache */
+size_t rugged_object_cache_used(git_repository *repo);
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#include "rugged.h"
+#include <ruby/version.h>
+
+extern VALUE rb_mRugged;
+VALUE rb_cRuggedOid;
+
+int rugged_oid_format_object = 0;
+
+static size_t rb_git_oid__size(const void *data)
+{
+	return sizeof(git_oid);
+}
+
+/*
+ * Oids are immutable and never point to other Ruby objects; on Rubies
+ * that support it, the git_oid is stored inline in the object slot.
+ */
+static const rb_data_type_t rugged_oid_type = {
+	.wrap_struct_name = "Rugged::Oid",
+	.function = {
+		.dmark = NULL,
+		.dfree = RUBY_TYPED_DEFAULT_FREE,
+		.dsize = rb_git_oid__size,
+	},
+	.data = NULL,
+#if RUBY_API_VERSION_MAJOR > 3 || (RUBY_API_VERSION_MAJOR == 3 && RUBY_API_VERSION_MINOR >= 3)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE | RUBY_TYPED_EMBEDDABLE,
+#else
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#endif
+};
+
+static VALUE rb_git_oid_allocate(VALUE klass)
+{
+	git_oid *oid;
+	return TypedData_Make_Struct(klass, git_oid, &rugged_oid_type, oid);
+}
+
+VALUE rugged_oid_new(const git_oid *oid)
+{
+	git_oid *out;
+	VALUE rb_oid = TypedData_Make_Struct(rb_cRuggedOid, git_oid, &rugged_oid_type, out);
+
+	git_oid_cpy(out, oid);
+	return rb_obj_freeze(rb_oid);
+}
+
+int rugged_oid_extract(git_oid *oid, VALUE rb_value)
+{
+	const git_oid *other;
+
+	if (!rb_obj_is_kind_of(rb_value, rb_cRuggedOid))
+		return 0;
+
+	TypedData_Get_Struct(rb_value, git_oid, &rugged_oid_type, other);
+	git_oid_cpy(oid, other);
+	return 1;
+}
+
+int rugged_oid_from_value(git_oid *oid, VALUE rb_value)
+{
+	if (rugged_oid_extract(oid, rb_value))
+		return GIT_OK;
+
+	Check_Type(rb_value, T_STRING);
+	return git_oid_fromstr(oid, StringValueCStr(rb_value));
+}
+
+/*
+ * Read +rb_value+ into +oid+ if it is an Oid or a full hexadecimal OID
+ * string, without raising. Returns 0 for anything else.
+ */
+static int rugged_oid_coerce(git_oid *oid, VALUE rb_value)
+{
+	if (rugged_oid_extract(oid, rb_value))
+		return 1;
+
+	if (!RB_TYPE_P(rb_value, T_STRING) || RSTRING_LEN(rb_value) != GIT_OID_HEXSZ)
+		return 0;
+
+	if (git_oid_fromstrn(oid, RSTRING_PTR(rb_value), GIT_OID_HEXSZ) < 0) {
+		giterr_clear();
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ *  call-seq:
+ *    Oid.new(hex) -> oid
+ *
+ *  Create a new Oid from a 40-character hexadecimal string.
+ *
+ *    Rugged::Oid.new('d8786bfc97485e8d7b19b21fb88c8ef1f199fc3f')
+ *    #=> #<Rugged::Oid d8786bfc97485e8d7b19b21fb88c8ef1f199fc3f>
+ */
+static VALUE rb_git_oid_initialize(VALUE self, VALUE rb_hex)
+{
+	git_oid *oid;
+
+	rb_check_frozen(self);
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	rugged_exception_check(rugged_oid_from_value(oid, rb_hex));
+
+	return rb_obj_freeze(self);
+}
+
+static VALUE rb_git_oid_initialize_copy(VALUE self, VALUE rb_other)
+{
+	git_oid *oid;
+
+	rb_check_frozen(self);
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	rugged_exception_check(rugged_oid_from_value(oid, rb_other));
+
+	return rb_obj_freeze(self);
+}
+
+/*
+ *  call-seq:
+ *    Oid.from_raw(buffer) -> oid
+ *
+ *  Create a new Oid from a buffer of 20 raw bytes.
+ */
+static VALUE rb_git_oid_from_raw(VALUE klass, VALUE rb_raw)
+{
+	git_oid oid;
+
+	Check_Type(rb_raw, T_STRING);
+
+	if (RSTRING_LEN(rb_raw) != GIT_OID_RAWSZ)
+		rb_raise(rb_eTypeError, "Invalid buffer size for an OID");
+
+	git_oid_fromraw(&oid, (const unsigned char *)RSTRING_PTR(rb_raw));
+	return rugged_oid_new(&oid);
+}
+
+/*
+ *  call-seq:
+ *    oid.to_s -> hex
+ *
+ *  Return the 40-character hexadecimal representation of +oid+.
+ */
+static VALUE rb_git_oid_to_s(VALUE self)
+{
+	const git_oid *oid;
+	char out[GIT_OID_HEXSZ];
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	git_oid_fmt(out, oid);
+
+	return rb_usascii_str_new(out, GIT_OID_HEXSZ);
+}
+
+/*
+ *  call-seq:
+ *    oid.raw -> buffer
+ *
+ *  Return the 20 raw bytes of +oid+ as a binary string.
+ */
+static VALUE rb_git_oid_raw(VALUE self)
+{
+	const git_oid *oid;
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	return rb_str_new((const char *)oid->id, GIT_OID_RAWSZ);
+}
+
+/*
+ *  call-seq:
+ *    oid.hash -> integer
+ *
+ *  OIDs are uniformly distributed already, so their leading bytes are
+ *  used as the hash value directly.
+ */
+static VALUE rb_git_oid_hash(VALUE self)
+{
+	const git_oid *oid;
+	st_index_t hash;
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	memcpy(&hash, oid->id, sizeof(hash));
+
+	return ST2FIX(hash);
+}
+
+/*
+ *  call-seq:
+ *    oid.eql?(other) -> true or false
+ *
+ *  Return true if +other+ is a Rugged::Oid with the same value.
+ */
+static VALUE rb_git_oid_eql(VALUE self, VALUE rb_other)
+{
+	const git_oid *a, *b;
+
+	if (!rb_obj_is_kind_of(rb_other, rb_cRuggedOid))
+		return Qfalse;
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, a);
+	TypedData_Get_Struct(rb_other, git_oid, &rugged_oid_type, b);
+
+	return git_oid_equal(a, b) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    oid == other -> true or false
+ *
+ *  Return true if +other+ is an Oid with the same value, or the
+ *  40-character hexadecimal string representing it.
+ */
+static VALUE rb_git_oid_equal(VALUE self, VALUE rb_other)
+{
+	const git_oid *oid;
+	git_oid other;
+
+	if (!rugged_oid_coerce(&other, rb_other))
+		return Qfalse;
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	return git_oid_equal(oid, &other) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    oid <=> other -> -1, 0, 1 or nil
+ *
+ *  Compare two Oids, or an Oid and a hexadecimal string.
+ */
+static VALUE rb_git_oid_cmp(VALUE self, VALUE rb_other)
+{
+	const git_oid *oid;
+	git_oid other;
+	int cmp;
+
+	if (!rugged_oid_coerce(&other, rb_other))
+		return Qnil;
+
+	TypedData_Get_Struct(self, git_oid, &rugged_oid_type, oid);
+	cmp = git_oid_cmp(oid, &other);
+
+	return INT2FIX(cmp < 0 ? -1 : cmp > 0 ? 1 : 0);
+}
+
+/*
+ *  call-seq:
+ *    oid.inspect -> string
+ */
+static VALUE rb_git_oid_inspect(VALUE self)
+{
+	return rb_sprintf("#<Rugged::Oid %"PRIsVALUE">", rb_git_oid_to_s(self));
+}
+
+/*
+ *  call-seq:
+ *    Rugged.oid_format = :hex or :object
+ *
+ *  Choose how object IDs are returned across the API. +:hex+ (the default)
+ *  returns 40-character strings; +:object+ returns frozen Rugged::Oid
+ *  instances, which take less memory and hash faster.
+ *
+ *  Both formats are always accepted as input.
+ */
+static VALUE rb_git_set_oid_format(VALUE self, VALUE rb_format)
+{
+	if (rb_format == CSTR2SYM("object"))
+		rugged_oid_format_object = 1;
+	else if (rb_format == CSTR2SYM("hex"))
+		rugged_oid_format_object = 0;
+	else
+		rb_raise(rb_eArgError, "Invalid OID format. Expected `:hex` or `:object`");
+
+	return rb_format;
+}
+
+/*
+ *  call-seq:
+ *    Rugged.oid_format -> :hex or :object
+ *
+ *  Return the format object IDs are returned in. See Rugged.oid_format=.
+ */
+static VALUE rb_git_get_oid_format(VALUE self)
+{
+	return rugged_oid_format_object ? CSTR2SYM("object") : CSTR2SYM("hex");
+}
+
+void Init_rugged_oid(void)
+{
+	rb_cRuggedOid = rb_define_class_under(rb_mRugged, "Oid", rb_cObject);
+	rb_include_module(rb_cRuggedOid, rb_mComparable);
+	rb_define_alloc_func(rb_cRuggedOid, rb_git_oid_allocate);
+
+	rb_define_singleton_method(rb_cRuggedOid, "from_raw", rb_git_oid_from_raw, 1);
+
+	rb_define_method(rb_cRuggedOid, "initialize", rb_git_oid_initialize, 1);
+	rb_define_method(rb_cRuggedOid, "initialize_copy", rb_git_oid_initialize_copy, 1);
+	rb_define_method(rb_cRuggedOid, "to_s", rb_git_oid_to_s, 0);
+	rb_define_method(rb_cRuggedOid, "to_str", rb_git_oid_to_s, 0);
+	rb_define_method(rb_cRuggedOid, "hex", rb_git_oid_to_s, 0);
+	rb_define_method(rb_cRuggedOid, "raw", rb_git_oid_raw, 0);
+	rb_define_method(rb_cRuggedOid, "hash", rb_git_oid_hash, 0);
+	rb_define_method(rb_cRuggedOid, "eql?", rb_git_oid_eql, 1);
+	rb_define_method(rb_cRuggedOid, "==", rb_git_oid_equal, 1);
+	rb_define_method(rb_cRuggedOid, "<=>", rb_git_oid_cmp, 1);
+	rb_define_method(rb_cRuggedOid, "inspect", rb_git_oid_inspect, 0);
+
+	rb_define_module_function(rb_mRugged, "oid_format=", rb_git_set_oid_format, 1);
+	rb_define_module_function(rb_mRugged, "oid_format", rb_git_get_oid_format, 0);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+/*
+ * libgit2's ODB can only stream loose objects. Objects stored whole in a
+ * packfile are a single zlib stream though, which libgit2's private pack
+ * API can inflate a window at a time. Like rugged_mwindow.c, this is kept
+ * apart from the rest of the extension so that libgit2's internal headers
+ * never meet ruby.h.
+ */
+#ifdef RUGGED_PACK_STREAM
+
+#include "common.h"
+#include "fs_path.h"
+#include "hash.h"
+#include "mwindow.h"
+#include "pack.h"
+
+#include "rugged_pack_stream.h"
+
+/*
+ * The pack is found without going through the ODB, so what is streamed
+ * is hashed along the way and checked against the requested id, as
+ * git_odb_read() does with strict hash verification.
+ */
+struct rugged_pack_stream {
+	struct git_pack_file *pack;
+	git_packfile_stream stream;
+	git_hash_ctx hash;
+	git_oid oid;
+	int verified;
+};
+
+struct rugged_pack_find {
+	const git_oid *oid;
+	struct git_pack_file *pack;
+	off64_t offset;
+};
+
+static int rugged_pack_find_cb(void *payload, git_str *path)
+{
+	struct rugged_pack_find *find = (struct rugged_pack_find *)payload;
+	struct git_pack_entry entry;
+	struct git_pack_file *pack;
+	int error;
+
+	if (git__suffixcmp(path->ptr, ".idx") != 0)
+		return 0;
+
+	/* Packs are shared with the ODB backends through mwindow's registry */
+	if (git_mwindow_get_pack(&pack, path->ptr, GIT_OID_SHA1) < 0) {
+		git_error_clear();
+		return 0;
+	}
+
+	error = git_pack_entry_find(&entry, pack, find->oid, GIT_OID_SHA1_HEXSIZE);
+
+	if (error == 0) {
+		find->pack = pack;
+		find->offset = entry.offset;
+		return 1;
+	}
+
+	git_mwindow_put_pack(pack);
+	git_error_clear();
+	return 0;
+}
+
+/* Objects are hashed with their loose header, "<type> <size>\0" */
+static int rugged_pack_stream_hash_header(struct rugged_pack_stream *stream, size_t len, git_object_t type)
+{
+	char header[64];
+	int written;
+
+	written = p_snprintf(header, sizeof(header), "%s %" PRIuZ, git_object_type2string(type), len);
+	if (written < 0 || (size_t)written >= sizeof(header)) {
+		git_error_set(GIT_ERROR_OBJECT, "invalid object header");
+		return -1;
+	}
+
+	return git_hash_update(&stream->hash, header, (size_t)written + 1);
+}
+
+int rugged_pack_stream_open(
+	struct rugged_pack_stream **out, size_t *len, git_object_t *type,
+	const char *pack_dir, const git_oid *oid)
+{
+	struct rugged_pack_find find = { oid, NULL, 0 };
+	struct rugged_pack_stream *stream;
+	git_str path = GIT_STR_INIT;
+	git_mwindow *w_curs = NULL;
+	off64_t curpos;
+	int error;
+
+	*out = NULL;
+
+	if ((error = git_str_sets(&path, pack_dir)) < 0)
+		return error;
+
+	git_fs_path_direach(&path, 0, rugged_pack_find_cb, &find);
+	git_str_dispose(&path);
+	git_error_clear();
+
+	if (!find.pack)
+		return GIT_ENOTFOUND;
+
+	curpos = find.offset;
+	error = git_packfile_unpack_header(len, type, find.pack, &w_curs, &curpos);
+	git_mwindow_close(&w_curs);
+
+	if (!error && (*type == GIT_OBJECT_OFS_DELTA || *type == GIT_OBJECT_REF_DELTA))
+		error = GIT_PASSTHROUGH;
+
+	if (error < 0) {
+		git_mwindow_put_pack(find.pack);
+		return error;
+	}
+
+	stream = git__calloc(1, sizeof(*stream));
+	if (!stream) {
+		git_mwindow_put_pack(find.pack);
+		return -1;
+	}
+
+	if ((error = git_hash_ctx_init(&stream->hash, GIT_HASH_ALGORITHM_SHA1)) < 0 ||
+		(error = rugged_pack_stream_hash_header(stream, *len, *type)) < 0 ||
+		(error = git_packfile_stream_open(&stream->stream, find.pack, curpos)) < 0) {
+		git_hash_ctx_cleanup(&stream->hash);
+		git_mwindow_put_pack(find.pack);
+		git__free(stream);
+		return error;
+	}
+
+	git_oid_cpy(&stream->oid, oid);
+
+	stream->pack = find.pack;
+	*out = stream;
+	return 0;
+}
+
+static int rugged_pack_stream_verify(struct rugged_pack_stream *stream)
+{
+	git_oid actual;
+
+	if (stream->verified)
+		return 0;
+
+	memset(&actual, 0, sizeof(actual));
+
+	if (git_hash_final(actual.id, &stream->hash) < 0)
+		return -1;
+
+	if (git_oid_cmp(&actual, &stream->oid) != 0) {
+		git_error_set(GIT_ERROR_ODB, "object hash mismatch while streaming %s",
+			git_oid_tostr_s(&stream->oid));
+		return GIT_EMISMATCH;
+	}
+
+	stream->verified = 1;
+	return 0;
+}
+
+int rugged_pack_stream_read(struct rugged_pack_stream *stream, char *buffer, size_t len)
+{
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	for (;;) {
+		off64_t curpos = stream->stream.curpos;
+		ssize_t read = git_packfile_stream_read(&stream->stream, buffer, len);
+
+		if (read > 0) {
+			if (git_hash_update(&stream->hash, buffer, (size_t)read) < 0)
+				return -1;
+			return (int)read;
+		}
+
+		if (read == 0)
+			return rugged_pack_stream_verify(stream);
+
+		if (read != GIT_EBUFS)
+			return (int)read;
+
+		/* A window that inflated to nothing; go on unless the pack ended */
+		if (stream->stream.curpos == curpos) {
+			git_error_set(GIT_ERROR_ZLIB, "truncated pack entry");
+			return -1;
+		}
+	}
+}
+
+void rugged_pack_stream_free(struct rugged_pack_stream *stream)
+{
+	if (!stream)
+		return;
+
+	git_packfile_stream_dispose(&stream->stream);
+	git_hash_ctx_cleanup(&stream->hash);
+	git_mwindow_put_pack(stream->pack);
+	git__free(stream);
+}
+
+#endif
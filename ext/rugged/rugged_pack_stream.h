@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#ifndef __H_RUGGED_PACK_STREAM__
+#define __H_RUGGED_PACK_STREAM__
+
+#include <git2.h>
+
+/*
+ * Incremental reads of objects stored whole (not as deltas) in a packfile.
+ * Implemented by rugged_pack_stream.c, which is built against the vendored
+ * libgit2's private headers and so must not include ruby.h or rugged.h.
+ */
+struct rugged_pack_stream;
+
+/*
+ * Find +oid+ in the packs of +pack_dir+. Returns GIT_ENOTFOUND if it is
+ * in none of them, and GIT_PASSTHROUGH if it is stored as a delta.
+ */
+int rugged_pack_stream_open(
+	struct rugged_pack_stream **out, size_t *len, git_object_t *type,
+	const char *pack_dir, const git_oid *oid);
+
+/*
+ * Returns the number of bytes read, 0 at the end, or a libgit2 error;
+ * GIT_EMISMATCH at the end if what was read doesn't hash to the object id.
+ */
+int rugged_pack_stream_read(struct rugged_pack_stream *stream, char *buffer, size_t len);
+
+void rugged_pack_stream_free(struct rugged_pack_stream *stream);
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#include "rugged.h"
+#include <ruby/thread.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define RUGGED_PARALLEL_MAX_THREADS 64
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * libgit2 takes internal locks (pack windows, caches) that a forked child
+ * would inherit held if a native thread was using them at fork time, and
+ * the child has no copy of that thread to release them. Work done by our
+ * own threads passes through this gate, which fork() closes and drains.
+ */
+static pthread_mutex_t fork_gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fork_gate_cond = PTHREAD_COND_INITIALIZER;
+static int fork_gate_closed;
+static size_t fork_gate_active;
+#endif
+
+void rugged_fork_gate_enter(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&fork_gate_lock);
+	while (fork_gate_closed)
+		pthread_cond_wait(&fork_gate_cond, &fork_gate_lock);
+	fork_gate_active++;
+	pthread_mutex_unlock(&fork_gate_lock);
+#endif
+}
+
+void rugged_fork_gate_leave(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&fork_gate_lock);
+	if (--fork_gate_active == 0 && fork_gate_closed)
+		pthread_cond_broadcast(&fork_gate_cond);
+	pthread_mutex_unlock(&fork_gate_lock);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void rugged_fork_gate_prepare(void)
+{
+	pthread_mutex_lock(&fork_gate_lock);
+	fork_gate_closed = 1;
+	while (fork_gate_active > 0)
+		pthread_cond_wait(&fork_gate_cond, &fork_gate_lock);
+	pthread_mutex_unlock(&fork_gate_lock);
+}
+
+static void rugged_fork_gate_parent(void)
+{
+	pthread_mutex_lock(&fork_gate_lock);
+	fork_gate_closed = 0;
+	pthread_cond_broadcast(&fork_gate_cond);
+	pthread_mutex_unlock(&fork_gate_lock);
+}
+
+static void rugged_fork_gate_child(void)
+{
+	/* Threads waiting at the gate weren't forked along with us */
+	pthread_mutex_init(&fork_gate_lock, NULL);
+	pthread_cond_init(&fork_gate_cond, NULL);
+	fork_gate_closed = 0;
+	fork_gate_active = 0;
+}
+#endif
+
+struct rugged_parallel {
+	rugged_parallel_cb cb;
+	void *payload;
+	size_t count;
+	size_t next;
+	int threads;
+
+	volatile int cancelled;
+	int error;
+	int error_klass;
+	char error_message[512];
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+};
+
+static void rugged_parallel_lock(struct rugged_parallel *p)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&p->lock);
+#endif
+}
+
+static void rugged_parallel_unlock(struct rugged_parallel *p)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+/*
+ * Record the first failure. libgit2 keeps its error state per thread, so
+ * the message has to be copied out of the worker that saw it.
+ */
+static void rugged_parallel_fail(struct rugged_parallel *p, int error)
+{
+	const git_error *last = giterr_last();
+
+	rugged_parallel_lock(p);
+	if (!p->error) {
+		p->error = error;
+		if (last && last->message) {
+			p->error_klass = last->klass;
+			strncpy(p->error_message, last->message, sizeof(p->error_message) - 1);
+		}
+	}
+	rugged_parallel_unlock(p);
+
+	giterr_clear();
+}
+
+/*
+ * Only native threads of our own go through the fork gate. The calling
+ * Ruby thread may need the GVL mid-callback (xmalloc runs the GC through
+ * rb_thread_call_with_gvl once malloc_increase is over its limit), while
+ * fork() closes the gate with the GVL held, so it must never wait on it.
+ */
+static void rugged_parallel_work(struct rugged_parallel *p, int gated)
+{
+	size_t index;
+	int error;
+
+	for (;;) {
+		rugged_parallel_lock(p);
+		if (p->cancelled || p->error || p->next >= p->count) {
+			rugged_parallel_unlock(p);
+			break;
+		}
+		index = p->next++;
+		rugged_parallel_unlock(p);
+
+		if (gated)
+			rugged_fork_gate_enter();
+		error = p->cb(index, p->payload);
+		if (gated)
+			rugged_fork_gate_leave();
+
+		if (error < 0)
+			rugged_parallel_fail(p, error);
+	}
+}
+
+static void *rugged_parallel_worker(void *_p)
+{
+	rugged_parallel_work((struct rugged_parallel *)_p, 1);
+	return NULL;
+}
+
+static void *rugged_parallel_run_nogvl(void *_p)
+{
+	struct rugged_parallel *p = (struct rugged_parallel *)_p;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t workers[RUGGED_PARALLEL_MAX_THREADS];
+	int started = 0, i;
+
+	/* The calling thread does its share of the work as well */
+	while (started < p->threads - 1) {
+		if (pthread_create(&workers[started], NULL, rugged_parallel_worker, p) != 0)
+			break;
+		started++;
+	}
+
+	rugged_parallel_work(p, 0);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+#else
+	rugged_parallel_work(p, 0);
+#endif
+
+	return NULL;
+}
+
+static void rugged_parallel_cancel(void *_p)
+{
+	struct rugged_parallel *p = (struct rugged_parallel *)_p;
+	p->cancelled = 1;
+}
+
+/*
+ * Call +cb+ once for every index in [0, count), spreading the calls over
+ * up to +threads+ native threads with the GVL released.
+ *
+ * The callback must not touch any Ruby objects. Processing stops at the
+ * first callback returning a negative value; that value is returned and
+ * its libgit2 error is restored on the calling thread.
+ *
+ * Ruby may skip the native call or cut it short whenever an interrupt is
+ * pending, including plain thread switches. The interrupt is then handled
+ * and the work resumed where it stopped; if handling it raises, the
+ * exception propagates from here, so callers must be able to unwind.
+ */
+int rugged_parallel_run(rugged_parallel_cb cb, void *payload, size_t count, int threads)
+{
+	struct rugged_parallel p;
+
+	memset(&p, 0, sizeof(p));
+	p.cb = cb;
+	p.payload = payload;
+	p.count = count;
+	p.threads = threads;
+
+	if ((size_t)p.threads > count)
+		p.threads = (int)count;
+
+	if (count == 0)
+		return 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&p.lock, NULL);
+#endif
+	for (;;) {
+		int exception;
+
+		p.cancelled = 0;
+		rb_thread_call_without_gvl2(rugged_parallel_run_nogvl, &p, rugged_parallel_cancel, &p);
+
+		/* Every worker has been joined, so claimed items are complete */
+		if (p.error || p.next >= p.count)
+			break;
+
+		if ((exception = rugged_check_ints_protect()) != 0) {
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_destroy(&p.lock);
+#endif
+			rb_jump_tag(exception);
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&p.lock);
+#endif
+
+	if (p.error) {
+		if (p.error_message[0])
+			giterr_set_str(p.error_klass, p.error_message);
+		return p.error;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a +threads+ option: a positive Integer, or +nil+ for one
+ * thread per online CPU.
+ */
+int rugged_parallel_threads_get(VALUE rb_threads)
+{
+	long threads = 1;
+
+	if (NIL_P(rb_threads)) {
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads < 1)
+			threads = 1;
+	} else {
+		Check_Type(rb_threads, T_FIXNUM);
+		threads = FIX2LONG(rb_threads);
+
+		if (threads < 1)
+			rb_raise(rb_eArgError, "threads must be a positive integer");
+	}
+
+	if (threads > RUGGED_PARALLEL_MAX_THREADS)
+		threads = RUGGED_PARALLEL_MAX_THREADS;
+
+	return (int)threads;
+}
+
+void Init_rugged_parallel(void)
+{
+#ifdef HAVE_PTHREAD_H
+	/*
+	 * Must be called after rugged_set_allocator(): prepare handlers run in
+	 * reverse order of registration, and the work this one drains may
+	 * still need the allocator's locks.
+	 */
+	pthread_atfork(rugged_fork_gate_prepare, rugged_fork_gate_parent, rugged_fork_gate_child);
+#endif
+}
@@ -75,10 +75,24 @@ static void rb_git_patch__free(void *data)
 	git_patch_free(patch);
 }
 
+static size_t rb_git_patch__size(const void *data)
+{
+	git_patch *patch = (git_patch *) data;
+	size_t context = 0, additions = 0, deletions = 0;
+
+	git_patch_line_stats(&context, &additions, &deletions, patch);
+
+	/* Line content and hunk headers, plus the structs describing them */
+	return git_patch_size(patch, 1, 1, 0) +
+		git_patch_num_hunks(patch) * sizeof(git_diff_hunk) +
+		(context + additions + deletions) * sizeof(git_diff_line);
+}
+
 const rb_data_type_t rugged_patch_type = {
 	.wrap_struct_name = "Rugged::Patch",
 	.function = {
 		.dfree = rb_git_patch__free,
+		.dsize = rb_git_patch__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -393,6 +407,135 @@ static VALUE rb_git_diff_patch_header(VALUE self)
 	return rb_ary_join(rb_buffer, Qnil);
 }
 
+void rugged_columns_init(struct rugged_columns *columns)
+{
+	columns->origins = rb_str_buf_new(0);
+	columns->old_lines = rb_str_buf_new(0);
+	columns->new_lines = rb_str_buf_new(0);
+	columns->offsets = rb_str_buf_new(0);
+	columns->content = rb_str_buf_new(0);
+}
+
+static void rugged_columns_push(struct rugged_columns *columns,
+	char origin, int old_lineno, int new_lineno, const char *content, size_t content_len)
+{
+	size_t offset = RSTRING_LEN(columns->content);
+	int32_t old_row = old_lineno, new_row = new_lineno;
+	uint32_t offset_row = (uint32_t)offset;
+
+	rb_str_cat(columns->origins, &origin, 1);
+	rb_str_cat(columns->old_lines, (const char *)&old_row, sizeof(old_row));
+	rb_str_cat(columns->new_lines, (const char *)&new_row, sizeof(new_row));
+	rb_str_cat(columns->offsets, (const char *)&offset_row, sizeof(offset_row));
+	rb_str_cat(columns->content, content, content_len);
+}
+
+/*
+ * Append a row for every hunk header and line of +patch+. Fails, rather
+ * than raising, once the content would no longer fit 32-bit offsets.
+ */
+int rugged_columns_add_patch(struct rugged_columns *columns, git_patch *patch)
+{
+	size_t h, hunks_count = git_patch_num_hunks(patch);
+	size_t size = git_patch_size(patch, 1, 1, 0);
+
+	if (size > UINT32_MAX - (size_t)RSTRING_LEN(columns->content)) {
+		giterr_set_str(GITERR_INVALID, "patch content is too large for 32-bit offsets");
+		return GIT_ERROR;
+	}
+
+	rb_str_modify_expand(columns->content, size);
+
+	for (h = 0; h < hunks_count; ++h) {
+		const git_diff_hunk *hunk;
+		size_t l, lines_in_hunk;
+		int error;
+
+		if ((error = git_patch_get_hunk(&hunk, &lines_in_hunk, patch, h)) < 0)
+			return error;
+
+		rugged_columns_push(columns, GIT_DIFF_LINE_HUNK_HDR,
+			hunk->old_start, hunk->new_start, hunk->header, hunk->header_len);
+
+		for (l = 0; l < lines_in_hunk; ++l) {
+			const git_diff_line *line;
+
+			if ((error = git_patch_get_line_in_hunk(&line, patch, h, l)) < 0)
+				return error;
+
+			rugged_columns_push(columns, line->origin,
+				line->old_lineno, line->new_lineno, line->content, line->content_len);
+		}
+	}
+
+	return 0;
+}
+
+VALUE rugged_columns_finish(struct rugged_columns *columns)
+{
+	uint32_t end = (uint32_t)RSTRING_LEN(columns->content);
+	VALUE rb_result = rb_hash_new();
+
+	/* One more offset than rows, so that row i spans offsets[i]...offsets[i + 1] */
+	rb_str_cat(columns->offsets, (const char *)&end, sizeof(end));
+
+	rb_enc_associate(columns->origins, rb_usascii_encoding());
+
+	rb_hash_aset(rb_result, CSTR2SYM("origins"), columns->origins);
+	rb_hash_aset(rb_result, CSTR2SYM("old_lines"), columns->old_lines);
+	rb_hash_aset(rb_result, CSTR2SYM("new_lines"), columns->new_lines);
+	rb_hash_aset(rb_result, CSTR2SYM("offsets"), columns->offsets);
+	rb_hash_aset(rb_result, CSTR2SYM("content"), columns->content);
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    patch.to_columns -> hash
+ *
+ *  Returns the hunks and lines of the patch as parallel columns, built in
+ *  one pass and without creating a Hunk or Line object per row. Each hunk
+ *  contributes a row for its header followed by a row per line. The Hash
+ *  has the following keys:
+ *
+ *  :origins ::
+ *    A String with one character per row: the libgit2 line origin, such as
+ *    <tt>" "</tt>, <tt>"+"</tt> or <tt>"-"</tt> for lines, or <tt>"H"</tt>
+ *    for hunk headers.
+ *
+ *  :old_lines, :new_lines ::
+ *    The line numbers of each row in the old and new file, packed as
+ *    native 32-bit integers (<tt>unpack("l*")</tt>), or -1 when the line
+ *    doesn't exist on that side. For hunk headers, these are the start
+ *    lines of the hunk.
+ *
+ *  :offsets ::
+ *    Byte offsets into +:content+, packed as native unsigned 32-bit
+ *    integers (<tt>unpack("L*")</tt>). There is one more offset than there
+ *    are rows: the content of row +i+ is <tt>content.byteslice(offsets[i]...offsets[i + 1])</tt>.
+ *
+ *  :content ::
+ *    The content of every row, back to back, as a binary String.
+ *
+ *    columns = patch.to_columns
+ *    offsets = columns[:offsets].unpack("L*")
+ *    columns[:origins].each_char.with_index do |origin, i|
+ *      puts origin + columns[:content].byteslice(offsets[i]...offsets[i + 1])
+ *    end
+ */
+static VALUE rb_git_diff_patch_to_columns(VALUE self)
+{
+	git_patch *patch;
+	struct rugged_columns columns;
+	TypedData_Get_Struct(self, git_patch, &rugged_patch_type, patch);
+
+	rugged_columns_init(&columns);
+	rugged_exception_check(rugged_columns_add_patch(&columns, patch));
+
+	return rugged_columns_finish(&columns);
+}
+
 
 void Init_rugged_patch(void)
 {
@@ -409,6 +552,7 @@ void Init_rugged_patch(void)
 
 	rb_define_method(rb_cRuggedPatch, "header", rb_git_diff_patch_header, 0);
 	rb_define_method(rb_cRuggedPatch, "to_s", rb_git_diff_patch_to_s, 0);
+	rb_define_method(rb_cRuggedPatch, "to_columns", rb_git_diff_patch_to_columns, 0);
 
 	rb_define_method(rb_cRuggedPatch, "each_hunk", rb_git_diff_patch_each_hunk, 0);
 	rb_define_method(rb_cRuggedPatch, "hunk_count", rb_git_diff_patch_hunk_count, 0);
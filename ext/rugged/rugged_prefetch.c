@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) the Rugged contributors.  All rights reserved.
+ *
+ * This file is part of Rugged, distributed under the MIT license.
+ * For full terms see the included LICENSE file.
+ */
+
+#include "rugged.h"
+#include <ruby/thread.h>
+#include <ruby/atomic.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+extern VALUE rb_mRugged;
+extern VALUE rb_cRuggedRepo;
+extern const rb_data_type_t rugged_repository_type;
+
+VALUE rb_cRuggedPrefetch;
+
+#define RUGGED_PREFETCH_DEFAULT_DEPTH 1000
+
+/* Keeps the queue and the set of seen commits to a few hundred megabytes */
+#define RUGGED_PREFETCH_MAX_DEPTH (1 << 22)
+
+/*
+ * State shared between a Rugged::Prefetch and the native thread doing the
+ * work. Either side may go away first, so it is reference counted and
+ * allocated with the system allocator rather than Ruby's.
+ */
+struct rugged_prefetch {
+	rb_atomic_t refcount;
+	volatile int cancelled;
+	volatile int interrupted;
+	int done;
+
+	git_odb *odb;
+	git_oid *starts;
+	size_t nstarts;
+	size_t depth;
+	int trees;
+
+	size_t commits;
+	size_t trees_read;
+	size_t missing;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pthread_t thread;
+	struct rugged_prefetch *next;
+
+	/*
+	 * Reading through the repository's ODB fills the repository's object
+	 * cache, so the Repository is kept alive until the thread finishes.
+	 */
+	git_repository *repo;
+	VALUE rb_repo;
+
+	/* Set in a forked child, which didn't inherit the thread */
+	int lost;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Prefetches whose thread hasn't been joined yet, each holding the
+ * reference its thread works with. The threads must all be stopped before
+ * libgit2 shuts down when Ruby exits, so they aren't detached.
+ */
+static pthread_mutex_t prefetch_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rugged_prefetch *prefetch_registry;
+static VALUE rb_prefetch_registry;
+#endif
+
+static void rugged_prefetch_release(struct rugged_prefetch *p)
+{
+	if (RUBY_ATOMIC_FETCH_SUB(p->refcount, 1) != 1)
+		return;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+#endif
+	git_odb_free(p->odb);
+	free(p->starts);
+	free(p);
+}
+
+/*
+ * A small open-addressing set of OIDs, so that merges in the history are
+ * only visited once.
+ */
+struct rugged_oid_set {
+	git_oid *slots;
+	unsigned char *used;
+	size_t mask;
+};
+
+static int rugged_oid_set_init(struct rugged_oid_set *set, size_t capacity)
+{
+	size_t size = 16;
+
+	if (capacity > SIZE_MAX / 4 / sizeof(git_oid))
+		return -1;
+
+	while (size < capacity * 2)
+		size <<= 1;
+
+	set->slots = malloc(size * sizeof(git_oid));
+	set->used = calloc(size, 1);
+	set->mask = size - 1;
+
+	return (set->slots && set->used) ? 0 : -1;
+}
+
+static void rugged_oid_set_free(struct rugged_oid_set *set)
+{
+	free(set->slots);
+	free(set->used);
+}
+
+/* Returns 1 if +oid+ was added, 0 if it was already present */
+static int rugged_oid_set_add(struct rugged_oid_set *set, const git_oid *oid)
+{
+	size_t i;
+
+	memcpy(&i, oid->id, sizeof(i));
+
+	for (i &= set->mask; set->used[i]; i = (i + 1) & set->mask) {
+		if (git_oid_equal(&set->slots[i], oid))
+			return 0;
+	}
+
+	git_oid_cpy(&set->slots[i], oid);
+	set->used[i] = 1;
+	return 1;
+}
+
+/*
+ * Read +oid+ into the ODB cache and queue its parents. Commits are parsed
+ * by hand from their raw header, since this thread has no repository to
+ * look them up through.
+ */
+static void rugged_prefetch_commit(struct rugged_prefetch *p, const git_oid *oid,
+	struct rugged_oid_set *seen, git_oid *queue, size_t *queued)
+{
+	git_odb_object *obj;
+	const char *data, *end;
+	git_oid parent;
+
+	if (git_odb_read(&obj, p->odb, oid) < 0) {
+		giterr_clear();
+		p->missing++;
+		return;
+	}
+
+	p->commits++;
+
+	data = git_odb_object_data(obj);
+	end = data + git_odb_object_size(obj);
+
+	if (git_odb_object_type(obj) != GIT_OBJ_COMMIT ||
+		end - data < 5 + GIT_OID_HEXSZ + 1 || memcmp(data, "tree ", 5) != 0)
+		goto done;
+
+	if (p->trees && git_oid_fromstrn(&parent, data + 5, GIT_OID_HEXSZ) == 0) {
+		git_odb_object *tree;
+
+		if (git_odb_read(&tree, p->odb, &parent) == 0) {
+			git_odb_object_free(tree);
+			p->trees_read++;
+		} else {
+			giterr_clear();
+			p->missing++;
+		}
+	}
+
+	data += 5 + GIT_OID_HEXSZ + 1;
+
+	while (end - data >= 7 + GIT_OID_HEXSZ + 1 && memcmp(data, "parent ", 7) == 0) {
+		if (*queued < p->depth &&
+			git_oid_fromstrn(&parent, data + 7, GIT_OID_HEXSZ) == 0 &&
+			rugged_oid_set_add(seen, &parent))
+			git_oid_cpy(&queue[(*queued)++], &parent);
+
+		data += 7 + GIT_OID_HEXSZ + 1;
+	}
+
+done:
+	git_odb_object_free(obj);
+}
+
+static void rugged_prefetch_run(struct rugged_prefetch *p)
+{
+	struct rugged_oid_set seen;
+	git_oid *queue, zero;
+	size_t i, head = 0, queued = 0;
+
+	/*
+	 * Looking up an object that can't exist makes libgit2 refresh the
+	 * packfile list and open the index of every pack.
+	 */
+	memset(&zero, 0, sizeof(zero));
+	rugged_fork_gate_enter();
+	git_odb_exists(p->odb, &zero);
+	rugged_fork_gate_leave();
+
+	queue = p->depth <= SIZE_MAX / sizeof(git_oid) ?
+		malloc(p->depth * sizeof(git_oid)) : NULL;
+
+	if (!queue || rugged_oid_set_init(&seen, p->depth) < 0) {
+		free(queue);
+		return;
+	}
+
+	for (i = 0; i < p->nstarts && queued < p->depth; ++i) {
+		if (rugged_oid_set_add(&seen, &p->starts[i]))
+			git_oid_cpy(&queue[queued++], &p->starts[i]);
+	}
+
+	/* Breadth first, so the most recent history is warmed first */
+	while (head < queued && !p->cancelled) {
+		rugged_fork_gate_enter();
+		rugged_prefetch_commit(p, &queue[head++], &seen, queue, &queued);
+		rugged_fork_gate_leave();
+	}
+
+	rugged_oid_set_free(&seen);
+	free(queue);
+}
+
+static void rugged_prefetch_finish(struct rugged_prefetch *p)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+#else
+	p->done = 1;
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *rugged_prefetch_thread(void *_p)
+{
+	struct rugged_prefetch *p = (struct rugged_prefetch *)_p;
+
+	rugged_prefetch_run(p);
+	rugged_prefetch_finish(p);
+
+	return NULL;
+}
+
+static int rugged_prefetch_done(struct rugged_prefetch *p)
+{
+	int done;
+
+	pthread_mutex_lock(&p->lock);
+	done = p->done;
+	pthread_mutex_unlock(&p->lock);
+
+	return done;
+}
+
+/*
+ * Join the threads of the prefetches that have finished, or with +all+,
+ * cancel and join every one of them, and drop the references they held.
+ * With +repo+, only the prefetches of that repository are considered.
+ */
+static void rugged_prefetch_reap(int all, git_repository *repo)
+{
+	struct rugged_prefetch *p, **pp, *reaped = NULL;
+
+	pthread_mutex_lock(&prefetch_registry_lock);
+	for (pp = &prefetch_registry; (p = *pp) != NULL; ) {
+		if (repo && p->repo != repo) {
+			pp = &p->next;
+			continue;
+		}
+
+		if (all)
+			p->cancelled = 1;
+
+		if (all || rugged_prefetch_done(p)) {
+			*pp = p->next;
+			p->next = reaped;
+			reaped = p;
+		} else {
+			pp = &p->next;
+		}
+	}
+	pthread_mutex_unlock(&prefetch_registry_lock);
+
+	while ((p = reaped) != NULL) {
+		reaped = p->next;
+		pthread_join(p->thread, NULL);
+		rugged_prefetch_release(p);
+	}
+}
+
+/* Keep the repositories of running prefetches alive */
+static void rugged_prefetch_registry_mark(void *unused)
+{
+	struct rugged_prefetch *p;
+
+	pthread_mutex_lock(&prefetch_registry_lock);
+	for (p = prefetch_registry; p; p = p->next) {
+		if (!rugged_prefetch_done(p))
+			rb_gc_mark(p->rb_repo);
+	}
+	pthread_mutex_unlock(&prefetch_registry_lock);
+}
+
+static const rb_data_type_t rugged_prefetch_registry_type = {
+	.wrap_struct_name = "Rugged::Prefetch registry",
+	.function = {
+		.dmark = rugged_prefetch_registry_mark,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+#else
+static void *rugged_prefetch_run_nogvl(void *_p)
+{
+	rugged_prefetch_run((struct rugged_prefetch *)_p);
+	return NULL;
+}
+
+static void rugged_prefetch_cancel_ubf(void *_p)
+{
+	((struct rugged_prefetch *)_p)->cancelled = 1;
+}
+#endif
+
+static void rb_git_prefetch__free(void *data)
+{
+	struct rugged_prefetch *p = (struct rugged_prefetch *)data;
+
+	/* Nobody can wait for the results any more */
+	p->cancelled = 1;
+
+#ifdef HAVE_PTHREAD_H
+	/* Drop the reference of a thread that was lost to a fork */
+	if (p->lost)
+		rugged_prefetch_release(p);
+#endif
+
+	rugged_prefetch_release(p);
+}
+
+static size_t rb_git_prefetch__size(const void *data)
+{
+	const struct rugged_prefetch *p = (const struct rugged_prefetch *)data;
+	return sizeof(*p) + p->nstarts * sizeof(git_oid);
+}
+
+static const rb_data_type_t rugged_prefetch_type = {
+	.wrap_struct_name = "Rugged::Prefetch",
+	.function = {
+		.dfree = rb_git_prefetch__free,
+		.dsize = rb_git_prefetch__size,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void rugged_prefetch_starts(struct rugged_prefetch *p, git_repository *repo, VALUE rb_refs)
+{
+	long i;
+
+	if (NIL_P(rb_refs))
+		rb_refs = rb_ary_new3(1, rb_str_new_cstr("HEAD"));
+
+	Check_Type(rb_refs, T_ARRAY);
+
+	p->starts = calloc(RARRAY_LEN(rb_refs) ? RARRAY_LEN(rb_refs) : 1, sizeof(git_oid));
+	if (!p->starts)
+		rb_raise(rb_eNoMemError, "failed to allocate prefetch state");
+
+	/*
+	 * References are resolved here rather than on the background thread:
+	 * the refdb belongs to the repository, which is only safe to use from
+	 * the thread holding it. This also loads the packed-refs cache.
+	 */
+	for (i = 0; i < RARRAY_LEN(rb_refs); ++i) {
+		VALUE rb_ref = rb_ary_entry(rb_refs, i);
+		git_oid *oid = &p->starts[p->nstarts];
+		int error;
+
+		if (rugged_oid_extract(oid, rb_ref)) {
+			p->nstarts++;
+			continue;
+		}
+
+		Check_Type(rb_ref, T_STRING);
+		error = git_reference_name_to_id(oid, repo, StringValueCStr(rb_ref));
+
+		if (error == GIT_ENOTFOUND) {
+			giterr_clear();
+			continue;
+		}
+
+		rugged_exception_check(error);
+		p->nstarts++;
+	}
+}
+
+/*
+ *  call-seq:
+ *    repo.prefetch(refs: ["HEAD"], depth: 1000, trees: false) -> prefetch
+ *
+ *  Warm up +repo+ on a native background thread: open the index of every
+ *  packfile and read the +depth+ most recent commits reachable from +refs+
+ *  into the object cache, breadth first. With +trees: true+, the root tree
+ *  of each of those commits is read as well. +depth+ can be at most 4194304.
+ *
+ *  +refs+ is an Array of reference names or Rugged::Oid instances. They are
+ *  resolved before this method returns, which also loads the packed refs;
+ *  names that don't exist are skipped.
+ *
+ *  Returns a Rugged::Prefetch, which can be used to wait for the work to
+ *  finish or to cancel it. The repository can be used normally while the
+ *  prefetch runs, and is kept alive until it finishes. Closing the
+ *  repository cancels its prefetches and waits for them to stop.
+ */
+static VALUE rb_git_repo_prefetch(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_options, rb_prefetch;
+	struct rugged_prefetch *p;
+	git_repository *repo;
+	int error;
+
+	rb_scan_args(argc, argv, "00:", &rb_options);
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		rb_raise(rb_eNoMemError, "failed to allocate prefetch state");
+
+	p->refcount = 1;
+	p->depth = RUGGED_PREFETCH_DEFAULT_DEPTH;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+#endif
+
+	/* From here on, the Prefetch object owns +p+ and frees it on errors */
+	rb_prefetch = TypedData_Wrap_Struct(rb_cRuggedPrefetch, &rugged_prefetch_type, p);
+	p->cancelled = 1;
+
+	if (!NIL_P(rb_options)) {
+		VALUE rb_depth = rb_hash_aref(rb_options, CSTR2SYM("depth"));
+
+		if (!NIL_P(rb_depth)) {
+			Check_Type(rb_depth, T_FIXNUM);
+			if (FIX2LONG(rb_depth) < 0 || FIX2LONG(rb_depth) > RUGGED_PREFETCH_MAX_DEPTH)
+				rb_raise(rb_eArgError, "depth must be between 0 and %d", RUGGED_PREFETCH_MAX_DEPTH);
+			p->depth = FIX2ULONG(rb_depth);
+		}
+
+		p->trees = RTEST(rb_hash_aref(rb_options, CSTR2SYM("trees")));
+		rugged_prefetch_starts(p, repo, rb_hash_aref(rb_options, CSTR2SYM("refs")));
+	} else {
+		rugged_prefetch_starts(p, repo, Qnil);
+	}
+
+	error = git_repository_odb(&p->odb, repo);
+	rugged_exception_check(error);
+
+	p->cancelled = 0;
+	rugged_set_owner(rb_prefetch, self);
+
+#ifdef HAVE_PTHREAD_H
+	rugged_prefetch_reap(0, NULL);
+
+	p->repo = repo;
+	p->rb_repo = self;
+
+	pthread_mutex_lock(&prefetch_registry_lock);
+	RUBY_ATOMIC_INC(p->refcount);
+	error = pthread_create(&p->thread, NULL, rugged_prefetch_thread, p);
+
+	if (error == 0) {
+		p->next = prefetch_registry;
+		prefetch_registry = p;
+	} else {
+		RUBY_ATOMIC_DEC(p->refcount);
+	}
+	pthread_mutex_unlock(&prefetch_registry_lock);
+
+	if (error != 0)
+		rb_raise(rb_eRuntimeError, "failed to start prefetch thread");
+#else
+	/* No native threads: do the work now, at least without the GVL */
+	rb_thread_call_without_gvl(rugged_prefetch_run_nogvl, p, rugged_prefetch_cancel_ubf, p);
+	rugged_prefetch_finish(p);
+#endif
+
+	return rb_prefetch;
+}
+
+static void *rugged_prefetch_wait_nogvl(void *_p)
+{
+	struct rugged_prefetch *p = (struct rugged_prefetch *)_p;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&p->lock);
+	while (!p->done && !p->interrupted)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+#endif
+
+	return NULL;
+}
+
+static void rugged_prefetch_wait_ubf(void *_p)
+{
+#ifdef HAVE_PTHREAD_H
+	struct rugged_prefetch *p = (struct rugged_prefetch *)_p;
+
+	pthread_mutex_lock(&p->lock);
+	p->interrupted = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+static struct rugged_prefetch *rugged_prefetch_get(VALUE self)
+{
+	struct rugged_prefetch *p;
+	TypedData_Get_Struct(self, struct rugged_prefetch, &rugged_prefetch_type, p);
+	return p;
+}
+
+/* A prefetch inherited from before a fork will never finish; treat it as cancelled */
+static int rugged_prefetch_finished(struct rugged_prefetch *p)
+{
+#ifdef HAVE_PTHREAD_H
+	return p->done || p->lost;
+#else
+	return p->done;
+#endif
+}
+
+/*
+ *  call-seq:
+ *    prefetch.wait -> hash
+ *
+ *  Block until the prefetch has finished, without holding the GVL, and
+ *  return a Hash with the number of +:commits+ and +:trees+ that were read
+ *  and of objects that were +:missing+.
+ */
+static VALUE rb_git_prefetch_wait(VALUE self)
+{
+	struct rugged_prefetch *p = rugged_prefetch_get(self);
+	VALUE rb_result;
+
+	while (!rugged_prefetch_finished(p)) {
+		p->interrupted = 0;
+		rb_thread_call_without_gvl(rugged_prefetch_wait_nogvl, p, rugged_prefetch_wait_ubf, p);
+		rb_thread_check_ints();
+	}
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("commits"), SIZET2NUM(p->commits));
+	rb_hash_aset(rb_result, CSTR2SYM("trees"), SIZET2NUM(p->trees_read));
+	rb_hash_aset(rb_result, CSTR2SYM("missing"), SIZET2NUM(p->missing));
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    prefetch.done? -> true or false
+ *
+ *  Return whether the prefetch has finished (or was cancelled).
+ */
+static VALUE rb_git_prefetch_done_p(VALUE self)
+{
+	return rugged_prefetch_finished(rugged_prefetch_get(self)) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    prefetch.cancel -> prefetch
+ *
+ *  Ask the background thread to stop after the object it is reading.
+ */
+static VALUE rb_git_prefetch_cancel(VALUE self)
+{
+	rugged_prefetch_get(self)->cancelled = 1;
+	return self;
+}
+
+/*
+ * Cancel every prefetch and wait for its thread to stop. Called before
+ * libgit2 shuts down, which the threads would otherwise outlive.
+ */
+void rugged_prefetch_shutdown(void)
+{
+#ifdef HAVE_PTHREAD_H
+	rugged_prefetch_reap(1, NULL);
+#endif
+}
+
+/*
+ * Cancel the prefetches of +repo+ and wait for their threads to stop,
+ * before the repository's caches are cleared or freed.
+ */
+void rugged_prefetch_stop(git_repository *repo)
+{
+#ifdef HAVE_PTHREAD_H
+	rugged_prefetch_reap(1, repo);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void rugged_prefetch_atfork_child(void)
+{
+	struct rugged_prefetch *p;
+
+	for (p = prefetch_registry; p; p = p->next) {
+		pthread_mutex_init(&p->lock, NULL);
+		pthread_cond_init(&p->cond, NULL);
+		p->lost = 1;
+	}
+
+	prefetch_registry = NULL;
+	pthread_mutex_init(&prefetch_registry_lock, NULL);
+}
+#endif
+
+void Init_rugged_prefetch(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_atfork(NULL, NULL, rugged_prefetch_atfork_child);
+
+	rb_prefetch_registry = TypedData_Wrap_Struct(0, &rugged_prefetch_registry_type, NULL);
+	rb_global_variable(&rb_prefetch_registry);
+#endif
+
+	rb_cRuggedPrefetch = rb_define_class_under(rb_mRugged, "Prefetch", rb_cObject);
+	rb_undef_alloc_func(rb_cRuggedPrefetch);
+
+	rb_define_method(rb_cRuggedPrefetch, "wait", rb_git_prefetch_wait, 0);
+	rb_define_method(rb_cRuggedPrefetch, "done?", rb_git_prefetch_done_p, 0);
+	rb_define_method(rb_cRuggedPrefetch, "cancel", rb_git_prefetch_cancel, 0);
+
+	rb_define_method(rb_cRuggedRepo, "prefetch", rb_git_repo_prefetch, -1);
+}
@@ -50,10 +50,18 @@ static void rb_git_rebase__free(void *data)
 	git_rebase_free(rebase);
 }
 
+static size_t rb_git_rebase__size(const void *data)
+{
+	git_rebase *rebase = (git_rebase *) data;
+
+	return git_rebase_operation_entrycount(rebase) * sizeof(git_rebase_operation) + 256;
+}
+
 const rb_data_type_t rugged_rebase_type = {
 	.wrap_struct_name = "Rugged::Rebase",
 	.function = {
 		.dfree = rb_git_rebase__free,
+		.dsize = rb_git_rebase__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -18,10 +18,19 @@ void rb_git_ref__free(void *data)
 	git_reference_free(ref);
 }
 
+static size_t rb_git_ref__size(const void *data)
+{
+	git_reference *ref = (git_reference *) data;
+
+	/* The name is allocated inline with the reference */
+	return 64 + strlen(git_reference_name(ref));
+}
+
 const rb_data_type_t rugged_reference_type = {
 	.wrap_struct_name = "Rugged::Reference",
 	.function = {
 		.dfree = rb_git_ref__free,
+		.dsize = rb_git_ref__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
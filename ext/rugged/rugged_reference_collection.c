@@ -60,6 +60,10 @@ static VALUE rb_git_reference_collection_create(int argc, VALUE *argv, VALUE sel
 	rugged_check_repo(rb_repo);
 	TypedData_Get_Struct(rb_repo, git_repository, &rugged_repository_type, repo);
 	Check_Type(rb_name, T_STRING);
+
+	if (rb_obj_is_kind_of(rb_target, rb_cRuggedOid))
+		rb_target = rb_obj_as_string(rb_target);
+
 	Check_Type(rb_target, T_STRING);
 
 	if (!NIL_P(rb_options)) {
@@ -328,6 +332,8 @@ static VALUE rb_git_reference_collection_update(int argc, VALUE *argv, VALUE sel
 
 	if (rb_obj_is_kind_of(rb_target, rb_cRuggedReference))
 		rb_target = rb_funcall(rb_target, rb_intern("canonical_name"), 0);
+	else if (rb_obj_is_kind_of(rb_target, rb_cRuggedOid))
+		rb_target = rb_obj_as_string(rb_target);
 
 	if (TYPE(rb_target) != T_STRING)
 		rb_raise(rb_eTypeError, "Expecting a String or Rugged::Reference instance");
@@ -266,10 +266,20 @@ static void rb_git_remote__free(void *data)
 	git_remote_free(remote);
 }
 
+static size_t rb_git_remote__size(const void *data)
+{
+	git_remote *remote = (git_remote *) data;
+	const char *url = git_remote_url(remote);
+
+	/* Refspecs and the connection state are opaque; guess the rest */
+	return 512 + (url ? strlen(url) : 0);
+}
+
 const rb_data_type_t rugged_remote_type = {
 	.wrap_struct_name = "Rugged::Remote",
 	.function = {
 		.dfree = rb_git_remote__free,
+		.dsize = rb_git_remote__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -643,6 +653,7 @@ static VALUE rb_git_remote_fetch(int argc, VALUE *argv, VALUE self)
 	struct rugged_remote_cb_payload payload = { Qnil, Qnil, Qnil, Qnil, Qnil, Qnil, Qnil, 0 };
 
 	char *log_message = NULL;
+	uint64_t started = rugged_instrument_start();
 	int error;
 
 	VALUE rb_options, rb_refspecs, rb_result = Qnil;
@@ -688,6 +699,14 @@ static VALUE rb_git_remote_fetch(int argc, VALUE *argv, VALUE self)
 	rb_hash_aset(rb_result, CSTR2SYM("indexed_deltas"),   UINT2NUM(stats->indexed_deltas));
 	rb_hash_aset(rb_result, CSTR2SYM("received_bytes"),   INT2FIX(stats->received_bytes));
 
+	if (started) {
+		const char *name = git_remote_name(remote);
+		VALUE rb_payload = rb_hash_dup(rb_result);
+
+		rb_hash_aset(rb_payload, CSTR2SYM("remote"), name ? rb_str_new_utf8(name) : Qnil);
+		rugged_instrument_emit("remote.fetch", started, rb_payload);
+	}
+
 	return rb_result;
 }
 
@@ -11,6 +11,16 @@
 #include <git2/sys/refdb_backend.h>
 #include <git2/refs.h>
 #include <git2/apply.h>
+#include <git2/sys/commit_graph.h>
+#include <ruby/thread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef RUGGED_PACK_STREAM
+#include "rugged_pack_stream.h"
+#endif
+#ifdef RUGGED_OBJECT_CACHE
+#include "rugged_object_cache.h"
+#endif
 
 extern VALUE rb_mRugged;
 extern VALUE rb_eRuggedError;
@@ -31,6 +41,7 @@ extern VALUE rb_cRuggedCredDefault;
 
 VALUE rb_cRuggedRepo;
 VALUE rb_cRuggedOdbObject;
+VALUE rb_cRuggedOdbWriter;
 
 static ID id_call;
 
@@ -59,19 +70,33 @@ static VALUE rb_git_odbobj_oid(VALUE self)
 
 /*
  *  call-seq:
- *    odb_obj.data -> buffer
+ *    odb_obj.data -> string
+ *    odb_obj.data(buffer: true) -> io_buffer
  *
  *  Return an ASCII buffer with the raw bytes that form the Git object.
  *
+ *  If +buffer+ is +true+, a read-only IO::Buffer pointing directly at the
+ *  object's data is returned instead of a String, which would have to be a
+ *  copy; +odb_obj+ is kept alive for as long as the buffer, or any slice
+ *  of it, is. This requires Ruby 3.1 or later, and raises
+ *  NotImplementedError otherwise.
+ *
  *    odb_obj.data #=> "tree 87ebee8367f9cc5ac04858b3bd5610ca74f04df9\n"
  *                 #=> "parent 68d041ee999cb07c6496fbdd4f384095de6ca9e1\n"
  *                 #=> "author Vicent Martí <tanoku@gmail.com> 1326863045 -0800\n"
  *                 #=> ...
  */
-static VALUE rb_git_odbobj_data(VALUE self)
+static VALUE rb_git_odbobj_data(int argc, VALUE *argv, VALUE self)
 {
 	git_odb_object *obj;
+	VALUE rb_options;
+
+	rb_scan_args(argc, argv, "00:", &rb_options);
 	TypedData_Get_Struct(self, git_odb_object, &rugged_odb_object_type, obj);
+
+	if (!NIL_P(rb_options) && RTEST(rb_hash_aref(rb_options, CSTR2SYM("buffer"))))
+		return rugged_buffer_new_borrowed(self, git_odb_object_data(obj), git_odb_object_size(obj));
+
 	return rb_str_new(git_odb_object_data(obj), git_odb_object_size(obj));
 }
 
@@ -130,33 +155,132 @@ static const rb_data_type_t rugged_odb_object_type = {
 
 
 
+/*
+ * Whether a read of +oid+ would be served from +repo+'s object cache: 1 or
+ * 0, or -1 if that can't be told, since only the vendored libgit2 lets us
+ * look into its cache. +raw+ is set for ODB reads, which can't use parsed
+ * objects. Safe to call without the GVL.
+ */
+int rugged_odb_cached(git_repository *repo, const git_oid *oid, int raw)
+{
+#ifdef RUGGED_OBJECT_CACHE
+	return rugged_object_cache_contains(repo, oid, raw);
+#else
+	return -1;
+#endif
+}
+
+static VALUE rugged_odb_read_publish_protected(VALUE _event)
+{
+	const struct rugged_odb_read_event *event = (const struct rugged_odb_read_event *)_event;
+	VALUE rb_payload = rb_hash_new();
+
+	rb_hash_aset(rb_payload, CSTR2SYM("oid"), rugged_create_oid(event->oid));
+	rb_hash_aset(rb_payload, CSTR2SYM("found"), event->found ? Qtrue : Qfalse);
+	rb_hash_aset(rb_payload, CSTR2SYM("cached"),
+		event->cached < 0 ? Qnil : (event->cached ? Qtrue : Qfalse));
+
+	if (event->found) {
+		rb_hash_aset(rb_payload, CSTR2SYM("type"), rugged_otype_new(event->type));
+		if (event->bytes != SIZE_MAX)
+			rb_hash_aset(rb_payload, CSTR2SYM("bytes"), SIZET2NUM(event->bytes));
+	}
+
+	rugged_instrument_publish("odb.read", event->duration, rb_payload);
+	return Qnil;
+}
+
+/*
+ * Report +event+ to the subscribers. Returns the tag of the exception
+ * raised by one of them, if any, so that the caller can release what it
+ * holds before passing it on with rb_jump_tag().
+ */
+int rugged_odb_read_publish(const struct rugged_odb_read_event *event)
+{
+	int exception = 0;
+
+	rb_protect(rugged_odb_read_publish_protected, (VALUE)event, &exception);
+	return exception;
+}
+
 VALUE rugged_raw_read(git_repository *repo, const git_oid *oid)
 {
 	git_odb *odb;
 	git_odb_object *obj;
+	uint64_t started = rugged_instrument_start();
+	VALUE rb_obj = Qnil;
+	int cached = 0;
 
 	int error;
 
 	error = git_repository_odb(&odb, repo);
 	rugged_exception_check(error);
 
+	if (started)
+		cached = rugged_odb_cached(repo, oid, 1);
+
 	error = git_odb_read(&obj, odb, oid);
 	git_odb_free(odb);
-	rugged_exception_check(error);
 
-	return TypedData_Wrap_Struct(rb_cRuggedOdbObject, &rugged_odb_object_type, obj);
+	if (!error)
+		rb_obj = TypedData_Wrap_Struct(rb_cRuggedOdbObject, &rugged_odb_object_type, obj);
+
+	if (started) {
+		struct rugged_odb_read_event event;
+		int exception;
+
+		event.duration = rugged_instrument_clock() - started;
+		event.oid = oid;
+		event.cached = cached;
+		event.found = !error;
+		event.type = error ? GIT_OBJ_BAD : git_odb_object_type(obj);
+		event.bytes = error ? SIZE_MAX : git_odb_object_size(obj);
+
+		if ((exception = rugged_odb_read_publish(&event)) != 0)
+			rb_jump_tag(exception);
+	}
+
+	rugged_exception_check(error);
+	return rb_obj;
 }
 
 void rb_git_repo__free(void *data)
 {
 	git_repository *repo = (git_repository *) data;
+	rugged_prefetch_stop(repo);
 	git_repository_free(repo);
 }
 
+static size_t rb_git_repo__size(const void *data)
+{
+	git_repository *repo = (git_repository *)data;
+
+	/*
+	 * The object cache is what grows with use. Everything else (config,
+	 * refdb, open packfile windows, which are shared process-wide) is
+	 * opaque, and only accounted for by this placeholder.
+	 */
+	size_t size = 16 * 1024;
+
+#ifdef RUGGED_OBJECT_CACHE
+	size += rugged_object_cache_used(repo);
+#else
+	/* Without the vendored libgit2, only the total of all caches is known */
+	ssize_t cached = 0, allowed = 0;
+
+	(void)repo;
+	if (git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cached, &allowed) == 0 && cached > 0)
+		size += (size_t)cached;
+#endif
+
+	return size;
+}
+
 const rb_data_type_t rugged_repository_type = {
 	.wrap_struct_name = "Rugged::Repository",
 	.function = {
 		.dfree = rb_git_repo__free,
+		.dsize = rb_git_repo__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -1123,7 +1247,7 @@ static VALUE rb_git_repo_merge_commits(int argc, VALUE *argv, VALUE self)
  *    repo.include?(oid) -> true or false
  *    repo.exists?(oid) -> true or false
  *
- *  Return whether an object with the given SHA1 OID (represented as
+ *  Return whether an object with the given SHA1 OID (a Rugged::Oid, or
  *  a hex string of at least 7 characters) exists in the repository.
  *
  *    repo.include?("d8786bfc97485e8d7b19b21fb88c8ef1f199fc3f") #=> true
@@ -1134,18 +1258,23 @@ static VALUE rb_git_repo_exists(VALUE self, VALUE hex)
 	git_repository *repo;
 	git_odb *odb;
 	git_oid oid;
+	size_t len = GIT_OID_HEXSZ;
 	int error;
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
-	Check_Type(hex, T_STRING);
 
-	error = git_oid_fromstrn(&oid, RSTRING_PTR(hex), RSTRING_LEN(hex));
-	rugged_exception_check(error);
+	if (!rugged_oid_extract(&oid, hex)) {
+		Check_Type(hex, T_STRING);
+
+		error = git_oid_fromstrn(&oid, RSTRING_PTR(hex), RSTRING_LEN(hex));
+		rugged_exception_check(error);
+		len = RSTRING_LEN(hex);
+	}
 
 	error = git_repository_odb(&odb, repo);
 	rugged_exception_check(error);
 
-	error = git_odb_exists_prefix(NULL, odb, &oid, RSTRING_LEN(hex));
+	error = git_odb_exists_prefix(NULL, odb, &oid, len);
 	git_odb_free(odb);
 
 	if (error == 0 || error == GIT_EAMBIGUOUS)
@@ -1167,14 +1296,438 @@ static VALUE rb_git_repo_read(VALUE self, VALUE hex)
 	int error;
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
-	Check_Type(hex, T_STRING);
-
-	error = git_oid_fromstr(&oid, StringValueCStr(hex));
+	error = rugged_oid_from_value(&oid, hex);
 	rugged_exception_check(error);
 
 	return rugged_raw_read(repo, &oid);
 }
 
+struct rugged_read_stream {
+	git_odb *odb;
+	git_odb_stream *stream;
+#ifdef RUGGED_PACK_STREAM
+	struct rugged_pack_stream *pack_stream;
+#endif
+	git_odb_object *obj;
+	char *buffer;
+	size_t chunk_size;
+	size_t remaining;
+	int error;
+};
+
+static void *rugged_read_stream_nogvl(void *_payload)
+{
+	struct rugged_read_stream *rs = (struct rugged_read_stream *)_payload;
+
+#ifdef RUGGED_PACK_STREAM
+	if (rs->pack_stream)
+		rs->error = rugged_pack_stream_read(rs->pack_stream, rs->buffer, rs->chunk_size);
+	else
+#endif
+		rs->error = git_odb_stream_read(rs->stream, rs->buffer, rs->chunk_size);
+
+	/* Streams must deliver exactly the size their header announced */
+	if (rs->error > 0 && (size_t)rs->error > rs->remaining) {
+		giterr_set_str(GITERR_ODB, "object is larger than its header says");
+		rs->error = -1;
+	} else if (rs->error == 0 && rs->remaining > 0) {
+		giterr_set_str(GITERR_ODB, "object is smaller than its header says");
+		rs->error = -1;
+	} else if (rs->error > 0) {
+		rs->remaining -= (size_t)rs->error;
+	}
+
+	return NULL;
+}
+
+static VALUE rugged_read_stream_yield(VALUE _payload)
+{
+	struct rugged_read_stream *rs = (struct rugged_read_stream *)_payload;
+
+	if (rs->buffer) {
+		for (;;) {
+			rb_thread_call_without_gvl(rugged_read_stream_nogvl, rs, RUBY_UBF_PROCESS, NULL);
+			rugged_exception_check(rs->error);
+
+			if (rs->error == 0)
+				break;
+
+			rb_yield(rb_str_new(rs->buffer, rs->error));
+		}
+	} else {
+		const char *data = git_odb_object_data(rs->obj);
+		size_t offset, size = git_odb_object_size(rs->obj);
+
+		for (offset = 0; offset < size; offset += rs->chunk_size) {
+			size_t len = size - offset;
+			if (len > rs->chunk_size)
+				len = rs->chunk_size;
+
+			rb_yield(rb_str_new(data + offset, len));
+		}
+	}
+
+	return Qnil;
+}
+
+static VALUE rugged_read_stream_cleanup(VALUE _payload)
+{
+	struct rugged_read_stream *rs = (struct rugged_read_stream *)_payload;
+
+	if (rs->stream)
+		git_odb_stream_free(rs->stream);
+
+#ifdef RUGGED_PACK_STREAM
+	rugged_pack_stream_free(rs->pack_stream);
+#endif
+	git_odb_object_free(rs->obj);
+	git_odb_free(rs->odb);
+	xfree(rs->buffer);
+
+	return Qnil;
+}
+
+#ifdef RUGGED_PACK_STREAM
+static int rugged_read_stream_open_packed(
+	struct rugged_pack_stream **out, size_t *len, git_otype *type,
+	git_repository *repo, const git_oid *oid)
+{
+	git_buf objects_path = {NULL};
+	char *pack_dir;
+	int error;
+
+	error = git_repository_item_path(&objects_path, repo, GIT_REPOSITORY_ITEM_OBJECTS);
+	if (error < 0)
+		return error;
+
+	pack_dir = malloc(objects_path.size + sizeof("pack"));
+	if (!pack_dir) {
+		git_buf_dispose(&objects_path);
+		giterr_set_str(GITERR_NOMEMORY, "out of memory");
+		return -1;
+	}
+
+	memcpy(pack_dir, objects_path.ptr, objects_path.size);
+	memcpy(pack_dir + objects_path.size, "pack", sizeof("pack"));
+	git_buf_dispose(&objects_path);
+
+	error = rugged_pack_stream_open(out, len, type, pack_dir, oid);
+	free(pack_dir);
+
+	return error;
+}
+#endif
+
+/*
+ *  call-seq:
+ *    repo.read_stream(oid, size: 65536) { |chunk| block } -> nil
+ *    repo.read_stream(oid, size: 65536) -> Enumerator
+ *
+ *  Read the raw data of the object identified by the given +oid+, yielding
+ *  it to +block+ in binary Strings of at most +size+ bytes.
+ *
+ *  Loose objects, and objects stored whole in a packfile, are inflated
+ *  incrementally without holding the GVL, so only +size+ bytes of them
+ *  are kept in memory at any time. Large files are rarely stored as
+ *  deltas, since git doesn't delta-compress files above
+ *  <tt>core.bigFileThreshold</tt>.
+ *
+ *  Objects stored as deltas have to be rebuilt in memory from their base,
+ *  so they are read whole, as with Repository#read, and then handed to
+ *  +block+ in windows of +size+ bytes. So are objects that only exist in
+ *  an alternate or a custom backend. Packed objects can only be streamed
+ *  with the vendored libgit2, whose private pack API this relies on.
+ *
+ *  Streamed objects are checked against the size in their header and,
+ *  when packed, against +oid+ itself. Since that can only be done as the
+ *  data goes by, a corrupt object raises Rugged::OdbError after some of
+ *  it may already have been yielded.
+ *
+ *    File.open("out", "wb") do |file|
+ *      repo.read_stream(oid) { |chunk| file.write(chunk) }
+ *    end
+ */
+static VALUE rb_git_repo_read_stream(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_oid, rb_options;
+	git_repository *repo;
+	struct rugged_read_stream rs;
+	git_otype type;
+	size_t len;
+	git_oid oid;
+	uint64_t started;
+	int error, cached = 0;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "10:", &rb_oid, &rb_options);
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+
+	memset(&rs, 0, sizeof(rs));
+	rs.chunk_size = rugged_chunk_size_get(rb_options);
+
+	error = rugged_oid_from_value(&oid, rb_oid);
+	rugged_exception_check(error);
+
+	error = git_repository_odb(&rs.odb, repo);
+	rugged_exception_check(error);
+
+	started = rugged_instrument_start();
+	error = git_odb_open_rstream(&rs.stream, &len, &type, rs.odb, &oid);
+
+	if (error < 0) {
+		giterr_clear();
+		rs.stream = NULL;
+
+		/* Only a whole read goes through the cache */
+		if (started)
+			cached = rugged_odb_cached(repo, &oid, 1);
+
+#ifdef RUGGED_PACK_STREAM
+		error = rugged_read_stream_open_packed(&rs.pack_stream, &len, &type, repo, &oid);
+		if (error == GIT_ENOTFOUND || error == GIT_PASSTHROUGH) {
+			giterr_clear();
+			error = git_odb_read(&rs.obj, rs.odb, &oid);
+		} else {
+			cached = 0;
+		}
+#else
+		error = git_odb_read(&rs.obj, rs.odb, &oid);
+#endif
+
+		if (error < 0)
+			git_odb_free(rs.odb);
+	}
+
+	if (rs.obj) {
+		type = git_odb_object_type(rs.obj);
+		len = git_odb_object_size(rs.obj);
+	}
+
+	if (started) {
+		struct rugged_odb_read_event event;
+		int exception;
+
+		event.duration = rugged_instrument_clock() - started;
+		event.oid = &oid;
+		event.cached = cached;
+		event.found = error >= 0;
+		event.type = type;
+		event.bytes = len;
+
+		if ((exception = rugged_odb_read_publish(&event)) != 0) {
+			if (error >= 0)
+				rugged_read_stream_cleanup((VALUE)&rs);
+			rb_jump_tag(exception);
+		}
+	}
+
+	rugged_exception_check(error);
+
+	if (!rs.obj) {
+		rs.remaining = len;
+		rs.buffer = xmalloc(rs.chunk_size);
+	}
+
+	rb_ensure(rugged_read_stream_yield, (VALUE)&rs, rugged_read_stream_cleanup, (VALUE)&rs);
+
+	return Qnil;
+}
+
+struct nogvl_read_many_args {
+	git_repository *repo;
+	git_odb *odb;
+	const git_oid *oids;
+	const git_otype *types;
+	git_odb_object **objects;
+	struct rugged_odb_read_event *events;
+	size_t count, next;
+	volatile int cancelled;
+	int error;
+};
+
+static void *rb_git_repo_read_many_nogvl(void *_args)
+{
+	struct nogvl_read_many_args *args = (struct nogvl_read_many_args *)_args;
+	struct rugged_odb_read_event *event = NULL;
+	uint64_t started = 0;
+	size_t i;
+	int error = 0;
+
+	for (i = args->next; i < args->count && !args->cancelled; ++i) {
+		if (args->events) {
+			event = &args->events[i];
+			event->oid = &args->oids[i];
+			event->cached = rugged_odb_cached(args->repo, &args->oids[i], 1);
+			started = rugged_instrument_clock();
+		}
+
+		error = git_odb_read(&args->objects[i], args->odb, &args->oids[i]);
+
+		if (event) {
+			event->duration = rugged_instrument_clock() - started;
+			event->found = error == 0;
+			if (event->found) {
+				event->type = git_odb_object_type(args->objects[i]);
+				event->bytes = git_odb_object_size(args->objects[i]);
+			}
+		}
+
+		if (error == GIT_ENOTFOUND) {
+			giterr_clear();
+			args->objects[i] = NULL;
+			error = 0;
+			continue;
+		}
+
+		if (error < 0)
+			break;
+
+		if (args->types[i] != GIT_OBJ_ANY &&
+			git_odb_object_type(args->objects[i]) != args->types[i]) {
+			git_odb_object_free(args->objects[i]);
+			args->objects[i] = NULL;
+		}
+	}
+
+	if (error < 0) {
+		while (i-- > 0)
+			git_odb_object_free(args->objects[i]);
+		i = 0;
+	}
+
+	args->next = i;
+	args->error = error;
+	return NULL;
+}
+
+static void rb_git_repo_read_many_cancel(void *_args)
+{
+	((struct nogvl_read_many_args *)_args)->cancelled = 1;
+}
+
+/*
+ *  call-seq:
+ *    repo.read_many(oids, types: nil) -> Array
+ *
+ *  Read the raw data of all the objects identified by the +oids+ Array in
+ *  a single call, similar to <tt>git cat-file --batch</tt>.
+ *
+ *  Returns an Array of Rugged::OdbObject instances in the same order as
+ *  +oids+. Objects that do not exist in the repository are returned
+ *  as +nil+.
+ *
+ *  If +types+ is given, it can either be a single type (e.g. +:blob+)
+ *  that all objects are expected to have, or an Array of types of the same
+ *  length as +oids+. Objects whose type does not match are returned as
+ *  +nil+.
+ *
+ *  All the objects are looked up and inflated without holding the GVL.
+ *
+ *    repo.read_many(["8496071c1b46c854b31185ea97743be6a8774479", "a496071c1b46c854b31185ea97743be6a8774471"])
+ *    #=> [#<Rugged::OdbObject ...>, nil]
+ */
+static VALUE rb_git_repo_read_many(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_oids, rb_options, rb_types = Qnil, rb_result;
+	VALUE rb_oids_buffer, rb_types_buffer, rb_objects_buffer, rb_events_buffer = 0;
+	struct nogvl_read_many_args args;
+	git_repository *repo;
+	git_oid *oids;
+	git_otype *types, expected_type = GIT_OBJ_ANY;
+	long i, count;
+	int error;
+
+	rb_scan_args(argc, argv, "10:", &rb_oids, &rb_options);
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+	Check_Type(rb_oids, T_ARRAY);
+
+	if (!NIL_P(rb_options))
+		rb_types = rb_hash_aref(rb_options, CSTR2SYM("types"));
+
+	count = RARRAY_LEN(rb_oids);
+
+	if (TYPE(rb_types) == T_ARRAY) {
+		if (RARRAY_LEN(rb_types) != count)
+			rb_raise(rb_eArgError,
+				"the `types` array must be the same length as the `oids` array");
+	} else if (!NIL_P(rb_types)) {
+		expected_type = rugged_otype_get(rb_types);
+	}
+
+	oids = ALLOCV_N(git_oid, rb_oids_buffer, count);
+	types = ALLOCV_N(git_otype, rb_types_buffer, count);
+
+	for (i = 0; i < count; ++i) {
+		rugged_exception_check(
+			rugged_oid_from_value(&oids[i], rb_ary_entry(rb_oids, i))
+		);
+
+		if (TYPE(rb_types) == T_ARRAY)
+			types[i] = rugged_otype_get(rb_ary_entry(rb_types, i));
+		else
+			types[i] = expected_type;
+	}
+
+	error = git_repository_odb(&args.odb, repo);
+	rugged_exception_check(error);
+
+	args.repo = repo;
+	args.oids = oids;
+	args.types = types;
+	args.objects = ALLOCV_N(git_odb_object *, rb_objects_buffer, count);
+	args.events = rugged_instrument_enabled ?
+		ALLOCV_N(struct rugged_odb_read_event, rb_events_buffer, count) : NULL;
+	args.count = (size_t)count;
+	args.next = 0;
+	args.error = 0;
+
+	/* Resume after interrupts that don't raise; free what was read if one does */
+	while (args.next < args.count && !args.error) {
+		int exception;
+
+		args.cancelled = 0;
+		rb_thread_call_without_gvl2(rb_git_repo_read_many_nogvl, &args, rb_git_repo_read_many_cancel, &args);
+
+		if ((exception = rugged_check_ints_protect()) != 0) {
+			for (i = 0; i < (long)args.next; ++i)
+				git_odb_object_free(args.objects[i]);
+			git_odb_free(args.odb);
+			rb_jump_tag(exception);
+		}
+	}
+
+	git_odb_free(args.odb);
+	rugged_exception_check(args.error);
+
+	rb_result = rb_ary_new2(count);
+
+	for (i = 0; i < count; ++i) {
+		if (args.objects[i] == NULL) {
+			rb_ary_push(rb_result, Qnil);
+		} else {
+			rb_ary_push(rb_result,
+				TypedData_Wrap_Struct(rb_cRuggedOdbObject, &rugged_odb_object_type, args.objects[i]));
+		}
+	}
+
+	/* Each object is reported on its own, as if read with Repository#read */
+	for (i = 0; args.events && i < count; ++i) {
+		int exception = rugged_odb_read_publish(&args.events[i]);
+		if (exception)
+			rb_jump_tag(exception);
+	}
+
+	if (args.events)
+		ALLOCV_END(rb_events_buffer);
+	ALLOCV_END(rb_objects_buffer);
+	ALLOCV_END(rb_types_buffer);
+	ALLOCV_END(rb_oids_buffer);
+
+	return rb_result;
+}
+
 /*
  *  call-seq:
  *    repo.read_header(oid) -> hash
@@ -1198,12 +1751,11 @@ static VALUE rb_git_repo_read_header(VALUE self, VALUE hex)
 	git_otype type;
 	size_t len;
 	VALUE rb_hash;
+	uint64_t started = rugged_instrument_start();
 	int error;
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
-	Check_Type(hex, T_STRING);
-
-	error = git_oid_fromstr(&oid, StringValueCStr(hex));
+	error = rugged_oid_from_value(&oid, hex);
 	rugged_exception_check(error);
 
 	error = git_repository_odb(&odb, repo);
@@ -1211,6 +1763,20 @@ static VALUE rb_git_repo_read_header(VALUE self, VALUE hex)
 
 	error = git_odb_read_header(&len, &type, odb, &oid);
 	git_odb_free(odb);
+
+	if (started) {
+		VALUE rb_payload = rb_hash_new();
+		rb_hash_aset(rb_payload, CSTR2SYM("oid"), rugged_create_oid(&oid));
+		rb_hash_aset(rb_payload, CSTR2SYM("found"), error ? Qfalse : Qtrue);
+
+		if (!error) {
+			rb_hash_aset(rb_payload, CSTR2SYM("type"), rugged_otype_new(type));
+			rb_hash_aset(rb_payload, CSTR2SYM("bytes"), SIZET2NUM(len));
+		}
+
+		rugged_instrument_emit("odb.read_header", started, rb_payload);
+	}
+
 	rugged_exception_check(error);
 
 	rb_hash = rb_hash_new();
@@ -1225,7 +1791,8 @@ static VALUE rb_git_repo_read_header(VALUE self, VALUE hex)
  *    repo.expand_oids([oid..], object_type = :any) -> hash
  *    repo.expand_oids([oid..], object_type = [type..]) -> hash
  *
- *  Expand a list of short oids to their full value, assuming they exist
+ *  Expand a list of short oids (or Rugged::Oid instances, which are
+ *  checked for existence) to their full value, assuming they exist
  *  in the repository. If `object_type` is passed and is an array, it must
  *  be the same length as the OIDs array. If it's a single type name, all
  *  OIDs will be expected to resolve to that object type. OIDs that don't
@@ -1254,6 +1821,12 @@ static VALUE rb_git_repo_expand_oids(int argc, VALUE *argv, VALUE self)
 
 	for (i = 0; i < expand_count; ++i) {
 		VALUE rb_hex = rb_ary_entry(rb_oids, i);
+
+		if (rugged_oid_extract(&expand[i].id, rb_hex)) {
+			expand[i].length = GIT_OID_HEXSZ;
+			continue;
+		}
+
 		Check_Type(rb_hex, T_STRING);
 
 		rugged_exception_check(
@@ -1288,143 +1861,495 @@ static VALUE rb_git_repo_expand_oids(int argc, VALUE *argv, VALUE self)
 	git_odb_free(odb);
 	rugged_exception_check(error);
 
-	rb_result = rb_hash_new();
+	rb_result = rb_hash_new();
+
+	for (i = 0; i < expand_count; ++i) {
+		if (expand[i].length) {
+			rb_hash_aset(rb_result,
+				rb_ary_entry(rb_oids, i), rugged_create_oid(&expand[i].id));
+		}
+	}
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    repo.descendant_of?(commit, ancestor) -> true or false
+ *
+ *  +commit+ and +ancestor+ must be String commit OIDs or instances of Rugged::Commit.
+ *
+ *  Returns true if +commit+ is a descendant of +ancestor+, or false if not.
+ */
+static VALUE rb_git_repo_descendant_of(VALUE self, VALUE rb_commit, VALUE rb_ancestor)
+{
+	int result;
+	int error;
+	git_repository *repo;
+	git_oid commit, ancestor;
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+
+	error = rugged_oid_get(&commit, repo, rb_commit);
+	rugged_exception_check(error);
+
+	error = rugged_oid_get(&ancestor, repo, rb_ancestor);
+	rugged_exception_check(error);
+
+	result = git_graph_descendant_of(repo, &commit, &ancestor);
+	rugged_exception_check(result);
+
+	return result ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    Repository.hash_data(str, type) -> oid
+ *
+ *  Hash the contents of +str+ as raw bytes (ignoring any encoding
+ *  information) and adding the relevant header corresponding to +type+,
+ *  and return a hex string representing the result from the hash.
+ *
+ *    Repository.hash_data('hello world', :commit) #=> "de5ba987198bcf2518885f0fc1350e5172cded78"
+ *
+ *    Repository.hash_data('hello_world', :tag) #=> "9d09060c850defbc7711d08b57def0d14e742f4e"
+ */
+static VALUE rb_git_repo_hash(VALUE self, VALUE rb_buffer, VALUE rb_type)
+{
+	int error;
+	git_oid oid;
+
+	Check_Type(rb_buffer, T_STRING);
+
+	error = git_odb_hash(&oid,
+		RSTRING_PTR(rb_buffer),
+		RSTRING_LEN(rb_buffer),
+		rugged_otype_get(rb_type)
+	);
+	rugged_exception_check(error);
+
+	return rugged_create_oid(&oid);
+}
+
+/*
+ *  call-seq:
+ *    Repository.hash_file(path, type) -> oid
+ *
+ *  Hash the contents of the file pointed at by +path+, assuming
+ *  that it'd be stored in the ODB with the given +type+, and return
+ *  a hex string representing the SHA1 OID resulting from the hash.
+ *
+ *    Repository.hash_file('foo.txt', :commit) #=> "de5ba987198bcf2518885f0fc1350e5172cded78"
+ *
+ *    Repository.hash_file('foo.txt', :tag) #=> "9d09060c850defbc7711d08b57def0d14e742f4e"
+ */
+static VALUE rb_git_repo_hashfile(VALUE self, VALUE rb_path, VALUE rb_type)
+{
+	int error;
+	git_oid oid;
+
+	FilePathValue(rb_path);
+
+	error = git_odb_hashfile(&oid,
+		StringValueCStr(rb_path),
+		rugged_otype_get(rb_type)
+	);
+	rugged_exception_check(error);
+
+	return rugged_create_oid(&oid);
+}
+
+struct rugged_hash_files_payload {
+	git_odb *odb;
+	git_otype type;
+	const char **paths;
+	git_oid *oids;
+};
+
+static int rugged_write_file(git_oid *oid, git_odb *odb, const char *path, git_otype type)
+{
+	git_odb_stream *stream = NULL;
+	char buffer[16 * 1024];
+	struct stat st;
+	size_t read_bytes;
+	FILE *fp;
+	int error;
+
+	if ((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &st) < 0) {
+		char message[1024];
+
+		snprintf(message, sizeof(message), "failed to open '%s': %s", path, strerror(errno));
+		giterr_set_str(GITERR_OS, message);
+
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+
+	error = git_odb_open_wstream(&stream, odb, (size_t)st.st_size, type);
+
+	while (!error && (read_bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		error = git_odb_stream_write(stream, buffer, read_bytes);
+
+	if (!error && ferror(fp)) {
+		giterr_set_str(GITERR_OS, "failed to read file");
+		error = -1;
+	}
+
+	if (!error)
+		error = git_odb_stream_finalize_write(oid, stream);
+
+	git_odb_stream_free(stream);
+	fclose(fp);
+
+	return error;
+}
+
+static int rugged_hash_files_cb(size_t i, void *_payload)
+{
+	struct rugged_hash_files_payload *payload = (struct rugged_hash_files_payload *)_payload;
+
+	if (payload->odb)
+		return rugged_write_file(&payload->oids[i], payload->odb, payload->paths[i], payload->type);
+
+	return git_odb_hashfile(&payload->oids[i], payload->paths[i], payload->type);
+}
+
+static VALUE rugged_hash_files(git_odb *odb, VALUE rb_paths, VALUE rb_options)
+{
+	struct rugged_hash_files_payload payload;
+	VALUE rb_result, rb_frozen_paths, rb_type = Qnil, rb_threads = Qnil;
+	VALUE paths_v, oids_v;
+	long i, count;
+	int threads, error;
+
+	Check_Type(rb_paths, T_ARRAY);
+
+	if (!NIL_P(rb_options)) {
+		rb_type = rb_hash_aref(rb_options, CSTR2SYM("type"));
+		rb_threads = rb_hash_aref(rb_options, CSTR2SYM("threads"));
+	}
+
+	payload.odb = odb;
+	payload.type = NIL_P(rb_type) ? GIT_OBJ_BLOB : rugged_otype_get(rb_type);
+	threads = rugged_parallel_threads_get(rb_threads);
+
+	count = RARRAY_LEN(rb_paths);
+
+	/* Workers read the paths without the GVL, so hold on to frozen copies */
+	rb_frozen_paths = rb_ary_new2(count);
+	for (i = 0; i < count; ++i) {
+		VALUE rb_path = rb_ary_entry(rb_paths, i);
+		FilePathValue(rb_path);
+		rb_ary_push(rb_frozen_paths, rb_str_new_frozen(rb_path));
+	}
+
+	payload.paths = ALLOCV_N(const char *, paths_v, count);
+	payload.oids = ALLOCV_N(git_oid, oids_v, count);
+
+	for (i = 0; i < count; ++i)
+		payload.paths[i] = StringValueCStr(RARRAY_PTR(rb_frozen_paths)[i]);
+
+	error = rugged_parallel_run(rugged_hash_files_cb, &payload, (size_t)count, threads);
+
+	rb_result = Qnil;
+	if (!error) {
+		rb_result = rb_ary_new2(count);
+		for (i = 0; i < count; ++i)
+			rb_ary_push(rb_result, rugged_create_oid(&payload.oids[i]));
+	}
+
+	ALLOCV_END(paths_v);
+	ALLOCV_END(oids_v);
+	RB_GC_GUARD(rb_frozen_paths);
+
+	rugged_exception_check(error);
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    Repository.hash_files(paths, options = {}) -> [oid, ...]
+ *
+ *  Hash the contents of all the files in the +paths+ array, like
+ *  Repository.hash_file, and return their OIDs in the same order.
+ *
+ *  The files are hashed on a pool of native threads, without holding
+ *  the GVL. The following options can be passed in the +options+ Hash:
+ *
+ *  :type ::
+ *    The type of object the files would be stored as. Defaults to +:blob+.
+ *
+ *  :threads ::
+ *    The number of threads to use. Defaults to the number of online CPUs.
+ *
+ *    Repository.hash_files(Dir["lib/**\/*.rb"], threads: 4)
+ *    #=> ["9d09060c850defbc7711d08b57def0d14e742f4e", ...]
+ */
+static VALUE rb_git_repo_hashfiles(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_paths, rb_options;
+
+	rb_scan_args(argc, argv, "10:", &rb_paths, &rb_options);
+
+	return rugged_hash_files(NULL, rb_paths, rb_options);
+}
+
+static VALUE rugged_hash_files_protected(VALUE _args)
+{
+	VALUE *args = (VALUE *)_args;
+	return rugged_hash_files((git_odb *)args[0], args[1], args[2]);
+}
+
+/*
+ *  call-seq:
+ *    repo.hash_files(paths, options = {}) -> [oid, ...]
+ *
+ *  Same as Repository.hash_files, but additionally accepts a +:write+
+ *  option. When +true+, every file is also written into the repository's
+ *  object database, streaming its contents from disk.
+ *
+ *    repo.hash_files(["README", "LICENSE"], write: true)
+ *    #=> ["a8233120f6ad708f843d861ce2b7228ec4e3dec6", ...]
+ */
+static VALUE rb_git_repo_hashfiles_instance(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_paths, rb_options, rb_result;
+	git_repository *repo;
+	git_odb *odb = NULL;
+	int error, exception = 0;
+
+	rb_scan_args(argc, argv, "10:", &rb_paths, &rb_options);
+
+	if (NIL_P(rb_options) || !RTEST(rb_hash_aref(rb_options, CSTR2SYM("write"))))
+		return rugged_hash_files(NULL, rb_paths, rb_options);
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+
+	error = git_repository_odb(&odb, repo);
+	rugged_exception_check(error);
+
+	{
+		VALUE args[3] = { (VALUE)odb, rb_paths, rb_options };
+		rb_result = rb_protect(rugged_hash_files_protected, (VALUE)args, &exception);
+	}
+
+	git_odb_free(odb);
+
+	if (exception)
+		rb_jump_tag(exception);
+
+	return rb_result;
+}
+
+/*
+ *  call-seq:
+ *    repo.write(buffer, type) -> oid
+ *
+ *  Write the data contained in the +buffer+ string as a raw object of the
+ *  given +type+ into the repository's object database.
+ *
+ *  +type+ can be either +:tag+, +:commit+, +:tree+ or +:blob+.
+ *
+ *  Returns the newly created object's oid.
+ */
+static VALUE rb_git_repo_write(VALUE self, VALUE rb_buffer, VALUE rub_type)
+{
+	git_repository *repo;
+	git_odb_stream *stream;
+
+	git_odb *odb;
+	git_oid oid;
+	int error;
+
+	git_otype type;
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+	Check_Type(rb_buffer, T_STRING);
+
+	error = git_repository_odb(&odb, repo);
+	rugged_exception_check(error);
+
+	type = rugged_otype_get(rub_type);
+
+	error = git_odb_open_wstream(&stream, odb, RSTRING_LEN(rb_buffer), type);
+	git_odb_free(odb);
+	rugged_exception_check(error);
+
+	error = git_odb_stream_write(stream, RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer));
+	if (!error)
+		error = git_odb_stream_finalize_write(&oid, stream);
+
+	git_odb_stream_free(stream);
+	rugged_exception_check(error);
+
+	return rugged_create_oid(&oid);
+}
+
+static size_t rb_git_odbwriter__size(const void *data)
+{
+	return sizeof(git_odb_stream);
+}
+
+/*
+ * The writer doesn't own its stream: it is only valid for the duration of
+ * the Repository#write_stream block, after which the pointer is cleared.
+ */
+static const rb_data_type_t rugged_odb_writer_type = {
+	.wrap_struct_name = "Rugged::OdbWriter",
+	.function = {
+		.dfree = NULL,
+		.dsize = rb_git_odbwriter__size,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+struct nogvl_odb_stream_write_args {
+	git_odb_stream *stream;
+	const char *data;
+	size_t len;
+	int written;
+	int error;
+};
+
+static void *rb_git_odbwriter_write_nogvl(void *_args)
+{
+	struct nogvl_odb_stream_write_args *args = (struct nogvl_odb_stream_write_args *)_args;
+	args->error = git_odb_stream_write(args->stream, args->data, args->len);
+	args->written = 1;
+	return NULL;
+}
+
+static git_odb_stream *rugged_odb_writer_get(VALUE self)
+{
+	git_odb_stream *stream;
+	TypedData_Get_Struct(self, git_odb_stream, &rugged_odb_writer_type, stream);
 
-	for (i = 0; i < expand_count; ++i) {
-		if (expand[i].length) {
-			rb_hash_aset(rb_result,
-				rb_ary_entry(rb_oids, i), rugged_create_oid(&expand[i].id));
-		}
-	}
+	if (!stream)
+		rb_raise(rb_eIOError, "closed stream");
 
-	return rb_result;
+	return stream;
 }
 
 /*
  *  call-seq:
- *    repo.descendant_of?(commit, ancestor) -> true or false
+ *    writer.write(buffer) -> int
  *
- *  +commit+ and +ancestor+ must be String commit OIDs or instances of Rugged::Commit.
+ *  Write the raw bytes in +buffer+ to the object being written, and
+ *  return the number of bytes written.
  *
- *  Returns true if +commit+ is a descendant of +ancestor+, or false if not.
+ *  The data is hashed and compressed without holding the GVL.
  */
-static VALUE rb_git_repo_descendant_of(VALUE self, VALUE rb_commit, VALUE rb_ancestor)
+static VALUE rb_git_odbwriter_write(VALUE self, VALUE rb_buffer)
 {
-	int result;
-	int error;
-	git_repository *repo;
-	git_oid commit, ancestor;
+	struct nogvl_odb_stream_write_args args;
 
-	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+	args.stream = rugged_odb_writer_get(self);
+	Check_Type(rb_buffer, T_STRING);
 
-	error = rugged_oid_get(&commit, repo, rb_commit);
-	rugged_exception_check(error);
+	rb_str_locktmp(rb_buffer);
 
-	error = rugged_oid_get(&ancestor, repo, rb_ancestor);
-	rugged_exception_check(error);
+	args.data = RSTRING_PTR(rb_buffer);
+	args.len = RSTRING_LEN(rb_buffer);
+	args.written = 0;
+	args.error = 0;
 
-	result = git_graph_descendant_of(repo, &commit, &ancestor);
-	rugged_exception_check(result);
+	/* The call is skipped while an interrupt is pending */
+	for (;;) {
+		int exception;
 
-	return result ? Qtrue : Qfalse;
-}
+		rb_thread_call_without_gvl2(rb_git_odbwriter_write_nogvl, &args, RUBY_UBF_PROCESS, NULL);
+		if (args.written)
+			break;
 
-/*
- *  call-seq:
- *    Repository.hash_data(str, type) -> oid
- *
- *  Hash the contents of +str+ as raw bytes (ignoring any encoding
- *  information) and adding the relevant header corresponding to +type+,
- *  and return a hex string representing the result from the hash.
- *
- *    Repository.hash_data('hello world', :commit) #=> "de5ba987198bcf2518885f0fc1350e5172cded78"
- *
- *    Repository.hash_data('hello_world', :tag) #=> "9d09060c850defbc7711d08b57def0d14e742f4e"
- */
-static VALUE rb_git_repo_hash(VALUE self, VALUE rb_buffer, VALUE rb_type)
-{
-	int error;
-	git_oid oid;
+		if ((exception = rugged_check_ints_protect()) != 0) {
+			rb_str_unlocktmp(rb_buffer);
+			rb_jump_tag(exception);
+		}
+	}
 
-	Check_Type(rb_buffer, T_STRING);
+	rb_str_unlocktmp(rb_buffer);
 
-	error = git_odb_hash(&oid,
-		RSTRING_PTR(rb_buffer),
-		RSTRING_LEN(rb_buffer),
-		rugged_otype_get(rb_type)
-	);
-	rugged_exception_check(error);
+	rb_thread_check_ints();
+	rugged_exception_check(args.error);
 
-	return rugged_create_oid(&oid);
+	return LONG2NUM(RSTRING_LEN(rb_buffer));
 }
 
 /*
  *  call-seq:
- *    Repository.hash_file(path, type) -> oid
- *
- *  Hash the contents of the file pointed at by +path+, assuming
- *  that it'd be stored in the ODB with the given +type+, and return
- *  a hex string representing the SHA1 OID resulting from the hash.
- *
- *    Repository.hash_file('foo.txt', :commit) #=> "de5ba987198bcf2518885f0fc1350e5172cded78"
+ *    writer << buffer -> writer
  *
- *    Repository.hash_file('foo.txt', :tag) #=> "9d09060c850defbc7711d08b57def0d14e742f4e"
+ *  Write the raw bytes in +buffer+ to the object being written.
  */
-static VALUE rb_git_repo_hashfile(VALUE self, VALUE rb_path, VALUE rb_type)
+static VALUE rb_git_odbwriter_append(VALUE self, VALUE rb_buffer)
 {
-	int error;
-	git_oid oid;
-
-	FilePathValue(rb_path);
-
-	error = git_odb_hashfile(&oid,
-		StringValueCStr(rb_path),
-		rugged_otype_get(rb_type)
-	);
-	rugged_exception_check(error);
-
-	return rugged_create_oid(&oid);
+	rb_git_odbwriter_write(self, rb_buffer);
+	return self;
 }
 
 /*
  *  call-seq:
- *    repo.write(buffer, type) -> oid
+ *    repo.write_stream(type, size) { |writer| block } -> oid
  *
- *  Write the data contained in the +buffer+ string as a raw object of the
- *  given +type+ into the repository's object database.
+ *  Write a raw object of the given +type+ and exactly +size+ bytes into
+ *  the repository's object database, streaming its contents from +block+.
+ *
+ *  +block+ is passed a Rugged::OdbWriter, to which the object's data must
+ *  be written in as many chunks as needed with +<<+ or +write+. Each chunk
+ *  is hashed and compressed as it is written, so the object is never
+ *  buffered as a whole. The writer can't be used after +block+ returns.
  *
  *  +type+ can be either +:tag+, +:commit+, +:tree+ or +:blob+.
  *
- *  Returns the newly created object's oid.
+ *  Returns the newly created object's oid. If +block+ raises, or the
+ *  amount of data written doesn't match +size+, no object is created.
+ *
+ *    repo.write_stream(:blob, File.size(path)) do |writer|
+ *      File.open(path, "rb") do |file|
+ *        while chunk = file.read(65536)
+ *          writer << chunk
+ *        end
+ *      end
+ *    end
  */
-static VALUE rb_git_repo_write(VALUE self, VALUE rb_buffer, VALUE rub_type)
+static VALUE rb_git_repo_write_stream(VALUE self, VALUE rb_type, VALUE rb_size)
 {
 	git_repository *repo;
 	git_odb_stream *stream;
-
 	git_odb *odb;
 	git_oid oid;
-	int error;
+	VALUE rb_writer;
+	int error, exception = 0;
 
-	git_otype type;
+	rb_need_block();
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
-	Check_Type(rb_buffer, T_STRING);
+	Check_Type(rb_size, T_FIXNUM);
+
+	if (FIX2LONG(rb_size) < 0)
+		rb_raise(rb_eArgError, "size must not be negative");
 
 	error = git_repository_odb(&odb, repo);
 	rugged_exception_check(error);
 
-	type = rugged_otype_get(rub_type);
-
-	error = git_odb_open_wstream(&stream, odb, RSTRING_LEN(rb_buffer), type);
+	error = git_odb_open_wstream(&stream, odb, FIX2ULONG(rb_size), rugged_otype_get(rb_type));
 	git_odb_free(odb);
 	rugged_exception_check(error);
 
-	error = git_odb_stream_write(stream, RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer));
-	if (!error)
+	rb_writer = TypedData_Wrap_Struct(rb_cRuggedOdbWriter, &rugged_odb_writer_type, stream);
+	rb_protect(rb_yield, rb_writer, &exception);
+	DATA_PTR(rb_writer) = NULL;
+
+	if (!exception)
 		error = git_odb_stream_finalize_write(&oid, stream);
 
 	git_odb_stream_free(stream);
+
+	if (exception)
+		rb_jump_tag(exception);
+
 	rugged_exception_check(error);
 
 	return rugged_create_oid(&oid);
@@ -1702,12 +2627,19 @@ static VALUE rb_git_repo_file_status(VALUE self, VALUE rb_path)
 	unsigned int flags;
 	int error;
 	git_repository *repo;
+	uint64_t started = rugged_instrument_start();
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
 	FilePathValue(rb_path);
 	error = git_status_file(&flags, repo, StringValueCStr(rb_path));
 	rugged_exception_check(error);
 
+	if (started) {
+		VALUE rb_payload = rb_hash_new();
+		rb_hash_aset(rb_payload, CSTR2SYM("path"), rb_path);
+		rugged_instrument_emit("status", started, rb_payload);
+	}
+
 	return flags_to_rb(flags);
 }
 
@@ -1717,6 +2649,7 @@ static VALUE rb_git_repo_file_each_status(VALUE self)
 	size_t i, nentries;
 	git_repository *repo;
 	git_status_list *list;
+	uint64_t started = rugged_instrument_start(), duration = 0;
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
 
@@ -1728,6 +2661,9 @@ static VALUE rb_git_repo_file_each_status(VALUE self)
 	error = git_status_list_new(&list, repo, NULL);
 	rugged_exception_check(error);
 
+	if (started)
+		duration = rugged_instrument_clock() - started;
+
 	nentries = git_status_list_entrycount(list);
 	for (i = 0; i < nentries; i++) {
 		const git_status_entry *entry;
@@ -1749,44 +2685,249 @@ static VALUE rb_git_repo_file_each_status(VALUE self)
 	if (exception != 0)
 		rb_jump_tag(exception);
 
+	/* Reported after iterating so a failing subscriber can't leak the list */
+	if (started) {
+		VALUE rb_payload = rb_hash_new();
+		rb_hash_aset(rb_payload, CSTR2SYM("entries"), SIZET2NUM(nentries));
+		rugged_instrument_publish("status", duration, rb_payload);
+	}
+
+	return Qnil;
+}
+
+#define RUGGED_EACH_ID_DEFAULT_BATCH_SIZE 1024
+
+struct rugged_each_id_state {
+	git_odb *odb;
+	git_otype type;
+	int binary;
+	int yield_batches;
+
+	git_oid *oids;
+	size_t batch_size;
+	size_t count;
+
+	volatile int cancelled;
+	int exception;
+};
+
+static VALUE rugged_each_id_yield(VALUE _state)
+{
+	struct rugged_each_id_state *state = (struct rugged_each_id_state *)_state;
+	VALUE rb_batch;
+	size_t i;
+
+	if (!state->yield_batches) {
+		for (i = 0; i < state->count; ++i) {
+			if (state->binary)
+				rb_yield(rb_str_new((const char *)state->oids[i].id, GIT_OID_RAWSZ));
+			else
+				rb_yield(rugged_create_oid(&state->oids[i]));
+		}
+	} else if (state->binary) {
+		char *ptr;
+
+		rb_batch = rb_str_new(NULL, state->count * GIT_OID_RAWSZ);
+		ptr = RSTRING_PTR(rb_batch);
+
+		for (i = 0; i < state->count; ++i)
+			memcpy(ptr + i * GIT_OID_RAWSZ, state->oids[i].id, GIT_OID_RAWSZ);
+
+		rb_yield(rb_batch);
+	} else {
+		rb_batch = rb_ary_new2(state->count);
+
+		for (i = 0; i < state->count; ++i)
+			rb_ary_push(rb_batch, rugged_create_oid(&state->oids[i]));
+
+		rb_yield(rb_batch);
+	}
+
 	return Qnil;
 }
 
+static void rugged_each_id_flush(struct rugged_each_id_state *state)
+{
+	if (state->count > 0)
+		rb_protect(rugged_each_id_yield, (VALUE)state, &state->exception);
+	state->count = 0;
+}
+
+static void *rugged_each_id_flush_with_gvl(void *_state)
+{
+	rugged_each_id_flush((struct rugged_each_id_state *)_state);
+	return NULL;
+}
+
+static void *rugged_each_id_check_ints_with_gvl(void *_state)
+{
+	struct rugged_each_id_state *state = (struct rugged_each_id_state *)_state;
+	state->exception = rugged_check_ints_protect();
+	return NULL;
+}
+
 static int rugged__each_id_cb(const git_oid *id, void *payload)
 {
-	int *exception = (int *)payload;
-	rb_protect(rb_yield, rugged_create_oid(id), exception);
-	return *exception ? GIT_ERROR : GIT_OK;
+	struct rugged_each_id_state *state = (struct rugged_each_id_state *)payload;
+
+	/*
+	 * The enumeration can't be resumed once aborted, so interrupts are
+	 * handled from here, and it only stops if handling one raised.
+	 */
+	if (state->cancelled) {
+		state->cancelled = 0;
+		rb_thread_call_with_gvl(rugged_each_id_check_ints_with_gvl, state);
+		if (state->exception)
+			return GIT_EUSER;
+	}
+
+	if (state->type != GIT_OBJ_ANY) {
+		git_otype type;
+		size_t len;
+		int error;
+
+		/* For packed objects this only decodes the entry header */
+		error = git_odb_read_header(&len, &type, state->odb, id);
+		if (error < 0)
+			return error;
+
+		if (type != state->type)
+			return GIT_OK;
+	}
+
+	git_oid_cpy(&state->oids[state->count++], id);
+
+	if (state->count == state->batch_size) {
+		rb_thread_call_with_gvl(rugged_each_id_flush_with_gvl, state);
+		if (state->exception)
+			return GIT_EUSER;
+	}
+
+	return GIT_OK;
+}
+
+struct nogvl_each_id_args {
+	struct rugged_each_id_state *state;
+	int started;
+	int error;
+};
+
+static void *rb_git_repo_each_id_nogvl(void *_args)
+{
+	struct nogvl_each_id_args *args = (struct nogvl_each_id_args *)_args;
+	args->started = 1;
+	args->error = git_odb_foreach(args->state->odb, &rugged__each_id_cb, args->state);
+	return NULL;
+}
+
+static void rb_git_repo_each_id_cancel(void *_state)
+{
+	struct rugged_each_id_state *state = (struct rugged_each_id_state *)_state;
+	state->cancelled = 1;
 }
 
 /*
  *  call-seq:
- *    repo.each_id { |id| block }
- *    repo.each_id -> Enumerator
+ *    repo.each_id(options = {}) { |id| block }
+ *    repo.each_id(options = {}) -> Enumerator
  *
  *  Call the given +block+ once with every object ID found in +repo+
  *  and all its alternates. Object IDs are passed as 40-character
  *  strings.
+ *
+ *  The object database is enumerated without holding the GVL. The
+ *  following options can be passed in the +options+ Hash:
+ *
+ *  :type ::
+ *    Only yield objects of the given type (+:commit+, +:tree+, +:blob+ or
+ *    +:tag+). Packed objects are filtered on their pack entry header,
+ *    without being inflated.
+ *
+ *  :format ::
+ *    +:hex+ (the default) for 40-character strings, or +:binary+ for
+ *    20-byte raw strings.
+ *
+ *  :batch ::
+ *    Yield the IDs in groups of up to this many. Hex IDs are yielded as
+ *    an Array; binary IDs are packed back to back into a single String.
+ *
+ *    repo.each_id(type: :blob, format: :binary, batch: 10_000) do |packed|
+ *      packed.unpack("a20" * (packed.bytesize / 20))
+ *    end
  */
-static VALUE rb_git_repo_each_id(VALUE self)
+static VALUE rb_git_repo_each_id(int argc, VALUE *argv, VALUE self)
 {
+	struct rugged_each_id_state state;
+	struct nogvl_each_id_args args;
 	git_repository *repo;
-	git_odb *odb;
-	int error, exception = 0;
+	VALUE rb_options, oids_v;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "00:", &rb_options);
+
+	memset(&state, 0, sizeof(state));
+	state.type = GIT_OBJ_ANY;
+	state.batch_size = RUGGED_EACH_ID_DEFAULT_BATCH_SIZE;
+
+	if (!NIL_P(rb_options)) {
+		VALUE rb_value;
+
+		rb_value = rb_hash_aref(rb_options, CSTR2SYM("type"));
+		if (!NIL_P(rb_value))
+			state.type = rugged_otype_get(rb_value);
 
-	RETURN_ENUMERATOR(self, 0, 0);
+		rb_value = rb_hash_aref(rb_options, CSTR2SYM("format"));
+		if (rb_value == CSTR2SYM("binary"))
+			state.binary = 1;
+		else if (!NIL_P(rb_value) && rb_value != CSTR2SYM("hex"))
+			rb_raise(rb_eArgError, "Invalid format. Expected `:hex` or `:binary`");
+
+		rb_value = rb_hash_aref(rb_options, CSTR2SYM("batch"));
+		if (!NIL_P(rb_value)) {
+			Check_Type(rb_value, T_FIXNUM);
+			if (FIX2LONG(rb_value) <= 0)
+				rb_raise(rb_eArgError, "batch size must be a positive integer");
+
+			state.batch_size = FIX2ULONG(rb_value);
+			state.yield_batches = 1;
+		}
+	}
 
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
 
-	error = git_repository_odb(&odb, repo);
-	rugged_exception_check(error);
+	args.error = git_repository_odb(&state.odb, repo);
+	rugged_exception_check(args.error);
 
-	error = git_odb_foreach(odb, &rugged__each_id_cb, &exception);
-	git_odb_free(odb);
+	state.oids = ALLOCV_N(git_oid, oids_v, state.batch_size);
+	args.state = &state;
+	args.started = 0;
 
-	if (exception)
-		rb_jump_tag(exception);
-	rugged_exception_check(error);
+	/* The call is skipped while an interrupt is pending */
+	for (;;) {
+		int exception;
+
+		rb_thread_call_without_gvl2(rb_git_repo_each_id_nogvl, &args, rb_git_repo_each_id_cancel, &state);
+		if (args.started)
+			break;
+
+		if ((exception = rugged_check_ints_protect()) != 0) {
+			git_odb_free(state.odb);
+			ALLOCV_END(oids_v);
+			rb_jump_tag(exception);
+		}
+	}
+
+	if (!args.error && !state.exception)
+		rugged_each_id_flush(&state);
+
+	git_odb_free(state.odb);
+	ALLOCV_END(oids_v);
+
+	if (state.exception)
+		rb_jump_tag(state.exception);
+
+	rb_thread_check_ints();
+	rugged_exception_check(args.error);
 
 	return Qnil;
 }
@@ -1915,6 +3056,7 @@ static VALUE rb_git_repo_close(VALUE self)
 	git_repository *repo;
 	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
 
+	rugged_prefetch_stop(repo);
 	git_repository__cleanup(repo);
 
 	return Qnil;
@@ -1996,6 +3138,149 @@ static VALUE rb_git_repo_ahead_behind(VALUE self, VALUE rb_local, VALUE rb_upstr
 	return rb_result;
 }
 
+struct nogvl_commit_graph_args {
+	git_commit_graph_writer *writer;
+	git_revwalk *walk;
+	int written;
+	int error;
+};
+
+static void *rb_git_repo_write_commit_graph_nogvl(void *_args)
+{
+	struct nogvl_commit_graph_args *args = (struct nogvl_commit_graph_args *)_args;
+	git_commit_graph_writer_options opts = GIT_COMMIT_GRAPH_WRITER_OPTIONS_INIT;
+
+	args->written = 1;
+	args->error = git_commit_graph_writer_add_revwalk(args->writer, args->walk);
+	if (!args->error)
+		args->error = git_commit_graph_writer_commit(args->writer, &opts);
+
+	return NULL;
+}
+
+/*
+ *  call-seq:
+ *    repo.write_commit_graph(options = {}) -> nil
+ *
+ *  Write a commit-graph file to <tt>objects/info/commit-graph</tt>,
+ *  covering every commit reachable from the repository's references.
+ *
+ *  Once the file exists, revision walks (Rugged::Walker), as well as
+ *  Repository#ahead_behind, Repository#merge_base and
+ *  Repository#descendant_of?, read commit parents, dates and generation
+ *  numbers from the commit-graph instead of parsing each commit object.
+ *  Commits that are not in the commit-graph are still parsed from the ODB,
+ *  so the file can safely be refreshed in the background.
+ *
+ *  The following options can be passed in the +options+ Hash:
+ *
+ *  :refs ::
+ *    An Array of reference globs (e.g. <tt>"refs/heads/*"</tt>) whose
+ *    commits should be written to the commit-graph. Defaults to all
+ *    references.
+ *
+ *  The graph is computed and written without holding the GVL.
+ */
+static VALUE rb_git_repo_write_commit_graph(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_options, rb_refs = Qnil;
+	git_repository *repo;
+	git_commit_graph_writer *writer;
+	git_buf objects_path = {NULL};
+	struct nogvl_commit_graph_args args;
+	VALUE rb_info_path;
+	const char *info_path;
+	int error;
+
+	rb_scan_args(argc, argv, "00:", &rb_options);
+
+	TypedData_Get_Struct(self, git_repository, &rugged_repository_type, repo);
+
+	if (!NIL_P(rb_options)) {
+		rb_refs = rb_hash_aref(rb_options, CSTR2SYM("refs"));
+		if (!NIL_P(rb_refs)) {
+			long i;
+
+			Check_Type(rb_refs, T_ARRAY);
+			for (i = 0; i < RARRAY_LEN(rb_refs); ++i) {
+				VALUE rb_ref = rb_ary_entry(rb_refs, i);
+				Check_Type(rb_ref, T_STRING);
+				StringValueCStr(rb_ref);
+			}
+		}
+	}
+
+	error = git_repository_item_path(&objects_path, repo, GIT_REPOSITORY_ITEM_OBJECTS);
+	rugged_exception_check(error);
+
+	rb_info_path = rb_str_new_utf8(objects_path.ptr);
+	git_buf_dispose(&objects_path);
+	rb_str_cat2(rb_info_path, "info");
+	info_path = StringValueCStr(rb_info_path);
+
+	/* Nothing below may raise until the walk and writer are freed */
+	error = git_revwalk_new(&args.walk, repo);
+	rugged_exception_check(error);
+
+	if (NIL_P(rb_refs)) {
+		error = git_revwalk_push_glob(args.walk, "refs/*");
+	} else {
+		long i;
+		for (i = 0; !error && i < RARRAY_LEN(rb_refs); ++i) {
+			VALUE rb_ref = rb_ary_entry(rb_refs, i);
+			error = git_revwalk_push_glob(args.walk, RSTRING_PTR(rb_ref));
+		}
+	}
+
+	if (!error)
+		error = git_commit_graph_writer_new(&writer, info_path);
+
+	if (error) {
+		git_revwalk_free(args.walk);
+		rugged_exception_check(error);
+	}
+
+	args.writer = writer;
+	args.written = 0;
+	args.error = 0;
+
+	/* The call is skipped while an interrupt is pending */
+	for (;;) {
+		int exception;
+
+		rb_thread_call_without_gvl2(rb_git_repo_write_commit_graph_nogvl, &args, RUBY_UBF_PROCESS, NULL);
+		if (args.written)
+			break;
+
+		if ((exception = rugged_check_ints_protect()) != 0) {
+			git_commit_graph_writer_free(writer);
+			git_revwalk_free(args.walk);
+			rb_jump_tag(exception);
+		}
+	}
+
+	git_commit_graph_writer_free(writer);
+	git_revwalk_free(args.walk);
+	RB_GC_GUARD(rb_info_path);
+
+	rb_thread_check_ints();
+	rugged_exception_check(args.error);
+
+	return Qnil;
+}
+
+static void rugged_checkout_instrument(uint64_t started, const char *source)
+{
+	VALUE rb_payload;
+
+	if (!started)
+		return;
+
+	rb_payload = rb_hash_new();
+	rb_hash_aset(rb_payload, CSTR2SYM("source"), CSTR2SYM(source));
+	rugged_instrument_emit("checkout", started, rb_payload);
+}
+
 /*
  *  call-seq:
  *    repo.default_signature -> signature or nil
@@ -2371,6 +3656,7 @@ static VALUE rb_git_checkout_tree(int argc, VALUE *argv, VALUE self)
 	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
 	struct rugged_cb_payload *payload;
 	int error, exception = 0;
+	uint64_t started = rugged_instrument_start();
 
 	rb_scan_args(argc, argv, "10:", &rb_treeish, &rb_options);
 
@@ -2407,6 +3693,8 @@ static VALUE rb_git_checkout_tree(int argc, VALUE *argv, VALUE self)
 
 	rugged_exception_check(error);
 
+	rugged_checkout_instrument(started, "tree");
+
 	return Qnil;
 }
 
@@ -2426,6 +3714,7 @@ static VALUE rb_git_checkout_index(int argc, VALUE *argv, VALUE self)
 	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
 	struct rugged_cb_payload *payload;
 	int error, exception = 0;
+	uint64_t started = rugged_instrument_start();
 
 	rb_scan_args(argc, argv, "10:", &rb_index, &rb_options);
 
@@ -2455,6 +3744,8 @@ static VALUE rb_git_checkout_index(int argc, VALUE *argv, VALUE self)
 
 	rugged_exception_check(error);
 
+	rugged_checkout_instrument(started, "index");
+
 	return Qnil;
 }
 
@@ -2473,6 +3764,7 @@ static VALUE rb_git_checkout_head(int argc, VALUE *argv, VALUE self)
 	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
 	struct rugged_cb_payload *payload;
 	int error, exception = 0;
+	uint64_t started = rugged_instrument_start();
 
 	rb_scan_args(argc, argv, "00:", &rb_options);
 
@@ -2498,6 +3790,8 @@ static VALUE rb_git_checkout_head(int argc, VALUE *argv, VALUE self)
 
 	rugged_exception_check(error);
 
+	rugged_checkout_instrument(started, "head");
+
 	return Qnil;
 }
 
@@ -2782,6 +4076,7 @@ void Init_rugged_repo(void)
 	rb_define_singleton_method(rb_cRuggedRepo, "bare", rb_git_repo_open_bare, -1);
 	rb_define_singleton_method(rb_cRuggedRepo, "hash_data", rb_git_repo_hash,  2);
 	rb_define_singleton_method(rb_cRuggedRepo, "hash_file", rb_git_repo_hashfile,  2);
+	rb_define_singleton_method(rb_cRuggedRepo, "hash_files", rb_git_repo_hashfiles, -1);
 	rb_define_singleton_method(rb_cRuggedRepo, "init_at", rb_git_repo_init_at, -1);
 	rb_define_singleton_method(rb_cRuggedRepo, "discover", rb_git_repo_discover, -1);
 	rb_define_singleton_method(rb_cRuggedRepo, "clone_at", rb_git_repo_clone_at, -1);
@@ -2794,9 +4089,13 @@ void Init_rugged_repo(void)
 	rb_define_method(rb_cRuggedRepo, "descendant_of?", rb_git_repo_descendant_of, 2);
 
 	rb_define_method(rb_cRuggedRepo, "read",   rb_git_repo_read,   1);
+	rb_define_method(rb_cRuggedRepo, "read_many",   rb_git_repo_read_many,   -1);
+	rb_define_method(rb_cRuggedRepo, "read_stream",   rb_git_repo_read_stream,   -1);
 	rb_define_method(rb_cRuggedRepo, "read_header",   rb_git_repo_read_header,   1);
 	rb_define_method(rb_cRuggedRepo, "write",  rb_git_repo_write,  2);
-	rb_define_method(rb_cRuggedRepo, "each_id",  rb_git_repo_each_id,  0);
+	rb_define_method(rb_cRuggedRepo, "hash_files",  rb_git_repo_hashfiles_instance,  -1);
+	rb_define_method(rb_cRuggedRepo, "write_stream",  rb_git_repo_write_stream,  2);
+	rb_define_method(rb_cRuggedRepo, "each_id",  rb_git_repo_each_id,  -1);
 
 	rb_define_method(rb_cRuggedRepo, "path",  rb_git_repo_path, 0);
 	rb_define_method(rb_cRuggedRepo, "workdir",  rb_git_repo_workdir, 0);
@@ -2842,6 +4141,7 @@ void Init_rugged_repo(void)
 	rb_define_method(rb_cRuggedRepo, "namespace", rb_git_repo_get_namespace, 0);
 
 	rb_define_method(rb_cRuggedRepo, "ahead_behind", rb_git_repo_ahead_behind, 2);
+	rb_define_method(rb_cRuggedRepo, "write_commit_graph", rb_git_repo_write_commit_graph, -1);
 
 	rb_define_method(rb_cRuggedRepo, "default_signature", rb_git_repo_default_signature, 0);
 
@@ -2856,8 +4156,14 @@ void Init_rugged_repo(void)
 	rb_cRuggedOdbObject = rb_define_class_under(rb_mRugged, "OdbObject", rb_cObject);
 	rb_undef_alloc_func(rb_cRuggedOdbObject);
 
-	rb_define_method(rb_cRuggedOdbObject, "data",  rb_git_odbobj_data,  0);
+	rb_define_method(rb_cRuggedOdbObject, "data",  rb_git_odbobj_data,  -1);
 	rb_define_method(rb_cRuggedOdbObject, "len",  rb_git_odbobj_size,  0);
 	rb_define_method(rb_cRuggedOdbObject, "type",  rb_git_odbobj_type,  0);
 	rb_define_method(rb_cRuggedOdbObject, "oid",  rb_git_odbobj_oid,  0);
+
+	rb_cRuggedOdbWriter = rb_define_class_under(rb_mRugged, "OdbWriter", rb_cObject);
+	rb_undef_alloc_func(rb_cRuggedOdbWriter);
+
+	rb_define_method(rb_cRuggedOdbWriter, "write", rb_git_odbwriter_write, 1);
+	rb_define_method(rb_cRuggedOdbWriter, "<<", rb_git_odbwriter_append, 1);
 }
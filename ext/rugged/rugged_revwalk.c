@@ -6,6 +6,9 @@
  */
 
 #include "rugged.h"
+#include <ruby/thread.h>
+
+#define RUGGED_WALK_DEFAULT_BATCH_SIZE 4096
 
 extern VALUE rb_mRugged;
 extern VALUE rb_cRuggedObject;
@@ -20,10 +23,20 @@ static void rb_git_walk__free(void *data)
 	git_revwalk_free(walk);
 }
 
+static size_t rb_git_walk__size(const void *data)
+{
+	/*
+	 * A placeholder, not an estimate: the commit pool grows as the walk
+	 * proceeds, but libgit2 gives no way to see how far.
+	 */
+	return 1024;
+}
+
 const rb_data_type_t rugged_walk_type = {
 	.wrap_struct_name = "Rugged::Walker",
 	.function = {
 		.dfree = rb_git_walk__free,
+		.dsize = rb_git_walk__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -53,6 +66,8 @@ static void push_commit_ref(git_revwalk *walk, const char *ref, int hide)
 
 static void push_commit_1(git_revwalk *walk, VALUE rb_commit, int hide)
 {
+	git_oid commit_oid;
+
 	if (rb_obj_is_kind_of(rb_commit, rb_cRuggedObject)) {
 		git_object *object;
 		TypedData_Get_Struct(rb_commit, git_object, &rugged_object_type, object);
@@ -61,10 +76,14 @@ static void push_commit_1(git_revwalk *walk, VALUE rb_commit, int hide)
 		return;
 	}
 
+	if (rugged_oid_extract(&commit_oid, rb_commit)) {
+		push_commit_oid(walk, &commit_oid, hide);
+		return;
+	}
+
 	Check_Type(rb_commit, T_STRING);
 
 	if (RSTRING_LEN(rb_commit) == 40) {
-		git_oid commit_oid;
 		if (git_oid_fromstr(&commit_oid, RSTRING_PTR(rb_commit)) == 0) {
 			push_commit_oid(walk, &commit_oid, hide);
 			return;
@@ -227,6 +246,37 @@ static VALUE rb_git_walker_reset(VALUE self)
 	return Qnil;
 }
 
+enum rugged_walk_field {
+	RUGGED_WALK_FIELD_OID,
+	RUGGED_WALK_FIELD_TIME,
+	RUGGED_WALK_FIELD_AUTHOR_NAME,
+	RUGGED_WALK_FIELD_AUTHOR_EMAIL,
+	RUGGED_WALK_FIELD_AUTHOR_TIME,
+	RUGGED_WALK_FIELD_COMMITTER_NAME,
+	RUGGED_WALK_FIELD_COMMITTER_EMAIL,
+	RUGGED_WALK_FIELD_PARENT_IDS,
+	RUGGED_WALK_FIELD_TREE_ID,
+	RUGGED_WALK_FIELD_SUMMARY,
+	RUGGED_WALK_FIELD_MESSAGE,
+	RUGGED_WALK_FIELD__COUNT
+};
+
+static const char *rugged_walk_field_names[RUGGED_WALK_FIELD__COUNT] = {
+	"oid",
+	"time",
+	"author_name",
+	"author_email",
+	"author_time",
+	"committer_name",
+	"committer_email",
+	"parent_ids",
+	"tree_id",
+	"summary",
+	"message",
+};
+
+#define RUGGED_WALK_MAX_FIELDS 32
+
 struct walk_options {
 	VALUE rb_owner;
 	VALUE rb_options;
@@ -235,8 +285,73 @@ struct walk_options {
 	git_revwalk *walk;
 	int oid_only;
 	uint64_t offset, limit;
+	size_t batch_size;
+	int yield_batches;
+
+	enum rugged_walk_field fields[RUGGED_WALK_MAX_FIELDS];
+	int field_count;
+	int want_summary;
 };
 
+static void load_walk_batch_size(struct walk_options *w, VALUE rb_value)
+{
+	if (NIL_P(rb_value) || rb_value == Qfalse)
+		return;
+
+	w->yield_batches = 1;
+
+	if (rb_value == Qtrue) {
+		w->batch_size = RUGGED_WALK_DEFAULT_BATCH_SIZE;
+		return;
+	}
+
+	Check_Type(rb_value, T_FIXNUM);
+	if (FIX2LONG(rb_value) <= 0)
+		rb_raise(rb_eArgError, "batch size must be a positive integer");
+
+	w->batch_size = FIX2ULONG(rb_value);
+}
+
+static void load_walk_fields(struct walk_options *w, VALUE rb_fields)
+{
+	long i;
+
+	if (NIL_P(rb_fields))
+		return;
+
+	Check_Type(rb_fields, T_ARRAY);
+
+	if (RARRAY_LEN(rb_fields) == 0)
+		rb_raise(rb_eArgError, "Expected at least one field to project");
+
+	if (RARRAY_LEN(rb_fields) > RUGGED_WALK_MAX_FIELDS)
+		rb_raise(rb_eArgError, "Too many fields to project (max %d)", RUGGED_WALK_MAX_FIELDS);
+
+	for (i = 0; i < RARRAY_LEN(rb_fields); ++i) {
+		VALUE rb_field = rb_ary_entry(rb_fields, i);
+		ID id_field;
+		int j;
+
+		Check_Type(rb_field, T_SYMBOL);
+		id_field = SYM2ID(rb_field);
+
+		for (j = 0; j < RUGGED_WALK_FIELD__COUNT; ++j) {
+			if (id_field == rb_intern(rugged_walk_field_names[j]))
+				break;
+		}
+
+		if (j == RUGGED_WALK_FIELD__COUNT)
+			rb_raise(rb_eArgError, "Unknown commit field `:%s`", rb_id2name(id_field));
+
+		if (j == RUGGED_WALK_FIELD_SUMMARY)
+			w->want_summary = 1;
+
+		w->fields[i] = (enum rugged_walk_field)j;
+	}
+
+	w->field_count = (int)RARRAY_LEN(rb_fields);
+}
+
 static void load_walk_limits(struct walk_options *w, VALUE rb_options)
 {
 	VALUE rb_value = rb_hash_lookup(rb_options, CSTR2SYM("offset"));
@@ -252,6 +367,17 @@ static void load_walk_limits(struct walk_options *w, VALUE rb_options)
 	}
 }
 
+static void init_walk_options(struct walk_options *w, int oid_only)
+{
+	w->oid_only = oid_only;
+	w->offset = 0;
+	w->limit = UINT64_MAX;
+	w->batch_size = 0;
+	w->yield_batches = 0;
+	w->field_count = 0;
+	w->want_summary = 0;
+}
+
 static VALUE load_all_options(VALUE _payload)
 {
 	struct walk_options *w = (struct walk_options *)_payload;
@@ -286,6 +412,266 @@ static VALUE load_all_options(VALUE _payload)
 		w->oid_only = 1;
 	}
 
+	load_walk_batch_size(w, rb_hash_lookup(rb_options, CSTR2SYM("batch")));
+	load_walk_fields(w, rb_hash_lookup(rb_options, CSTR2SYM("fields")));
+
+	return Qnil;
+}
+
+static VALUE rugged_walk_project_commit(struct walk_options *w, git_commit *commit)
+{
+	VALUE rb_tuple = rb_ary_new2(w->field_count);
+	rb_encoding *encoding = rb_utf8_encoding();
+	const char *encoding_name;
+	int i;
+
+	encoding_name = git_commit_message_encoding(commit);
+	if (encoding_name != NULL)
+		encoding = rb_enc_find(encoding_name);
+
+	for (i = 0; i < w->field_count; ++i) {
+		VALUE rb_value = Qnil;
+		const git_signature *sig;
+		const char *str;
+
+		switch (w->fields[i]) {
+		case RUGGED_WALK_FIELD_OID:
+			rb_value = rugged_create_oid(git_commit_id(commit));
+			break;
+
+		case RUGGED_WALK_FIELD_TIME:
+			rb_value = LL2NUM(git_commit_time(commit));
+			break;
+
+		case RUGGED_WALK_FIELD_AUTHOR_NAME:
+			sig = git_commit_author(commit);
+			rb_value = rb_enc_str_new(sig->name, strlen(sig->name), encoding);
+			break;
+
+		case RUGGED_WALK_FIELD_AUTHOR_EMAIL:
+			sig = git_commit_author(commit);
+			rb_value = rb_enc_str_new(sig->email, strlen(sig->email), encoding);
+			break;
+
+		case RUGGED_WALK_FIELD_AUTHOR_TIME:
+			sig = git_commit_author(commit);
+			rb_value = LL2NUM(sig->when.time);
+			break;
+
+		case RUGGED_WALK_FIELD_COMMITTER_NAME:
+			sig = git_commit_committer(commit);
+			rb_value = rb_enc_str_new(sig->name, strlen(sig->name), encoding);
+			break;
+
+		case RUGGED_WALK_FIELD_COMMITTER_EMAIL:
+			sig = git_commit_committer(commit);
+			rb_value = rb_enc_str_new(sig->email, strlen(sig->email), encoding);
+			break;
+
+		case RUGGED_WALK_FIELD_PARENT_IDS: {
+			unsigned int n, parent_count = git_commit_parentcount(commit);
+
+			rb_value = rb_ary_new2(parent_count);
+			for (n = 0; n < parent_count; ++n)
+				rb_ary_push(rb_value, rugged_create_oid(git_commit_parent_id(commit, n)));
+			break;
+		}
+
+		case RUGGED_WALK_FIELD_TREE_ID:
+			rb_value = rugged_create_oid(git_commit_tree_id(commit));
+			break;
+
+		case RUGGED_WALK_FIELD_SUMMARY:
+			str = git_commit_summary(commit);
+			if (str)
+				rb_value = rb_enc_str_new(str, strlen(str), encoding);
+			break;
+
+		case RUGGED_WALK_FIELD_MESSAGE:
+			str = git_commit_message(commit);
+			rb_value = rb_enc_str_new(str, strlen(str), encoding);
+			break;
+
+		default:
+			break;
+		}
+
+		rb_ary_push(rb_tuple, rb_value);
+	}
+
+	return rb_obj_freeze(rb_tuple);
+}
+
+struct nogvl_walk_batch_args {
+	struct walk_options *w;
+	git_oid *oids;
+	git_commit **commits;
+	size_t count;
+	size_t consumed;
+	volatile int cancelled;
+	int error;
+};
+
+/*
+ * Advance the revwalk by up to one batch worth of commits, and parse
+ * them if the caller needs more than their OIDs. This runs without the
+ * GVL, so it must not touch any Ruby objects.
+ */
+static void *do_walk_batch_nogvl(void *_args)
+{
+	struct nogvl_walk_batch_args *args = (struct nogvl_walk_batch_args *)_args;
+	struct walk_options *w = args->w;
+	git_oid commit_oid;
+	int error = 0;
+
+	args->count = 0;
+
+	while (args->count < w->batch_size && w->limit > 0 && !args->cancelled) {
+		if ((error = git_revwalk_next(&commit_oid, w->walk)) < 0)
+			break;
+
+		if (w->offset > 0) {
+			w->offset--;
+			continue;
+		}
+
+		if (args->commits) {
+			git_commit *commit;
+
+			if ((error = git_commit_lookup(&commit, w->repo, &commit_oid)) < 0)
+				break;
+
+			if (w->want_summary)
+				git_commit_summary(commit);
+
+			args->commits[args->count] = commit;
+		}
+
+		git_oid_cpy(&args->oids[args->count++], &commit_oid);
+		w->limit--;
+	}
+
+	args->error = error;
+	return NULL;
+}
+
+static void do_walk_batch_cancel(void *_args)
+{
+	((struct nogvl_walk_batch_args *)_args)->cancelled = 1;
+}
+
+static void walk_batch_free_commits(struct nogvl_walk_batch_args *args, size_t from)
+{
+	size_t i;
+
+	if (!args->commits)
+		return;
+
+	for (i = from; i < args->count; ++i)
+		git_commit_free(args->commits[i]);
+}
+
+/*
+ * Turn a batch into Ruby objects. +consumed+ counts the commits that were
+ * already freed or handed over to Ruby, in case this raises.
+ */
+static VALUE walk_batch_build(VALUE _args)
+{
+	struct nogvl_walk_batch_args *args = (struct nogvl_walk_batch_args *)_args;
+	struct walk_options *w = args->w;
+	VALUE rb_batch = rb_ary_new2(args->count);
+	size_t i;
+
+	for (i = 0; i < args->count; ++i) {
+		if (w->field_count > 0) {
+			rb_ary_push(rb_batch, rugged_walk_project_commit(w, args->commits[i]));
+			git_commit_free(args->commits[i]);
+			args->consumed = i + 1;
+		} else if (w->oid_only) {
+			rb_ary_push(rb_batch, rugged_create_oid(&args->oids[i]));
+		} else {
+			/* Once wrapped, the commit is freed by the GC, not by us */
+			VALUE rb_commit = rugged_object_new(w->rb_owner, (git_object *)args->commits[i]);
+			args->consumed = i + 1;
+			rb_ary_push(rb_batch, rb_commit);
+		}
+	}
+
+	return rb_batch;
+}
+
+static VALUE do_walk_batched(struct walk_options *w)
+{
+	struct nogvl_walk_batch_args args;
+	VALUE rb_oids_buffer, rb_commits_buffer = 0;
+	size_t i;
+	int exception = 0;
+
+	args.w = w;
+	args.oids = ALLOCV_N(git_oid, rb_oids_buffer, w->batch_size);
+	args.commits = NULL;
+
+	if (w->field_count > 0 || !w->oid_only)
+		args.commits = ALLOCV_N(git_commit *, rb_commits_buffer, w->batch_size);
+
+	for (;;) {
+		VALUE rb_batch;
+		uint64_t started = rugged_instrument_start();
+
+		/* The call is skipped if an interrupt is already pending */
+		args.count = 0;
+		args.error = 0;
+		args.cancelled = 0;
+		rb_thread_call_without_gvl2(do_walk_batch_nogvl, &args, do_walk_batch_cancel, &args);
+
+		/* An interrupt may raise, which must not leak the batch */
+		if ((exception = rugged_check_ints_protect()) != 0) {
+			walk_batch_free_commits(&args, 0);
+			rb_jump_tag(exception);
+		}
+
+		if (args.error < 0 && args.error != GIT_ITEROVER) {
+			walk_batch_free_commits(&args, 0);
+			rugged_exception_check(args.error);
+		}
+
+		/*
+		 * Nothing was read without reaching the end of the walk: an
+		 * interrupt that didn't raise skipped the call or cut it short.
+		 */
+		if (args.count == 0) {
+			if (args.error == 0 && w->limit > 0)
+				continue;
+			break;
+		}
+
+		args.consumed = 0;
+		rb_batch = rb_protect(walk_batch_build, (VALUE)&args, &exception);
+		if (exception) {
+			walk_batch_free_commits(&args, args.consumed);
+			rb_jump_tag(exception);
+		}
+
+		if (started) {
+			VALUE rb_payload = rb_hash_new();
+			rb_hash_aset(rb_payload, CSTR2SYM("count"), SIZET2NUM(args.count));
+			rugged_instrument_emit("revwalk.batch", started, rb_payload);
+		}
+
+		if (w->yield_batches) {
+			rb_yield(rb_batch);
+		} else {
+			for (i = 0; i < args.count; ++i)
+				rb_yield(rb_ary_entry(rb_batch, i));
+		}
+
+		if (args.error != 0 || w->limit == 0)
+			break;
+	}
+
+	ALLOCV_END(rb_commits_buffer);
+	ALLOCV_END(rb_oids_buffer);
+
 	return Qnil;
 }
 
@@ -295,6 +681,12 @@ static VALUE do_walk(VALUE _payload)
 	int error;
 	git_oid commit_oid;
 
+	if (w->field_count > 0 && w->batch_size == 0)
+		w->batch_size = RUGGED_WALK_DEFAULT_BATCH_SIZE;
+
+	if (w->batch_size > 0)
+		return do_walk_batched(w);
+
 	while ((error = git_revwalk_next(&commit_oid, w->walk)) == 0) {
 		if (w->offset > 0) {
 			w->offset--;
@@ -354,6 +746,17 @@ static VALUE do_walk(VALUE _payload)
  *	- +simplify+: if +true+, the walk will be simplified
  *	to the first parent of each commit.
  *
+ *	- +batch+: if set to a positive integer, the walk will advance
+ *	that many commits at a time without holding the GVL, and yield
+ *	an +Array+ of commits (or OIDs, when +oid_only+ is set) for each
+ *	batch instead of a single commit. Passing +true+ uses a batch
+ *	size of 4096.
+ *
+ *	- +fields+: an +Array+ of commit fields to project. When given,
+ *	the walker will yield a frozen +Array+ with the requested fields
+ *	of each commit (in the same order), instead of a +Rugged::Commit+.
+ *	See Rugged::Walker#each for the list of supported fields.
+ *
  *	Example:
  *
  *    Rugged::Walker.walk(repo,
@@ -386,9 +789,7 @@ static VALUE rb_git_walk(int argc, VALUE *argv, VALUE self)
 	w.rb_owner = rb_repo;
 	w.rb_options = rb_options;
 
-	w.oid_only = 0;
-	w.offset = 0;
-	w.limit = UINT64_MAX;
+	init_walk_options(&w, 0);
 
 	if (!NIL_P(w.rb_options))
 		rb_protect(load_all_options, (VALUE)&w, &exception);
@@ -418,12 +819,12 @@ static VALUE rb_git_walk_with_opts(int argc, VALUE *argv, VALUE self, int oid_on
 	w.rb_owner = rugged_owner(self);
 	w.rb_options = Qnil;
 
-	w.oid_only = oid_only;
-	w.offset = 0;
-	w.limit = UINT64_MAX;
+	init_walk_options(&w, oid_only);
 
-	if (!NIL_P(rb_options))
+	if (!NIL_P(rb_options)) {
 		load_walk_limits(&w, rb_options);
+		load_walk_fields(&w, rb_hash_lookup(rb_options, CSTR2SYM("fields")));
+	}
 
 	return do_walk((VALUE)&w);
 }
@@ -452,6 +853,32 @@ static VALUE rb_git_walk_with_opts(int argc, VALUE *argv, VALUE self, int oid_on
  *    ef9207141549f4ffcd3c4597e270d32e10d0a6bc
  *    cb75e05f0f8ac3407fb3bd0ebd5ff07573b16c9f
  *    ...
+ *
+ *  If the +fields+ option is given, only the requested fields of each
+ *  commit are extracted, and a frozen +Array+ holding them in the given
+ *  order is yielded instead of a <tt>Rugged::Commit</tt>. Commits are
+ *  parsed in batches without holding the GVL. The supported fields are:
+ *
+ *  :oid ::
+ *    The commit's OID, as a 40-char hex +String+.
+ *  :time ::
+ *    The committer time, as an +Integer+ of seconds since the Epoch.
+ *  :author_name, :author_email ::
+ *    The author's name and email, as +String+s.
+ *  :author_time ::
+ *    The author time, as an +Integer+ of seconds since the Epoch.
+ *  :committer_name, :committer_email ::
+ *    The committer's name and email, as +String+s.
+ *  :parent_ids ::
+ *    An +Array+ with the OIDs of the commit's parents.
+ *  :tree_id ::
+ *    The OID of the commit's tree.
+ *  :summary, :message ::
+ *    The commit's summary and full message.
+ *
+ *    walker.each(fields: [:oid, :time, :summary]) do |oid, time, summary|
+ *      puts "#{oid[0, 7]} #{summary}"
+ *    end
  */
 static VALUE rb_git_walker_each(int argc, VALUE *argv, VALUE self)
 {
@@ -488,6 +915,56 @@ static VALUE rb_git_walker_each_oid(int argc, VALUE *argv, VALUE self)
 	return rb_git_walk_with_opts(argc, argv, self, 1);
 }
 
+/*
+ *  call-seq:
+ *    walker.each_batch(size: 4096) { |oids| block }
+ *    walker.each_batch(size: 4096) -> Enumerator
+ *
+ *  Perform the walk through the repository, yielding the commit oids
+ *  found as an +Array+ of up to +size+ <tt>String</tt>s at a time.
+ *
+ *  Each batch is computed without holding the GVL, so other Ruby threads
+ *  can keep running while the walk advances. The +offset+, +limit+ and
+ *  +fields+ options are also accepted, and behave as in Rugged::Walker#each.
+ *
+ *  If no +block+ is given, an +Enumerator+ will be returned.
+ *
+ *    walker.push("92b22bbcb37caf4f6f53d30292169e84f5e4283b")
+ *    walker.each_batch(size: 2) { |oids| p oids }
+ *
+ *  generates:
+ *
+ *    ["92b22bbcb37caf4f6f53d30292169e84f5e4283b", "6b750d5800439b502de669465b385e5f469c78b6"]
+ *    ["ef9207141549f4ffcd3c4597e270d32e10d0a6bc", "cb75e05f0f8ac3407fb3bd0ebd5ff07573b16c9f"]
+ *    ...
+ */
+static VALUE rb_git_walker_each_batch(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rb_options;
+	struct walk_options w;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "00:", &rb_options);
+
+	TypedData_Get_Struct(self, git_revwalk, &rugged_walk_type, w.walk);
+	w.repo = git_revwalk_repository(w.walk);
+
+	w.rb_owner = rugged_owner(self);
+	w.rb_options = Qnil;
+
+	init_walk_options(&w, 1);
+	w.batch_size = RUGGED_WALK_DEFAULT_BATCH_SIZE;
+	w.yield_batches = 1;
+
+	if (!NIL_P(rb_options)) {
+		load_walk_limits(&w, rb_options);
+		load_walk_batch_size(&w, rb_hash_lookup(rb_options, CSTR2SYM("size")));
+		load_walk_fields(&w, rb_hash_lookup(rb_options, CSTR2SYM("fields")));
+	}
+
+	return do_walk_batched(&w);
+}
+
 
 
 void Init_rugged_revwalk(void)
@@ -502,6 +979,7 @@ void Init_rugged_revwalk(void)
 	rb_define_method(rb_cRuggedWalker, "push_range", rb_git_walker_push_range, 1);
 	rb_define_method(rb_cRuggedWalker, "each", rb_git_walker_each, -1);
 	rb_define_method(rb_cRuggedWalker, "each_oid", rb_git_walker_each_oid, -1);
+	rb_define_method(rb_cRuggedWalker, "each_batch", rb_git_walker_each_batch, -1);
 	rb_define_method(rb_cRuggedWalker, "walk", rb_git_walker_each, -1);
 	rb_define_method(rb_cRuggedWalker, "hide", rb_git_walker_hide, 1);
 	rb_define_method(rb_cRuggedWalker, "reset", rb_git_walker_reset, 0);
@@ -6,6 +6,9 @@
  */
 
 #include "rugged.h"
+#ifdef RUGGED_MWINDOW_STATS
+#include "rugged_mwindow.h"
+#endif
 
 #if !defined(NUM2SIZET)
 #  if SIZEOF_SIZE_T == SIZEOF_LONG
@@ -69,6 +72,13 @@ static VALUE rb_git_set_option(VALUE self, VALUE option, VALUE value)
 		git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, val);
 	}
 
+	else if (strcmp(opt, "mwindow_file_limit") == 0) {
+		size_t val;
+		Check_Type(value, T_FIXNUM);
+		val = NUM2SIZET(value);
+		git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, val);
+	}
+
 	else if (strcmp(opt, "search_path_global") == 0) {
 		set_search_path(GIT_CONFIG_LEVEL_GLOBAL, value);
 	}
@@ -96,6 +106,10 @@ static VALUE rb_git_set_option(VALUE self, VALUE option, VALUE value)
 		git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, validation);
 	}
 
+	else if (strcmp(opt, "allocator") == 0) {
+		rugged_allocator_mode_set(value);
+	}
+
 	else {
 		rb_raise(rb_eArgError, "Unknown option specified");
 	}
@@ -128,6 +142,12 @@ static VALUE rb_git_get_option(VALUE self, VALUE option)
 		return SIZET2NUM(val);
 	}
 
+	else if (strcmp(opt, "mwindow_file_limit") == 0) {
+		size_t val;
+		git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &val);
+		return SIZET2NUM(val);
+	}
+
 	else if (strcmp(opt, "search_path_global") == 0) {
 		return get_search_path(GIT_CONFIG_LEVEL_GLOBAL);
 	}
@@ -146,6 +166,14 @@ static VALUE rb_git_get_option(VALUE self, VALUE option)
 		return validation ? Qtrue : Qfalse;
 	}
 
+	else if (strcmp(opt, "allocator") == 0) {
+		return rugged_allocator_mode_get();
+	}
+
+	else if (strcmp(opt, "allocator_pool_size") == 0) {
+		return SIZET2NUM(rugged_allocator_pool_size());
+	}
+
 	else {
 		rb_raise(rb_eArgError, "Unknown option specified");
 	}
@@ -177,6 +205,68 @@ static VALUE rb_git_get_used_cache_size(VALUE mod) {
     return SIZET2NUM(val);
 }
 
+/*
+ *  call-seq:
+ *    Rugged::Settings.pack_stats -> hash
+ *
+ *  Returns a Hash describing how packfiles are currently mapped into memory.
+ *  These are process-wide: libgit2 shares its pack windows and open pack
+ *  files between all repositories.
+ *
+ *  :window_size ::
+ *    The size of each mapped window (Settings['mwindow_size']).
+ *  :mapped_limit ::
+ *    The soft limit on mapped bytes (Settings['mwindow_mapped_limit']).
+ *  :file_limit ::
+ *    The limit on open pack files, or 0 if unlimited
+ *    (Settings['mwindow_file_limit']).
+ *
+ *  When Rugged is built against its bundled libgit2, the Hash also contains
+ *  live counters:
+ *
+ *  :mapped_bytes, :peak_mapped_bytes ::
+ *    Bytes of packfiles currently (and at most) mapped.
+ *  :open_windows, :peak_open_windows ::
+ *    Number of windows currently (and at most) mapped.
+ *  :open_files ::
+ *    Number of pack files currently open.
+ *  :window_hits, :window_misses ::
+ *    How often a lookup switched to an already mapped window, and how often
+ *    a new window had to be mapped, since the process started.
+ */
+static VALUE rb_git_get_pack_stats(VALUE mod)
+{
+	size_t window_size, mapped_limit, file_limit;
+	VALUE rb_stats = rb_hash_new();
+
+	git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &window_size);
+	git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, &mapped_limit);
+	git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &file_limit);
+
+	rb_hash_aset(rb_stats, CSTR2SYM("window_size"), SIZET2NUM(window_size));
+	rb_hash_aset(rb_stats, CSTR2SYM("mapped_limit"), SIZET2NUM(mapped_limit));
+	rb_hash_aset(rb_stats, CSTR2SYM("file_limit"), SIZET2NUM(file_limit));
+
+#ifdef RUGGED_MWINDOW_STATS
+	{
+		struct rugged_mwindow_stats mw;
+
+		if (rugged_mwindow_stats_get(&mw) < 0)
+			rb_raise(rb_eRuntimeError, "failed to lock the pack window list");
+
+		rb_hash_aset(rb_stats, CSTR2SYM("mapped_bytes"), SIZET2NUM(mw.mapped));
+		rb_hash_aset(rb_stats, CSTR2SYM("peak_mapped_bytes"), SIZET2NUM(mw.peak_mapped));
+		rb_hash_aset(rb_stats, CSTR2SYM("open_windows"), UINT2NUM(mw.open_windows));
+		rb_hash_aset(rb_stats, CSTR2SYM("peak_open_windows"), UINT2NUM(mw.peak_open_windows));
+		rb_hash_aset(rb_stats, CSTR2SYM("open_files"), SIZET2NUM(mw.open_files));
+		rb_hash_aset(rb_stats, CSTR2SYM("window_hits"), SIZET2NUM(mw.used > mw.mmap_calls ? mw.used - mw.mmap_calls : 0));
+		rb_hash_aset(rb_stats, CSTR2SYM("window_misses"), SIZET2NUM(mw.mmap_calls));
+	}
+#endif
+
+	return rb_stats;
+}
+
 void Init_rugged_settings(void)
 {
 	VALUE rb_cRuggedSettings = rb_define_class_under(rb_mRugged, "Settings", rb_cObject);
@@ -184,4 +274,5 @@ void Init_rugged_settings(void)
 	rb_define_module_function(rb_cRuggedSettings, "[]", rb_git_get_option, 1);
 	rb_define_module_function(rb_cRuggedSettings, "max_cache_size", rb_git_get_max_cache_size, 0);
 	rb_define_module_function(rb_cRuggedSettings, "used_cache_size", rb_git_get_used_cache_size, 0);
+	rb_define_module_function(rb_cRuggedSettings, "pack_stats", rb_git_get_pack_stats, 0);
 }
@@ -32,10 +32,19 @@ static void rb_git_submodule__free(void *data)
 	git_submodule_free(submodule);
 }
 
+static size_t rb_git_submodule__size(const void *data)
+{
+	git_submodule *submodule = (git_submodule *) data;
+	const char *url = git_submodule_url(submodule);
+
+	return 256 + strlen(git_submodule_path(submodule)) + (url ? strlen(url) : 0);
+}
+
 const rb_data_type_t rugged_submodule_type = {
 	.wrap_struct_name = "Rugged::Submodule",
 	.function = {
 		.dfree = rb_git_submodule__free,
+		.dsize = rb_git_submodule__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
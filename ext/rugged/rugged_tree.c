@@ -215,8 +215,7 @@ static VALUE rb_git_tree_get_entry_by_oid(VALUE self, VALUE rb_oid)
 	git_oid oid;
 	TypedData_Get_Struct(self, git_tree, &rugged_object_type, tree);
 
-	Check_Type(rb_oid, T_STRING);
-	rugged_exception_check(git_oid_fromstr(&oid, StringValueCStr(rb_oid)));
+	rugged_exception_check(rugged_oid_from_value(&oid, rb_oid));
 
 	return rb_git_treeentry_fromC(git_tree_entry_byid(tree, &oid));
 }
@@ -365,14 +364,17 @@ static VALUE rb_git_diff_tree_to_index(VALUE self, VALUE rb_repo, VALUE rb_self,
 {
 	git_tree *tree = NULL;
 	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	struct rugged_diff_budget budget;
 	git_repository *repo = NULL;
 	git_diff *diff = NULL;
 	git_index *index;
+	uint64_t started = rugged_instrument_start();
 	int error;
 
 	TypedData_Get_Struct(rb_repo, git_repository, &rugged_repository_type, repo);
 	TypedData_Get_Struct(rb_other, git_index, &rugged_index_type, index);
 
+	rugged_parse_diff_budget(&budget, &opts, rb_options);
 	rugged_parse_diff_options(&opts, rb_options);
 
 	if (RTEST(rb_self)) {
@@ -384,7 +386,8 @@ static VALUE rb_git_diff_tree_to_index(VALUE self, VALUE rb_repo, VALUE rb_self,
 	rugged_strarray_dispose(&opts.pathspec);
 	rugged_exception_check(error);
 
-	return rugged_diff_new(rb_cRuggedDiff, rb_repo, diff);
+	return rugged_diff_instrument("diff.tree_to_index", started,
+		rugged_diff_budget_attach(rugged_diff_new(rb_cRuggedDiff, rb_repo, diff), &budget));
 }
 
 struct nogvl_diff_args {
@@ -409,9 +412,11 @@ static VALUE rb_git_diff_tree_to_tree(VALUE self, VALUE rb_repo, VALUE rb_tree,
 	git_tree *tree = NULL;
 	git_tree *other_tree = NULL;
 	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	struct rugged_diff_budget budget;
 	git_repository *repo = NULL;
 	git_diff *diff = NULL;
 	struct nogvl_diff_args args;
+	uint64_t started = rugged_instrument_start();
 
 	TypedData_Get_Struct(rb_repo, git_repository, &rugged_repository_type, repo);
 
@@ -421,6 +426,7 @@ static VALUE rb_git_diff_tree_to_tree(VALUE self, VALUE rb_repo, VALUE rb_tree,
 	if(RTEST(rb_other_tree))
 	    TypedData_Get_Struct(rb_other_tree, git_tree, &rugged_object_type, other_tree);
 
+	rugged_parse_diff_budget(&budget, &opts, rb_options);
 	rugged_parse_diff_options(&opts, rb_options);
 
 	args.repo = repo;
@@ -433,7 +439,8 @@ static VALUE rb_git_diff_tree_to_tree(VALUE self, VALUE rb_repo, VALUE rb_tree,
 	rugged_strarray_dispose(&opts.pathspec);
 	rugged_exception_check(args.error);
 
-	return rugged_diff_new(rb_cRuggedDiff, rb_repo, diff);
+	return rugged_diff_instrument("diff.tree_to_tree", started,
+		rugged_diff_budget_attach(rugged_diff_new(rb_cRuggedDiff, rb_repo, diff), &budget));
 }
 
 /*
@@ -451,12 +458,15 @@ static VALUE rb_git_tree_diff_workdir(int argc, VALUE *argv, VALUE self)
 {
 	git_tree *tree;
 	git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+	struct rugged_diff_budget budget;
 	git_repository *repo;
 	git_diff *diff;
 	VALUE owner, rb_options;
+	uint64_t started = rugged_instrument_start();
 	int error;
 
 	rb_scan_args(argc, argv, "00:", &rb_options);
+	rugged_parse_diff_budget(&budget, &opts, rb_options);
 	rugged_parse_diff_options(&opts, rb_options);
 
 	TypedData_Get_Struct(self, git_tree, &rugged_object_type, tree);
@@ -468,7 +478,8 @@ static VALUE rb_git_tree_diff_workdir(int argc, VALUE *argv, VALUE self)
 	rugged_strarray_dispose(&opts.pathspec);
 	rugged_exception_check(error);
 
-	return rugged_diff_new(rb_cRuggedDiff, owner, diff);
+	return rugged_diff_instrument("diff.tree_to_workdir", started,
+		rugged_diff_budget_attach(rugged_diff_new(rb_cRuggedDiff, owner, diff), &budget));
 }
 
 void rugged_parse_merge_options(git_merge_options *opts, VALUE rb_options)
@@ -661,13 +672,15 @@ static void parse_tree_updates(git_tree_update **out, int *nupdates_out, VALUE r
 		action = SYM2ID(rb_action);
 
 		if (action == rb_intern("upsert")) {
-			if (!RB_TYPE_P(rb_oid, T_STRING) ||!RB_TYPE_P(rb_filemode, T_FIXNUM))
+			if (!RB_TYPE_P(rb_filemode, T_FIXNUM))
 				goto on_error;
 
 			update->action = GIT_TREE_UPDATE_UPSERT;
 			update->filemode = NUM2INT(rb_filemode);
 
-			if (git_oid_fromstr(&update->id, StringValueCStr(rb_oid)) < 0)
+			if (!rugged_oid_extract(&update->id, rb_oid) &&
+				(!RB_TYPE_P(rb_oid, T_STRING) ||
+				 git_oid_fromstr(&update->id, StringValueCStr(rb_oid)) < 0))
 				goto on_error;
 		} else if (action == rb_intern("remove")) {
 			update->action = GIT_TREE_UPDATE_REMOVE;
@@ -736,10 +749,19 @@ static void rb_git_treebuilder__free(void *data)
 	git_treebuilder_free(bld);
 }
 
+static size_t rb_git_treebuilder__size(const void *data)
+{
+	git_treebuilder *bld = (git_treebuilder *) data;
+
+	/* Same estimate as for trees: an entry plus a short filename */
+	return git_treebuilder_entrycount(bld) * 64;
+}
+
 const rb_data_type_t rugged_treebuilder_type = {
 	.wrap_struct_name = "Rugged::Tree::Builder",
 	.function = {
 		.dfree = rb_git_treebuilder__free,
+		.dsize = rb_git_treebuilder__size,
 	},
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -834,8 +856,7 @@ static VALUE rb_git_treebuilder_insert(VALUE self, VALUE rb_entry)
 	Check_Type(rb_path, T_STRING);
 
 	rb_oid = rb_hash_aref(rb_entry, CSTR2SYM("oid"));
-	Check_Type(rb_oid, T_STRING);
-	rugged_exception_check(git_oid_fromstr(&oid, StringValueCStr(rb_oid)));
+	rugged_exception_check(rugged_oid_from_value(&oid, rb_oid));
 
 	rb_attr = rb_hash_aref(rb_entry, CSTR2SYM("filemode"));
 	Check_Type(rb_attr, T_FIXNUM);
@@ -14,6 +14,9 @@ require 'rugged/object'
 require 'rugged/commit'
 require 'rugged/version'
 require 'rugged/repository'
+require 'rugged/repository_pool'
+require 'rugged/pack_tuner'
+require 'rugged/after_fork'
 require 'rugged/reference'
 require 'rugged/walker'
 require 'rugged/tree'
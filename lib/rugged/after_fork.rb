@@ -0,0 +1,40 @@
+# Copyright (C) the Rugged contributors.  All rights reserved.
+#
+# This file is part of Rugged, distributed under the MIT license.
+# For full terms see the included LICENSE file.
+
+module Rugged
+  # Release the libgit2 state a forked child inherited from its parent.
+  #
+  # Every open Repository is closed, which drops its object cache, index,
+  # config and refdb, and unmaps the pack windows of its ODB. Each handle
+  # stays usable and reopens what it needs on demand, so the child maps
+  # only the packs it actually reads instead of touching pages shared with
+  # its parent and its siblings.
+  #
+  # This runs automatically in children forked on Ruby 3.1 and later. On
+  # older rubies, call it at the start of each child, e.g. from Unicorn's
+  # +after_fork+ or Puma's +on_worker_boot+ hook.
+  #
+  # Closing a repository takes libgit2's internal locks, so fork waits for
+  # Rugged's own native threads (Repository#prefetch and the workers of
+  # calls taking a +threads+ option) to put those locks down first. A fork
+  # made while another Ruby thread is still inside a Rugged call can leave
+  # them held in the child, so fork while the process is otherwise idle.
+  #
+  # Returns nil.
+  def self.after_fork!
+    ObjectSpace.each_object(Rugged::Repository, &:close)
+    nil
+  end
+
+  module AfterForkHook # :nodoc:
+    def _fork
+      pid = super
+      Rugged.after_fork! if pid == 0
+      pid
+    end
+  end
+
+  Process.singleton_class.prepend(AfterForkHook) if Process.respond_to?(:_fork)
+end
@@ -14,8 +14,10 @@ module Rugged
 
     attr_reader :owner
 
-    def patches
-      each_patch.to_a
+    # Returns an Array of all the patches in this diff. Pass +threads+ to
+    # generate them in parallel; see #each_patch.
+    def patches(**options)
+      each_patch(**options).to_a
     end
 
     def deltas
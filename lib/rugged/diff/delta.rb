@@ -18,6 +18,12 @@ module Rugged
 
       alias binary? binary
 
+      # Returns true if no patch was generated for this delta because the
+      # diff, or the latest Diff#each_patch, went over its budget.
+      attr_reader :truncated
+
+      alias truncated? truncated
+
       def added?
         status == :added
       end
@@ -0,0 +1,97 @@
+# Copyright (C) the Rugged contributors.  All rights reserved.
+#
+# This file is part of Rugged, distributed under the MIT license.
+# For full terms see the included LICENSE file.
+
+module Rugged
+  # Adjusts libgit2's pack window settings from the hit rate reported by
+  # Settings.pack_stats, without letting mapped packfiles grow past a
+  # memory ceiling or open pack files past a descriptor budget.
+  #
+  # Each call to #tune looks at the window hits and misses since the
+  # previous call. When too many lookups had to map a new window it first
+  # raises the mapped limit, so fewer windows get evicted, and then the
+  # window size, so each window covers more of a pack. If windows were being
+  # closed because too many pack files were open, it raises the file limit
+  # instead. Settings beyond either ceiling, including an unlimited file
+  # limit, are always brought back within it.
+  #
+  #   tuner = Rugged::PackTuner.new(memory_limit: 512 * 1024 * 1024)
+  #   tuner.start(interval: 30)
+  class PackTuner
+    attr_reader :memory_limit, :max_open_files, :target_hit_rate
+
+    # memory_limit    - The most bytes of packfiles to keep mapped.
+    # max_open_files  - The most pack files to keep open (default: half the
+    #                   process's descriptor limit).
+    # target_hit_rate - The fraction of window lookups that should find an
+    #                   already mapped window (default 0.95).
+    # min_samples     - Intervals with fewer lookups than this are ignored.
+    def initialize(memory_limit:, max_open_files: nil, target_hit_rate: 0.95, min_samples: 100)
+      unless Rugged::Settings.pack_stats.key?(:window_hits)
+        raise NotImplementedError, "pack statistics require Rugged's bundled libgit2"
+      end
+
+      @memory_limit = memory_limit
+      @max_open_files = max_open_files || Process.getrlimit(:NOFILE).first / 2
+      @target_hit_rate = target_hit_rate
+      @min_samples = min_samples
+      @last = Rugged::Settings.pack_stats
+    end
+
+    # Look at the window hit rate since the last call and adjust the settings
+    # once. Returns a Hash of the settings that were changed, which is empty
+    # if there was nothing to do.
+    def tune
+      stats = Rugged::Settings.pack_stats
+      hits = stats[:window_hits] - @last[:window_hits]
+      misses = stats[:window_misses] - @last[:window_misses]
+      @last = stats
+
+      changes = {}
+      file_limit = stats[:file_limit]
+
+      if stats[:mapped_limit] > @memory_limit
+        changes['mwindow_mapped_limit'] = @memory_limit
+      end
+
+      if file_limit == 0 || file_limit > @max_open_files
+        changes['mwindow_file_limit'] = @max_open_files
+      end
+
+      if changes.empty? && hits + misses >= @min_samples && hits.fdiv(hits + misses) < @target_hit_rate
+        if stats[:open_files] >= file_limit && file_limit < @max_open_files
+          changes['mwindow_file_limit'] = [file_limit * 2, @max_open_files].min
+        elsif stats[:mapped_limit] < @memory_limit
+          changes['mwindow_mapped_limit'] = [stats[:mapped_limit] * 2, @memory_limit].min
+        elsif stats[:window_size] * 16 <= @memory_limit
+          changes['mwindow_size'] = stats[:window_size] * 2
+        end
+      end
+
+      changes.each { |option, value| Rugged::Settings[option] = value }
+      changes
+    end
+
+    # Call #tune every +interval+ seconds from a background thread until
+    # #stop is called. The thread doesn't survive a fork, so forked children
+    # have to call this again.
+    def start(interval: 10)
+      @thread = nil unless @thread && @thread.alive?
+      @thread ||= Thread.new do
+        loop do
+          sleep interval
+          tune
+        end
+      end
+
+      self
+    end
+
+    def stop
+      @thread.kill if @thread
+      @thread = nil
+      self
+    end
+  end
+end
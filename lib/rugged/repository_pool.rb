@@ -0,0 +1,188 @@
+# Copyright (C) the Rugged contributors.  All rights reserved.
+#
+# This file is part of Rugged, distributed under the MIT license.
+# For full terms see the included LICENSE file.
+
+module Rugged
+  # A thread-safe pool of Repository handles for the same path.
+  #
+  # A Repository must not be used by more than one thread at a time, but
+  # opening one per request throws away its config, pack indexes and object
+  # cache. The pool keeps up to +size+ handles open and lends each of them
+  # to one thread at a time; the most recently returned handle is handed
+  # out first, so the busiest handles stay warm while spare ones go idle
+  # and, after +idle_timeout+ seconds, are closed.
+  #
+  #   pool = Rugged::RepositoryPool.new("/srv/git/project.git", size: 8)
+  #   pool.with_repo { |repo| repo.head.target_id }
+  class RepositoryPool
+    # Raised when no handle becomes available within the checkout timeout.
+    class TimeoutError < Rugged::Error; end
+
+    attr_reader :path, :size, :idle_timeout
+
+    # Create a new pool. No repository is opened until the first checkout.
+    #
+    # path    - The path of the repository, as for Repository.new.
+    # options - A Hash of options:
+    #           :size             - The maximum number of open handles (default 5).
+    #           :idle_timeout     - Seconds after which an unused handle is closed
+    #                               (default nil, never).
+    #           :checkout_timeout - Seconds to wait for a free handle before
+    #                               raising TimeoutError (default nil, forever).
+    #           :max_open_files   - If given, caps the number of packfiles
+    #                               libgit2 keeps open. This limit is process-wide,
+    #                               so it bounds the file descriptors of all the
+    #                               handles together.
+    #           Any other option is passed on to Repository.new.
+    def initialize(path, size: 5, idle_timeout: nil, checkout_timeout: nil, max_open_files: nil, **repo_options)
+      raise ArgumentError, "size must be positive" unless size > 0
+
+      @path = path
+      @size = size
+      @idle_timeout = idle_timeout
+      @checkout_timeout = checkout_timeout
+      @repo_options = repo_options
+
+      Rugged::Settings['mwindow_file_limit'] = max_open_files if max_open_files
+
+      @mutex = Mutex.new
+      @available = ConditionVariable.new
+      @idle = []
+      @opened = 0
+      @shutdown = false
+    end
+
+    # Check a handle out, yield it, and return it to the pool afterwards,
+    # even if the block raises.
+    #
+    # Returns the result of the block.
+    def with_repo(timeout: @checkout_timeout)
+      repo = checkout(timeout: timeout)
+      begin
+        yield repo
+      ensure
+        checkin(repo)
+      end
+    end
+
+    # Take a handle out of the pool, opening a new one if none is idle and
+    # the pool isn't full. Every handle must be given back with #checkin.
+    #
+    # timeout - Seconds to wait for a handle to be returned when the pool
+    #           is exhausted, or nil to wait forever.
+    #
+    # Returns a Rugged::Repository.
+    def checkout(timeout: @checkout_timeout)
+      deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+
+      @mutex.synchronize do
+        loop do
+          raise Rugged::Error, "repository pool has been shut down" if @shutdown
+
+          if (entry = @idle.pop)
+            return entry[0]
+          end
+
+          if @opened < @size
+            @opened += 1
+            break
+          end
+
+          remaining = deadline && deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          if remaining && remaining <= 0
+            raise TimeoutError, "no repository handle available after #{timeout}s"
+          end
+
+          @available.wait(@mutex, remaining)
+        end
+      end
+
+      # Opening a repository reads its config and scans the ODB; don't hold
+      # up other threads while doing so.
+      begin
+        Rugged::Repository.new(@path, @repo_options)
+      rescue Exception
+        @mutex.synchronize do
+          @opened -= 1
+          @available.signal
+        end
+        raise
+      end
+    end
+
+    # Return a handle obtained from #checkout to the pool.
+    def checkin(repo)
+      stale = nil
+
+      @mutex.synchronize do
+        if @shutdown
+          stale = [repo]
+          @opened -= 1
+        else
+          @idle.push([repo, Process.clock_gettime(Process::CLOCK_MONOTONIC)])
+          stale = reap_idle
+          @available.signal
+        end
+      end
+
+      stale.each(&:close)
+      nil
+    end
+
+    # Close the handles that have been idle for longer than +idle_timeout+.
+    # This happens as a matter of course whenever a handle is returned, but
+    # can also be called periodically so that a quiet pool releases its
+    # files.
+    def reap
+      stale = @mutex.synchronize do
+        reap_idle.tap { |reaped| @available.broadcast unless reaped.empty? }
+      end
+
+      stale.each(&:close)
+      nil
+    end
+
+    # Close all idle handles and refuse further checkouts. Handles which are
+    # checked out at the time are closed as they are returned.
+    def shutdown
+      idle = @mutex.synchronize do
+        @shutdown = true
+        @opened -= @idle.size
+        @available.broadcast
+        @idle.slice!(0..-1)
+      end
+
+      idle.each { |repo, _| repo.close }
+      nil
+    end
+
+    # The number of open handles, idle or in use.
+    def opened
+      @mutex.synchronize { @opened }
+    end
+
+    # The number of open handles not currently checked out.
+    def available
+      @mutex.synchronize { @idle.size }
+    end
+
+    def inspect
+      "#<Rugged::RepositoryPool {path: #{@path.inspect}, size: #{@size}}>"
+    end
+
+    private
+
+    # Must be called with the mutex held. The idle list is ordered from
+    # least to most recently used, so stale handles are at the front.
+    def reap_idle
+      return [] unless @idle_timeout
+
+      cutoff = Process.clock_gettime(Process::CLOCK_MONOTONIC) - @idle_timeout
+      count = @idle.index { |_, returned_at| returned_at > cutoff } || @idle.size
+
+      @opened -= count
+      @idle.slice!(0, count).map(&:first)
+    end
+  end
+end
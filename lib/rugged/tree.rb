@@ -113,6 +113,23 @@ module Rugged
     #   marked with a single entry in the diff. If this flag is set to true,
     #   all files under ignored directories will be included in the diff, too.
     #
+    # :max_files ::
+    #   The most files to include in the diff. Any further changes are left
+    #   out and Diff#truncated? returns true.
+    #
+    # :deadline_ms ::
+    #   Stop adding files to the diff once this many milliseconds have
+    #   passed, and mark it as truncated.
+    #
+    #   Both limits bound the size of the diff, not the time it takes to
+    #   generate: libgit2 still walks the rest of the trees (or workdir) to
+    #   skip the remaining changes, since aborting would discard the diff.
+    #
+    # :max_lines ::
+    # :max_total_bytes ::
+    #   Limits on the patches generated from the diff, together with
+    #   +:max_files+ and +:deadline_ms+. See Diff#each_patch.
+    #
     # Examples:
     #
     #   # Emulating `git diff <treeish>`
@@ -0,0 +1,89 @@
+require "test_helper"
+
+# Upper bounds on the allocations made by hot paths. The object budgets are
+# the number of Ruby objects each element needs plus a small constant for
+# argument handling; the native budgets only exist to catch blowups, and
+# are checked in a child process when this one has no allocation headers.
+class AllocationBudgetTest < Rugged::TestCase
+  COMMITS = 1000
+  ENTRIES = 200
+
+  def setup
+    @repo = FixtureRepo.empty
+    @signature = { name: "Rugged", email: "rugged@example.com", time: Time.at(1_500_000_000) }
+
+    builder = Rugged::Tree::Builder.new(@repo)
+    ENTRIES.times do |i|
+      builder << { type: :blob, name: "file#{i}.txt", oid: @repo.write("#{i}\n", :blob), filemode: 0100644 }
+    end
+    @tree = builder.write
+
+    @head = COMMITS.times.inject(nil) do |parent, i|
+      Rugged::Commit.create(@repo,
+        tree: @tree, parents: [parent].compact, message: "#{i}\n",
+        author: @signature, committer: @signature)
+    end
+  end
+
+  def teardown
+    Rugged.oid_format = :hex
+  end
+
+  def test_walk_oid_only
+    return rerun_with_allocator unless allocation_headers?
+
+    assert_allocations(objects: COMMITS + 10, native_bytes: COMMITS * 8192) do
+      Rugged::Walker.walk(@repo, show: @head, oid_only: true) { |oid| }
+    end
+  end
+
+  def test_walk_oid_only_as_objects
+    Rugged.oid_format = :object
+
+    assert_allocations(objects: COMMITS + 10) do
+      Rugged::Walker.walk(@repo, show: @head, oid_only: true) { |oid| }
+    end
+  end
+
+  def test_walk_batches
+    walker = Rugged::Walker.new(@repo)
+
+    assert_allocations(objects: COMMITS + 20) do
+      walker.reset
+      walker.push(@head)
+      walker.each_batch(size: COMMITS) { |oids| }
+    end
+  end
+
+  def test_tree_each
+    return rerun_with_allocator unless allocation_headers?
+
+    tree = @repo.lookup(@tree)
+
+    # A Hash, a name and an OID String per entry
+    assert_allocations(objects: ENTRIES * 3 + 10, native_bytes: 4096) do
+      tree.each { |entry| }
+    end
+  end
+
+  def test_index_each
+    return rerun_with_allocator unless allocation_headers?
+
+    index = Rugged::Index.new
+    index.read_tree(@repo.lookup(@tree))
+
+    # A Hash, a path, an OID String and two Times per entry
+    assert_allocations(objects: ENTRIES * 5 + 10, native_bytes: 4096) do
+      index.each { |entry| }
+    end
+  end
+
+  def test_commit_lookup_and_author
+    return rerun_with_allocator unless allocation_headers?
+
+    # The Commit, then a Hash, name, email and Time for the signature
+    assert_allocations(objects: 10, native_bytes: 16384) do
+      @repo.lookup(@head).author
+    end
+  end
+end
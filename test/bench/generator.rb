@@ -0,0 +1,128 @@
+require 'digest'
+require 'fileutils'
+require 'rugged'
+
+module Rugged
+  module Bench
+    # Builds synthetic repositories for the benchmark suite.
+    #
+    # Every byte written is derived from a seeded Random and all signatures
+    # use fixed timestamps, so the same options always produce a repository
+    # with the same object IDs, on any machine.
+    class Generator
+      SCALES = {
+        "small"  => { commits: 200,  files: 200,   refs: 500,   large_blobs: 2, large_blob_size: 1 << 20, packs: 4 },
+        "medium" => { commits: 2000, files: 2000,  refs: 5000,  large_blobs: 4, large_blob_size: 4 << 20, packs: 8 },
+        "large"  => { commits: 8000, files: 10000, refs: 20000, large_blobs: 8, large_blob_size: 16 << 20, packs: 16 },
+      }
+
+      DEFAULTS = SCALES["small"].merge(depth: 6, changes: 8, line_count: 60, seed: 0x5eed)
+
+      EPOCH = 1_500_000_000
+
+      attr_reader :options, :path, :commits, :hot_path
+
+      def initialize(root, options = {})
+        @options = DEFAULTS.merge(options)
+        @path = File.join(root, "rugged-bench-#{Digest::SHA1.hexdigest(@options.sort.inspect)[0, 12]}")
+      end
+
+      # Returns the repository, generating it first unless a previous run
+      # with the same options already left it in place.
+      def repository
+        generate unless File.exist?(File.join(@path, ".git", "bench-complete"))
+
+        repo = Rugged::Repository.new(@path)
+        @commits ||= Rugged::Walker.walk(repo, show: repo.head.target_id, sort: Rugged::SORT_TOPO | Rugged::SORT_REVERSE).map(&:oid)
+        @hot_path ||= file_path(0)
+        repo
+      end
+
+      def generate
+        unless system("git", "--version", out: File::NULL, err: File::NULL)
+          raise "git is required to build the benchmark repositories' packfiles"
+        end
+
+        FileUtils.rm_rf(@path)
+        FileUtils.mkdir_p(@path)
+
+        @rng = Random.new(@options[:seed])
+        @commits = []
+        @hot_path = file_path(0)
+
+        repo = Rugged::Repository.init_at(@path)
+        index = Rugged::Index.new
+        pack_every = [@options[:commits] / [@options[:packs], 1].max, 1].max
+
+        @options[:files].times do |n|
+          add_file(repo, index, file_path(n), text_blob(n, 0))
+        end
+
+        @options[:commits].times do |i|
+          # Always touch the first file so Blame has a long history to chew on
+          touched = [0] + Array.new(@options[:changes] - 1) { @rng.rand(@options[:files]) }
+          touched.uniq.each do |n|
+            add_file(repo, index, file_path(n), text_blob(n, i + 1))
+          end
+
+          if i == @options[:commits] - 1
+            @options[:large_blobs].times do |n|
+              add_file(repo, index, "large/blob#{n}.bin", @rng.bytes(@options[:large_blob_size]))
+            end
+          end
+
+          commit(repo, index, i)
+          repack if (i + 1) % pack_every == 0
+        end
+
+        @options[:refs].times do |n|
+          target = @commits[@rng.rand(@commits.size)]
+          name = n.even? ? "refs/heads/bench/#{n}" : "refs/tags/bench/#{n}"
+          repo.references.create(name, target)
+        end
+
+        repo.checkout_head(strategy: :force)
+        File.write(File.join(@path, ".git", "bench-complete"), "")
+        repo
+      end
+
+      def file_path(n)
+        dirs = Array.new(@options[:depth]) { |level| "d#{(n >> (2 * level)) % 4}" }
+        File.join(*dirs, "file#{n}.txt")
+      end
+
+      private
+
+      def text_blob(n, revision)
+        lines = Array.new(@options[:line_count]) do |l|
+          "#{n}:#{l}:#{@rng.rand(1 << 30).to_s(36)}"
+        end
+        lines.join("\n") << "\nrevision #{revision}\n"
+      end
+
+      def add_file(repo, index, path, content)
+        oid = repo.write(content, :blob)
+        index.add(path: path, oid: oid, mode: 0100644)
+      end
+
+      def commit(repo, index, i)
+        signature = { name: "Bench", email: "bench@example.com", time: Time.at(EPOCH + i * 60).utc }
+
+        @commits << Rugged::Commit.create(repo,
+          tree: index.write_tree(repo),
+          parents: @commits.last ? [@commits.last] : [],
+          message: "Commit #{i}\n",
+          author: signature,
+          committer: signature,
+          update_ref: "HEAD")
+      end
+
+      # Rugged doesn't expose libgit2's packbuilder, so shell out to git.
+      # A repository left loose would measure something else entirely.
+      def repack
+        return if system("git", "-C", @path, "repack", "-d", "-q", out: File::NULL, err: File::NULL)
+        raise "git repack failed in #{@path}"
+      end
+    end
+  end
+end
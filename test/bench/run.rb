@@ -0,0 +1,148 @@
+#
+# Runs Rugged's benchmark suite against synthetic repositories and prints
+# the results as JSON, so that runs from different commits can be diffed.
+#
+# Environment:
+#
+#   BENCH_SCALE       small (default), medium or large
+#   BENCH_ITERATIONS  timed iterations per benchmark (default 5)
+#   BENCH_FILTER      only run benchmarks whose name matches this regexp
+#   BENCH_OUT         write the JSON report here instead of stdout
+#   BENCH_ROOT        where to keep generated repositories (default tmpdir)
+#
+require 'json'
+require 'tmpdir'
+require_relative 'generator'
+
+module Rugged
+  module Bench
+    class Runner
+      def initialize(generator, iterations:, filter: nil)
+        @generator = generator
+        @iterations = iterations
+        @filter = filter
+        @results = {}
+      end
+
+      def run
+        @repo = @generator.repository
+        @head = @repo.head.target
+        @base = @repo.lookup(@generator.commits[@generator.commits.size / 2])
+
+        bench("walker.walk") { Rugged::Walker.walk(@repo, show: @head.oid, sort: Rugged::SORT_TOPO).count }
+        bench("walker.each_oid") do
+          walker = Rugged::Walker.new(@repo)
+          walker.push(@head.oid)
+          walker.each_oid.count
+        end
+        bench("tree.walk") { count_walk(@head.tree) }
+        bench("diff.tree_to_tree") { @base.diff(@head).size }
+        bench("diff.many") { @repo.diff_many(@generator.commits.each_cons(2).to_a).sum { |r| r[:files] } }
+        bench("diff.patches") { @base.diff(@head).each_patch.sum(&:bytesize) }
+        bench("diff.workdir") { @head.diff_workdir.size }
+        bench("blame") { Rugged::Blame.new(@repo, @generator.hot_path).count }
+        bench("status") { count_status }
+        bench("index.add_all") do
+          index = @repo.index
+          index.add_all
+          index.count
+        end
+        bench("checkout") do
+          @repo.checkout_tree(@base, strategy: :force)
+          @repo.checkout_tree(@head, strategy: :force)
+        end
+        bench("references.each") { @repo.references.each.count }
+        bench("branches.each") { @repo.branches.each(:local).count }
+
+        report
+      end
+
+      private
+
+      def count_walk(tree)
+        count = 0
+        tree.walk(:preorder) { count += 1 }
+        count
+      end
+
+      def count_status
+        count = 0
+        @repo.status { count += 1 }
+        count
+      end
+
+      def bench(name)
+        return if @filter && name !~ @filter
+
+        yield # warm up caches and the filesystem
+
+        times = Array.new(@iterations) do
+          started = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+          yield
+          Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - started
+        end.sort
+
+        @results[name] = {
+          iterations: @iterations,
+          min_ms: times.first / 1e6,
+          median_ms: times[times.size / 2] / 1e6,
+          mean_ms: times.sum / times.size / 1e6,
+        }.merge(allocations { yield })
+      end
+
+      # Allocations are measured in a separate, untimed iteration since
+      # native allocation tracking adds overhead of its own. Native counts
+      # are only reported when allocations carry headers (RUGGED_ALLOCATOR).
+      def allocations
+        native = %w[accounting pool].include?(ENV['RUGGED_ALLOCATOR'])
+        Rugged.reset_allocation_stats
+        Rugged.allocation_tracking = true if native
+        objects = GC.stat(:total_allocated_objects)
+
+        yield
+
+        objects = GC.stat(:total_allocated_objects) - objects
+        Rugged.allocation_tracking = false
+        return { ruby_objects: objects } unless native
+
+        sites = Rugged.allocation_stats.values
+        {
+          ruby_objects: objects,
+          native_allocations: sites.sum { |site| site[:allocations] },
+          native_bytes: sites.sum { |site| site[:allocated_bytes] },
+        }
+      ensure
+        Rugged.allocation_tracking = false
+      end
+
+      def report
+        {
+          rugged: Rugged::Version,
+          libgit2: Rugged.libgit2_version.join("."),
+          ruby: RUBY_DESCRIPTION,
+          revision: `git rev-parse HEAD 2>#{File::NULL}`.strip,
+          repository: @generator.options,
+          benchmarks: @results,
+        }
+      end
+    end
+  end
+end
+
+if $0 == __FILE__
+  scale = ENV.fetch("BENCH_SCALE", "small")
+  options = Rugged::Bench::Generator::SCALES.fetch(scale) { abort "Unknown BENCH_SCALE #{scale}" }
+
+  generator = Rugged::Bench::Generator.new(ENV.fetch("BENCH_ROOT", Dir.tmpdir), options)
+  runner = Rugged::Bench::Runner.new(generator,
+    iterations: Integer(ENV.fetch("BENCH_ITERATIONS", "5")),
+    filter: ENV["BENCH_FILTER"] && Regexp.new(ENV["BENCH_FILTER"]))
+
+  json = JSON.pretty_generate(runner.run)
+
+  if ENV["BENCH_OUT"]
+    File.write(ENV["BENCH_OUT"], json + "\n")
+  else
+    puts json
+  end
+end
@@ -84,6 +84,44 @@ class BlobTest < Rugged::TestCase
     assert_equal blob.size, content.size
   end
 
+  def test_blob_content_as_buffer
+    skip "IO::Buffer is not available" unless defined?(IO::Buffer)
+
+    oid = "7771329dfa3002caf8c61a0ceb62a31d09023f37"
+    slice = @repo.lookup(oid).content(buffer: true).slice(2, 6)
+    GC.start
+
+    assert_equal "Rugged", slice.get_string
+
+    buffer = @repo.lookup(oid).content(buffer: true)
+    assert buffer.readonly?
+    assert_equal @repo.lookup(oid).content, buffer.get_string
+  end
+
+  def test_blob_content_with_size_as_buffer
+    skip "IO::Buffer is not available" unless defined?(IO::Buffer)
+
+    oid = "7771329dfa3002caf8c61a0ceb62a31d09023f37"
+    buffer = @repo.lookup(oid).content(10, buffer: true)
+    assert_equal "# Rugged\n*", buffer.get_string
+  end
+
+  def test_blob_content_as_buffer_needs_io_buffer
+    skip "IO::Buffer is available" if defined?(IO::Buffer)
+
+    blob = @repo.lookup("7771329dfa3002caf8c61a0ceb62a31d09023f37")
+    assert_raises(NotImplementedError) { blob.content(buffer: true) }
+  end
+
+  def test_blob_each_chunk
+    oid = "7771329dfa3002caf8c61a0ceb62a31d09023f37"
+    blob = @repo.lookup(oid)
+    chunks = blob.each_chunk(size: 100).to_a
+
+    assert chunks.all? { |chunk| chunk.bytesize <= 100 }
+    assert_equal blob.content, chunks.join
+  end
+
   def test_blob_text_with_max_lines
     oid = "7771329dfa3002caf8c61a0ceb62a31d09023f37"
     blob = @repo.lookup(oid)
@@ -428,6 +466,27 @@ class BlobCreateFromIOTest < Rugged::TestCase
     end
   end
 
+  def test_write_blob_from_io_pipe
+    content = "a" * 100_000
+    reader, writer = IO.pipe
+    thread = Thread.new { writer.write(content); writer.close }
+
+    oid = Rugged::Blob.from_io(@repo, reader)
+    thread.join
+    reader.close
+
+    assert_equal content, @repo.lookup(oid).content
+  end
+
+  def test_write_blob_from_io_with_buffered_data
+    file_path= File.join(TEST_DIR, (File.join('fixtures', 'archive.tar.gz')))
+    File.open(file_path, 'rb') do |io|
+      io.getc
+      oid = Rugged::Blob.from_io(@repo, io)
+      assert_equal File.binread(file_path)[1..-1], @repo.lookup(oid).content
+    end
+  end
+
   class BrokenIO
     def read(length)
       raise IOError
@@ -1,4 +1,5 @@
 require "test_helper"
+require "objspace"
 
 class PatchFromStringsTest < Rugged::TestCase
   def test_from_strings_no_args
@@ -104,6 +105,17 @@ class RepoDiffTest < Rugged::TestCase
     assert_equal((7 + 1), lines.select(&:deletion?).size)
   end
 
+  def test_memsize_reflects_native_size
+    repo = FixtureRepo.from_libgit2("attr")
+    empty = repo.diff("605812a", "605812a")
+    diff = repo.diff("605812a", "370fe9ec22")
+
+    assert_operator ObjectSpace.memsize_of(diff), :>, ObjectSpace.memsize_of(empty)
+    diff.patches.each do |patch|
+      assert_operator ObjectSpace.memsize_of(patch), :>=, patch.bytesize(exclude_file_headers: true)
+    end
+  end
+
   def test_delta_status_char
     repo = FixtureRepo.from_libgit2("attr")
     diff = repo.diff("605812a", "370fe9ec22", :context_lines => 1, :interhunk_lines => 1)
@@ -1037,6 +1049,95 @@ EOS
     assert_equal 2, patches.size
   end
 
+  def test_each_patch_with_threads
+    repo = FixtureRepo.empty
+    old_tree, new_tree = 2.times.map do |version|
+      builder = Rugged::Tree::Builder.new(repo)
+      100.times do |i|
+        content = (1..20).map { |line| line == i % 20 + 1 ? "changed #{version}\n" : "line #{line}\n" }.join
+        builder << { type: :blob, name: "file#{i}.txt", oid: repo.write(content, :blob), filemode: 0100644 }
+      end
+      repo.lookup(builder.write)
+    end
+
+    diff = old_tree.diff(new_tree)
+    expected = diff.patches.map(&:to_s)
+
+    assert_equal 100, expected.size
+    assert_equal expected, diff.patches(threads: 3).map(&:to_s)
+    assert_equal expected, diff.each_patch(threads: nil).map(&:to_s)
+
+    # Stopping early stops the workers and frees the patches they got ahead with
+    assert_equal expected.first(5), diff.each_patch(threads: 2).first(5).map(&:to_s)
+
+    diff.each_patch(threads: 2) do
+      assert_raises(RuntimeError) { diff.find_similar! }
+      break
+    end
+    assert_same diff, diff.find_similar!
+
+    assert_raises(ArgumentError) { diff.patches(threads: 0) }
+  end
+
+  def test_budgets
+    repo = FixtureRepo.empty
+    old_tree, new_tree = 2.times.map do |version|
+      builder = Rugged::Tree::Builder.new(repo)
+      10.times do |i|
+        builder << { type: :blob, name: "file#{i}.txt", oid: repo.write("file #{i}\nversion #{version}\n", :blob), filemode: 0100644 }
+      end
+      repo.lookup(builder.write)
+    end
+
+    diff = old_tree.diff(new_tree)
+    refute diff.truncated?
+    assert_equal 10, diff.patches(max_files: 10).size
+    refute diff.truncated?
+
+    patches = diff.patches(max_files: 4)
+    assert_equal 4, patches.size
+    assert diff.truncated?
+    assert_equal [false] * 4 + [true] * 6, diff.deltas.map(&:truncated?)
+
+    # A budget given to one iteration doesn't outlive it
+    assert_equal 10, diff.patches.size
+    refute diff.truncated?
+    assert_equal [false] * 10, diff.deltas.map(&:truncated?)
+
+    diff = old_tree.diff(new_tree, max_files: 3)
+    assert diff.truncated?
+    assert_equal 3, diff.size
+    assert_equal 3, diff.patches.size
+    assert diff.truncated?
+
+    diff = old_tree.diff(new_tree)
+    assert_equal 2, diff.patches(max_lines: 7).size
+    assert_equal [], diff.patches(max_total_bytes: 0)
+    assert_equal [], diff.patches(deadline_ms: 0, threads: 2)
+    assert diff.truncated?
+  end
+
+  def test_byte_budget_skips_oversized_files_up_front
+    repo = FixtureRepo.empty
+    huge = "generated line\n" * 100_000
+
+    old_tree, new_tree = [["a\n", ""], ["b\n", huge]].map do |small, large|
+      builder = Rugged::Tree::Builder.new(repo)
+      builder << { type: :blob, name: "a.txt", oid: repo.write(small, :blob), filemode: 0100644 }
+      builder << { type: :blob, name: "z.txt", oid: repo.write(large, :blob), filemode: 0100644 }
+      repo.lookup(builder.write)
+    end
+
+    [nil, 2].each do |threads|
+      diff = old_tree.diff(new_tree)
+      options = { max_total_bytes: 64 * 1024 }
+      options[:threads] = threads if threads
+
+      assert_equal ["a.txt"], diff.patches(**options).map { |p| p.delta.new_file[:path] }
+      assert_equal [false, true], diff.deltas.map(&:truncated?)
+    end
+  end
+
   def test_each_hunk_returns_enumerator
     repo = FixtureRepo.from_libgit2("diff")
 
@@ -1190,6 +1291,15 @@ EOS
 
       assert_equal expected_lines, patch.lines(exclude_eofnl: true)
     end
+
+    paths, adds, dels, binary = diff.numstat
+    assert_equal diff.deltas.map { |delta| delta.new_file[:path] }, paths
+    assert_equal [5, 2], adds
+    assert_equal [5, 9], dels
+    assert_equal [false, false], binary
+
+    # The diff is only busy while the counts are being computed
+    assert_same diff, diff.find_similar!
   end
 end
 
@@ -28,6 +28,30 @@ class RuggedTest < Rugged::TestCase
     assert_raises(TypeError) { Rugged::Settings['mwindow_size'] = nil }
   end
 
+  def test_pool_allocator
+    return rerun_with_allocator unless allocation_headers?
+
+    Rugged::Settings['allocator'] = :pool
+    assert_equal :pool, Rugged::Settings['allocator']
+
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    walker = Rugged::Walker.new(repo)
+    walker.push(repo.head.target_id)
+    assert_operator walker.count, :>, 0
+    assert_operator Rugged::Settings['allocator_pool_size'], :>, 0
+
+    # Blocks allocated from the pool must survive a switch back
+    Rugged::Settings['allocator'] = :ruby
+    walker.reset
+    repo.close
+  ensure
+    Rugged::Settings['allocator'] = :ruby
+  end
+
+  def test_invalid_allocator
+    assert_raises(ArgumentError) { Rugged::Settings['allocator'] = :jemalloc }
+  end
+
   def test_fsync_gitdir
     # We can only really test whether this does _something_. libgit2 doesn't
     # provide any way to query the state of this configuration, and we have no
@@ -184,4 +208,212 @@ MESSAGE
 
     assert_equal clean_message, Rugged::prettify_message(message, true)
   end
+
+  def test_allocation_stats
+    return rerun_with_allocator unless allocation_headers?
+
+    Rugged.reset_allocation_stats
+    Rugged.allocation_tracking = true
+    assert Rugged.allocation_tracking?
+
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    repo.lookup("a65fedf39aefe402d3bb6e24df4d4f5fe4547750").tree
+
+    stats = Rugged.allocation_stats
+    refute_empty stats
+    stats.each_value do |site|
+      assert_operator site[:allocations], :>, 0
+      assert_operator site[:peak_bytes], :>=, site[:live_bytes]
+    end
+
+    Rugged.reset_allocation_stats
+    assert Rugged.allocation_stats.each_value.all? { |site| site[:allocations] == 0 }
+  ensure
+    Rugged.allocation_tracking = false
+  end
+
+  def test_allocation_tracking_needs_headers
+    skip "running with allocation headers" if allocation_headers?
+
+    assert_raises(NotImplementedError) { Rugged.allocation_tracking = true }
+    assert_raises(NotImplementedError) { Rugged::Settings['allocator'] = :pool }
+    refute Rugged.allocation_tracking?
+  end
+
+  def test_subscribe
+    events = []
+    subscriber = Rugged.subscribe { |event, duration, payload| events << [event, duration, payload] }
+
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    repo.read("a65fedf39aefe402d3bb6e24df4d4f5fe4547750")
+    assert_raises(Rugged::Error) { repo.read("a" * 40) }
+    repo.diff("a65fedf39aefe402d3bb6e24df4d4f5fe4547750", "be3563ae3f795b2b4353bcce3a527ad0a4f7f644")
+
+    found, missing, diff = events
+    assert_equal "odb.read", found[0]
+    assert_kind_of Integer, found[1]
+    assert_equal true, found[2][:found]
+    assert_equal :commit, found[2][:type]
+
+    assert_equal "odb.read", missing[0]
+    assert_equal false, missing[2][:found]
+
+    assert_equal "diff.tree_to_tree", diff[0]
+    assert_operator diff[2][:deltas], :>, 0
+
+    Rugged.unsubscribe(subscriber)
+    events.clear
+    repo.read("a65fedf39aefe402d3bb6e24df4d4f5fe4547750")
+    assert_empty events
+  ensure
+    Rugged.unsubscribe(subscriber)
+  end
+
+  def test_odb_read_reports_cache_hits
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    commit_id = "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+    blob_id = repo.write("streamed\n" * 100, :blob)
+
+    events = []
+    subscriber = Rugged.subscribe { |event, _, payload| events << payload if event == "odb.read" }
+
+    repo.lookup(commit_id)
+    repo.lookup(commit_id)
+    Rugged::Commit.lookup(repo, commit_id[0, 7])
+    repo.read_many([commit_id, "a" * 40])
+    repo.read_stream(blob_id) { |chunk| }
+    repo.lookup(blob_id)
+
+    skip "the object cache can only be probed with the vendored libgit2" if events.first[:cached].nil?
+
+    first, second, prefix, many_found, many_missing, stream, blob = events
+    assert_equal [commit_id, true, false, :commit], first.values_at(:oid, :found, :cached, :type)
+    assert_equal true, second[:cached]
+
+    # Prefixes always have to be resolved from the ODB
+    assert_equal [commit_id, false], prefix.values_at(:oid, :cached)
+
+    # Parsed objects can't serve raw reads
+    assert_equal [commit_id, true, false], many_found.values_at(:oid, :found, :cached)
+    assert_equal ["a" * 40, false], many_missing.values_at(:oid, :found)
+
+    assert_equal [blob_id, :blob], stream.values_at(:oid, :type)
+    assert_equal stream[:bytes], blob[:bytes]
+  ensure
+    Rugged.unsubscribe(subscriber)
+  end
+
+  def test_after_fork
+    skip "fork is not supported" unless Process.respond_to?(:fork)
+
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    repo.prefetch(depth: 100).wait
+    prefetch = repo.prefetch(depth: 100)
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      Rugged.after_fork!
+      writer.write([prefetch.done?, repo.head.target_id].inspect)
+      writer.close
+      exit!(0)
+    end
+
+    writer.close
+    Process.wait(pid)
+
+    assert_equal [true, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"].inspect, reader.read
+    prefetch.wait
+  ensure
+    reader.close if reader
+  end
+
+  def test_fork_while_prefetching
+    skip "fork is not supported" unless Process.respond_to?(:fork)
+
+    repo = FixtureRepo.from_libgit2("testrepo.git")
+    head = repo.head.target_id
+
+    20.times do
+      prefetches = Array.new(4) { repo.prefetch(depth: 1000, trees: true) }
+
+      # The automatic hook closes the repository in the child; neither that
+      # nor reading from it may find a lock held by a prefetch thread.
+      pid = fork { exit!(repo.head.target_id == head && repo.exists?(head) ? 0 : 1) }
+
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 30
+      until Process.wait(pid, Process::WNOHANG)
+        if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+          Process.kill(:KILL, pid)
+          Process.wait(pid)
+          flunk "forked child deadlocked"
+        end
+        sleep 0.01
+      end
+
+      assert $?.success?
+      prefetches.each(&:wait)
+    end
+  end
+
+  # Repository.hash_files does part of its work on the calling thread, whose
+  # allocations may have to take the GVL back to run the GC. fork() drains
+  # the gate while holding the GVL, so that thread must not be behind it.
+  # A deadlock would hang fork() itself, hence the child process.
+  def test_fork_while_hashing_files
+    skip "fork is not supported" unless Process.respond_to?(:fork)
+
+    Dir.mktmpdir("rugged-hash") do |dir|
+      paths = Array.new(32) do |i|
+        File.join(dir, "file#{i}").tap { |path| File.write(path, "line #{i}\n" * 1000) }
+      end
+
+      script = <<-RUBY
+        require "rugged"
+        GC.stress = true
+        Thread.new { loop { Rugged::Repository.hash_files(ARGV, threads: 4) } }
+        10.times { Process.wait(fork { exit!(0) }) }
+        exit!(0)
+      RUBY
+
+      pid = Process.spawn(RbConfig.ruby, "-I", File.expand_path("../../lib", __FILE__),
+        "-e", script, *paths, out: File::NULL, err: File::NULL)
+
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 120
+      until Process.wait(pid, Process::WNOHANG)
+        if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+          Process.kill(:KILL, pid)
+          Process.wait(pid)
+          flunk "fork deadlocked while hashing files"
+        end
+        sleep 0.05
+      end
+
+      assert $?.success?
+    end
+  end
+
+  # The pool allocator locks its depot around fork, which must not happen
+  # before the prefetch threads have been drained. It can only be enabled
+  # at startup, so this reruns the test above in a child process.
+  def test_fork_while_prefetching_with_pool_allocator
+    skip "fork is not supported" unless Process.respond_to?(:fork)
+    skip "already running with the pool allocator" if ENV['RUGGED_ALLOCATOR'] == 'pool'
+
+    pid = Process.spawn({ "RUGGED_ALLOCATOR" => "pool" },
+      RbConfig.ruby, "-I", File.expand_path("../../lib", __FILE__), "-I", __dir__,
+      __FILE__, "-n", "test_fork_while_prefetching", out: File::NULL, err: File::NULL)
+
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 120
+    until Process.wait(pid, Process::WNOHANG)
+      if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+        Process.kill(:KILL, pid)
+        Process.wait(pid)
+        flunk "fork deadlocked with the pool allocator"
+      end
+      sleep 0.05
+    end
+
+    assert $?.success?
+  end
 end
@@ -0,0 +1,77 @@
+require "test_helper"
+
+class OidTest < Rugged::TestCase
+  HEX = "8496071c1b46c854b31185ea97743be6a8774479"
+
+  def setup
+    @repo = FixtureRepo.from_rugged("testrepo.git")
+  end
+
+  def teardown
+    Rugged.oid_format = :hex
+  end
+
+  def test_create_from_hex_and_raw
+    oid = Rugged::Oid.new(HEX)
+    assert oid.frozen?
+    assert_equal HEX, oid.to_s
+    assert_equal Rugged.hex_to_raw(HEX), oid.raw
+    assert_equal oid, Rugged::Oid.from_raw(oid.raw)
+  end
+
+  def test_invalid_hex
+    assert_raises(Rugged::InvalidError) { Rugged::Oid.new("z" * 40) }
+    assert_raises(TypeError) { Rugged::Oid.from_raw("short") }
+  end
+
+  def test_equality_and_hashing
+    a = Rugged::Oid.new(HEX)
+    b = Rugged::Oid.new(HEX)
+
+    assert a.eql?(b)
+    assert_equal a.hash, b.hash
+    assert_equal 1, { a => true, b => true }.size
+
+    assert a == HEX
+    assert HEX == a
+    refute a.eql?(HEX)
+    assert_equal 0, a <=> HEX
+  end
+
+  def test_accepted_as_input
+    oid = Rugged::Oid.new(HEX)
+
+    assert_equal HEX, @repo.lookup(oid).oid
+    assert_equal :commit, @repo.read(oid).type
+    assert @repo.exists?(oid)
+    assert_equal({ oid => HEX }, @repo.expand_oids([oid]))
+    assert_equal Rugged.hex_to_raw(HEX), Rugged.hex_to_raw(oid)
+
+    copy = oid.dup
+    assert copy.frozen?
+    assert_equal oid, copy
+
+    walker = Rugged::Walker.new(@repo)
+    walker.push(oid)
+    assert_equal 1, walker.count
+  end
+
+  def test_object_format
+    assert_equal :hex, Rugged.oid_format
+    assert_kind_of String, @repo.head.target_id
+
+    Rugged.oid_format = :object
+    assert_equal :object, Rugged.oid_format
+
+    commit = @repo.lookup(HEX)
+    assert_kind_of Rugged::Oid, commit.oid
+    assert_equal HEX, commit.oid
+
+    commit.tree.each { |entry| assert_kind_of Rugged::Oid, entry[:oid] }
+    assert Rugged::Walker.walk(@repo, show: HEX).all? { |c| c.oid.is_a?(Rugged::Oid) }
+  end
+
+  def test_invalid_format
+    assert_raises(ArgumentError) { Rugged.oid_format = :binary }
+  end
+end
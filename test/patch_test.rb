@@ -93,4 +93,36 @@ index 7b808f7..29ab705 100644
 +++ b/readme.txt
     DIFF
   end
+
+  def test_to_columns
+    repo = FixtureRepo.from_libgit2("diff")
+
+    a = repo.lookup("d70d245ed97ed2aa596dd1af6536e4bfdb047b69")
+    b = repo.lookup("7a9e0b02e63179929fed24f0a3e0f19168114d10")
+
+    diff = a.tree.diff(b.tree, :context_lines => 0)
+    patch = diff.patches[0]
+
+    expected = patch.each_hunk.flat_map do |hunk|
+      [["H", hunk.old_start, hunk.new_start, hunk.header]] +
+        hunk.each_line.map { |line| [line.line_origin, line.old_lineno, line.new_lineno, line.content] }
+    end
+    origins = { context: " ", addition: "+", deletion: "-" }
+    expected.each { |row| row[0] = origins.fetch(row[0], row[0]) }
+
+    columns = patch.to_columns
+    offsets = columns[:offsets].unpack("L*")
+    actual = columns[:origins].each_char.each_with_index.map do |origin, i|
+      [origin, columns[:old_lines].unpack("l*")[i], columns[:new_lines].unpack("l*")[i],
+        columns[:content].byteslice(offsets[i]...offsets[i + 1])]
+    end
+
+    assert_equal expected, actual
+    assert_equal offsets.size, actual.size + 1
+
+    all = diff.to_columns
+    files = all[:files].unpack("L*")
+    assert_equal [0, actual.size, all[:origins].size], files
+    assert_equal columns[:origins] + diff.patches[1].to_columns[:origins], all[:origins]
+  end
 end
@@ -35,6 +35,76 @@ class RepositoryTest < Rugged::TestCase
     assert_equal :commit, rawobj.type
   end
 
+  def test_can_read_a_raw_object_as_buffer
+    skip "IO::Buffer is not available" unless defined?(IO::Buffer)
+
+    data = @repo.read("8496071c1b46c854b31185ea97743be6a8774479").data(buffer: true)
+    GC.start
+
+    assert data.readonly?
+    assert_match 'tree 181037049a54a1eb5fab404658a3a250b44335d7', data.get_string
+    assert_equal 172, data.size
+  end
+
+  def test_can_stream_a_raw_object
+    oid = "8496071c1b46c854b31185ea97743be6a8774479"
+    chunks = []
+    @repo.read_stream(oid, size: 50) { |chunk| chunks << chunk }
+
+    assert_equal [50, 50, 50, 22], chunks.map(&:bytesize)
+    assert_equal @repo.read(oid).data, chunks.join
+  end
+
+  def test_can_stream_packed_objects
+    @repo.each_id.first(300).each do |oid|
+      assert_equal @repo.read(oid).data.b, @repo.read_stream(oid, size: 7).to_a.join.b
+    end
+  end
+
+  def test_can_stream_objects_from_alternates
+    source = FixtureRepo.from_libgit2("testrepo.git")
+    repo = Rugged::Repository.new(FixtureRepo.empty.path, alternates: [File.join(source.path, "objects")])
+
+    source.each_id.first(100).each do |oid|
+      assert_equal source.read(oid).data.b, repo.read_stream(oid, size: 7).to_a.join.b
+    end
+  end
+
+  def test_stream_fails_on_missing_objects
+    assert_raises Rugged::OdbError do
+      @repo.read_stream("a496071c1b46c854b31185ea97743be6a8774471") { |chunk| }
+    end
+  end
+
+  def test_can_read_many_raw_objects
+    objects = @repo.read_many([
+      "8496071c1b46c854b31185ea97743be6a8774479",
+      "a496071c1b46c854b31185ea97743be6a8774471",
+      "1385f264afb75a56a5bec74243be9b367ba4ca08"
+    ])
+
+    assert_equal 3, objects.length
+    assert_equal :commit, objects[0].type
+    assert_equal 172, objects[0].len
+    assert_nil objects[1]
+    assert_equal :blob, objects[2].type
+  end
+
+  def test_can_read_many_raw_objects_filtered_by_type
+    oids = ["8496071c1b46c854b31185ea97743be6a8774479", "1385f264afb75a56a5bec74243be9b367ba4ca08"]
+
+    objects = @repo.read_many(oids, types: :blob)
+    assert_nil objects[0]
+    assert_equal "1385f264afb75a56a5bec74243be9b367ba4ca08", objects[1].oid
+
+    objects = @repo.read_many(oids, types: [:commit, :blob])
+    assert_equal [:commit, :blob], objects.map(&:type)
+
+    assert_raises ArgumentError do
+      @repo.read_many(oids, types: [:commit])
+    end
+  end
+
   def test_can_read_object_headers
     hash = @repo.read_header("8496071c1b46c854b31185ea97743be6a8774479")
     assert_equal 172, hash[:len]
@@ -53,6 +123,72 @@ class RepositoryTest < Rugged::TestCase
     end
   end
 
+  def test_prefetch
+    prefetch = @repo.prefetch(refs: ["refs/heads/master", "refs/heads/missing"], depth: 3, trees: true)
+    assert_equal({ commits: 3, trees: 3, missing: 0 }, prefetch.wait)
+    assert prefetch.done?
+
+    assert_equal "a65fedf39aefe402d3bb6e24df4d4f5fe4547750", @repo.head.target_id
+    assert_raises(ArgumentError) { @repo.prefetch(depth: -1) }
+    assert_raises(ArgumentError) { @repo.prefetch(depth: 2**40) }
+  end
+
+  def test_close_stops_prefetches
+    prefetch = @repo.prefetch(depth: 1000, trees: true)
+    @repo.close
+
+    assert prefetch.done?
+    assert_equal "a65fedf39aefe402d3bb6e24df4d4f5fe4547750", @repo.head.target_id
+  end
+
+  def test_prefetch_outliving_its_objects
+    10.times do
+      Rugged::Repository.new(@repo.path).prefetch(depth: 1000, trees: true)
+      GC.start
+    end
+  end
+
+  def test_prefetch_running_at_exit
+    skip "fork is not supported" unless Process.respond_to?(:fork)
+
+    pid = fork do
+      @repo.prefetch(depth: 1000, trees: true)
+      exit
+    end
+
+    Process.wait(pid)
+    assert $?.success?
+  end
+
+  def test_diff_many
+    commits = Rugged::Walker.walk(@repo, show: @repo.head.target_id).to_a
+    pairs = commits.map { |commit| [commit.parent_ids.first, commit] }
+
+    results = @repo.diff_many(pairs, stats: true, threads: 3)
+    assert_equal commits.size, results.size
+
+    commits.zip(results) do |commit, result|
+      diff = commit.parents.empty? ? commit.tree.diff(nil, reverse: true) : commit.parents.first.tree.diff(commit.tree)
+      files, additions, deletions = diff.stat
+
+      assert_equal files, result[:files]
+      assert_equal additions, result[:additions]
+      assert_equal deletions, result[:deletions]
+      assert_equal diff.deltas.map { |d| [d.status, d.new_file[:path]] },
+        result[:deltas].map { |d| [d.status, d.new_file[:path]] }
+      result[:deltas].each { |d| assert_kind_of Rugged::Diff, d.diff }
+    end
+
+    result = @repo.diff_many([[nil, "HEAD"]], paths: ["README"]).first
+    assert_equal ["README"], result[:deltas].map { |d| d.new_file[:path] }
+    refute result.key?(:additions)
+
+    assert_equal [], @repo.diff_many([])
+    assert_raises(ArgumentError) { @repo.diff_many([["HEAD"]]) }
+    assert_raises(ArgumentError) { @repo.diff_many(pairs, max_files: 1) }
+    assert_raises(ArgumentError) { @repo.diff_many(pairs, deadline_ms: 100) }
+  end
+
   def test_walking_with_block
     oid = "a4a7dce85cf63874e984719f4fdd239f5145052f"
     list = []
@@ -144,6 +280,38 @@ class RepositoryTest < Rugged::TestCase
     assert_equal 1700, @repo.each_id.count
   end
 
+  def test_enumerate_all_objects_while_another_thread_is_busy
+    # The spinning thread keeps thread-switch interrupts pending
+    done = false
+    spinner = Thread.new { nil until done }
+
+    20.times { assert_equal 1700, @repo.each_id(batch: 100).sum(&:size) }
+  ensure
+    done = true
+    spinner.join if spinner
+  end
+
+  def test_enumerate_objects_by_type
+    commits = @repo.each_id.select { |id| @repo.read_header(id)[:type] == :commit }
+    assert_equal commits.sort, @repo.each_id(type: :commit).to_a.sort
+  end
+
+  def test_enumerate_binary_ids_in_batches
+    batches = @repo.each_id(format: :binary, batch: 500).to_a
+
+    assert_equal [500, 500, 500, 200], batches.map { |b| b.bytesize / 20 }
+    assert_equal Encoding::BINARY, batches[0].encoding
+
+    ids = batches.join.unpack("H40" * 1700)
+    assert_equal @repo.each_id.to_a.sort, ids.sort
+  end
+
+  def test_enumerate_hex_ids_in_batches
+    batches = @repo.each_id(type: :blob, batch: 100).to_a
+    assert batches.all? { |b| b.is_a?(Array) && b.size <= 100 }
+    assert batches.flatten.all? { |id| @repo.read_header(id)[:type] == :blob }
+  end
+
   def test_loading_alternates
     alt_path = File.dirname(__FILE__) + '/fixtures/alternate/objects'
     repo = Rugged::Repository.new(@repo.path, :alternates => [alt_path])
@@ -243,6 +411,25 @@ class RepositoryTest < Rugged::TestCase
     assert_equal 2, behind
   end
 
+  def test_write_commit_graph
+    @repo.write_commit_graph
+    assert File.exist?(File.join(@repo.path, "objects", "info", "commit-graph"))
+
+    ahead, behind = @repo.ahead_behind(
+      'a4a7dce85cf63874e984719f4fdd239f5145052f',
+      'a65fedf39aefe402d3bb6e24df4d4f5fe4547750'
+    )
+    assert_equal 1, ahead
+    assert_equal 2, behind
+
+    assert @repo.descendant_of?("a65fedf39aefe402d3bb6e24df4d4f5fe4547750", "be3563ae3f795b2b4353bcce3a527ad0a4f7f644")
+  end
+
+  def test_write_commit_graph_for_selected_refs
+    @repo.write_commit_graph(refs: ["refs/heads/master"])
+    assert File.exist?(File.join(@repo.path, "objects", "info", "commit-graph"))
+  end
+
   def test_expand_objects
     expected = {
       'a4a7dce8' => 'a4a7dce85cf63874e984719f4fdd239f5145052f',
@@ -364,6 +551,75 @@ class RepositoryWriteTest < Rugged::TestCase
     assert @repo.exists?("76b1b55ab653581d6f2c7230d34098e837197674")
   end
 
+  def test_write_stream_to_odb
+    oid = @repo.write_stream(TEST_CONTENT_TYPE, TEST_CONTENT.bytesize) do |writer|
+      TEST_CONTENT.each_char { |c| writer << c }
+    end
+
+    assert_equal "76b1b55ab653581d6f2c7230d34098e837197674", oid
+    assert_equal TEST_CONTENT, @repo.read(oid).data
+  end
+
+  def test_write_stream_with_wrong_size
+    assert_raises Rugged::OdbError do
+      @repo.write_stream(TEST_CONTENT_TYPE, TEST_CONTENT.bytesize + 1) do |writer|
+        writer.write(TEST_CONTENT)
+      end
+    end
+  end
+
+  def test_write_stream_writer_is_closed_after_block
+    leaked = nil
+    @repo.write_stream(TEST_CONTENT_TYPE, TEST_CONTENT.bytesize) do |writer|
+      writer << TEST_CONTENT
+      leaked = writer
+    end
+
+    assert_raises(IOError) { leaked << "more" }
+  end
+
+  def test_hash_files
+    paths = Dir[File.join(@repo.workdir || @repo.path, "**", "*")].select { |f| File.file?(f) }.sort
+    expected = paths.map { |path| Rugged::Repository.hash_file(path, :blob) }
+
+    assert_equal expected, Rugged::Repository.hash_files(paths, threads: 4)
+    assert_equal expected, Rugged::Repository.hash_files(paths, threads: 1)
+    assert_equal [], Rugged::Repository.hash_files([])
+  end
+
+  def test_hash_files_while_another_thread_is_busy
+    paths = Dir[File.join(@repo.workdir || @repo.path, "**", "*")].select { |f| File.file?(f) }.sort
+    expected = paths.map { |path| Rugged::Repository.hash_file(path, :blob) }
+
+    # The spinning thread keeps thread-switch interrupts pending
+    done = false
+    spinner = Thread.new { nil until done }
+
+    50.times do
+      assert_equal expected, Rugged::Repository.hash_files(paths, threads: 2)
+    end
+  ensure
+    done = true
+    spinner.join if spinner
+  end
+
+  def test_hash_files_with_missing_file
+    assert_raises Rugged::OSError do
+      Rugged::Repository.hash_files([File.join(@repo.path, "does-not-exist")])
+    end
+  end
+
+  def test_hash_files_and_write
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "test.txt")
+      File.binwrite(path, TEST_CONTENT)
+
+      oids = @repo.hash_files([path], type: TEST_CONTENT_TYPE, write: true)
+      assert_equal ["76b1b55ab653581d6f2c7230d34098e837197674"], oids
+      assert_equal TEST_CONTENT, @repo.read(oids[0]).data
+    end
+  end
+
   def test_no_merge_base_between_unrelated_branches
     info = @repo.rev_parse('HEAD').to_hash
     baseless = Rugged::Commit.create(@repo, info.merge(:parents => []))
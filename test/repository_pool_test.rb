@@ -0,0 +1,69 @@
+require "test_helper"
+
+class RepositoryPoolTest < Rugged::TestCase
+  def setup
+    @path = FixtureRepo.from_libgit2("testrepo.git").path
+  end
+
+  def test_reuses_handles
+    pool = Rugged::RepositoryPool.new(@path, size: 2)
+
+    first = pool.with_repo { |repo| repo }
+    second = pool.with_repo { |repo| repo }
+
+    assert_same first, second
+    assert_equal 1, pool.opened
+    assert_equal 1, pool.available
+  end
+
+  def test_bounded_size_and_timeout
+    pool = Rugged::RepositoryPool.new(@path, size: 1)
+    repo = pool.checkout
+
+    assert_raises(Rugged::RepositoryPool::TimeoutError) { pool.checkout(timeout: 0.01) }
+
+    waiter = Thread.new { pool.with_repo { |r| r } }
+    pool.checkin(repo)
+    assert_same repo, waiter.value
+    assert_equal 1, pool.opened
+  end
+
+  def test_concurrent_use
+    pool = Rugged::RepositoryPool.new(@path, size: 3)
+
+    threads = 8.times.map do
+      Thread.new do
+        20.times.map { pool.with_repo { |repo| repo.head.target_id } }.uniq
+      end
+    end
+
+    assert_equal [["a65fedf39aefe402d3bb6e24df4d4f5fe4547750"]], threads.map(&:value).uniq
+    assert_operator pool.opened, :<=, 3
+  end
+
+  def test_idle_handles_are_closed
+    pool = Rugged::RepositoryPool.new(@path, size: 2, idle_timeout: 0)
+
+    first = pool.with_repo { |repo| repo }
+    pool.reap
+
+    assert_equal 0, pool.opened
+    refute_same first, pool.with_repo { |repo| repo }
+  end
+
+  def test_shutdown
+    pool = Rugged::RepositoryPool.new(@path)
+    pool.with_repo { |repo| repo.head }
+    pool.shutdown
+
+    assert_equal 0, pool.opened
+    assert_raises(Rugged::Error) { pool.checkout }
+  end
+
+  def test_max_open_files
+    Rugged::RepositoryPool.new(@path, max_open_files: 64)
+    assert_equal 64, Rugged::Settings['mwindow_file_limit']
+  ensure
+    Rugged::Settings['mwindow_file_limit'] = 0
+  end
+end
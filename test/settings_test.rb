@@ -1,4 +1,5 @@
 require "test_helper"
+require "minitest/mock"
 
 class SettingsTest < Rugged::TestCase
   def scrub_stack size
@@ -26,4 +27,94 @@ class SettingsTest < Rugged::TestCase
     # default size without breaking these tests).
     assert Rugged::Settings.max_cache_size
   end
+
+  def test_pack_stats
+    stats = Rugged::Settings.pack_stats
+    assert_equal Rugged::Settings['mwindow_size'], stats[:window_size]
+    assert_equal Rugged::Settings['mwindow_mapped_limit'], stats[:mapped_limit]
+    assert_equal Rugged::Settings['mwindow_file_limit'], stats[:file_limit]
+
+    skip "pack counters need the bundled libgit2" unless stats.key?(:window_misses)
+
+    repo = FixtureRepo.from_rugged("testrepo.git")
+    repo.read("41bc8c69075bbdb46c5c6f0566cc8cc5b46e8bd9")
+
+    assert_operator Rugged::Settings.pack_stats[:window_misses], :>, stats[:window_misses]
+  end
+
+  def test_pack_tuner_enforces_ceilings
+    skip "pack counters need the bundled libgit2" unless Rugged::Settings.pack_stats.key?(:window_misses)
+
+    mapped_limit = Rugged::Settings['mwindow_mapped_limit']
+    tuner = Rugged::PackTuner.new(memory_limit: mapped_limit / 2, max_open_files: 32)
+
+    assert_equal({ 'mwindow_mapped_limit' => mapped_limit / 2, 'mwindow_file_limit' => 32 }, tuner.tune)
+    assert_equal({}, tuner.tune)
+  ensure
+    Rugged::Settings['mwindow_mapped_limit'] = mapped_limit if mapped_limit
+    Rugged::Settings['mwindow_file_limit'] = 0
+  end
+
+  # Runs the block with Settings.pack_stats reporting +stats+, and with
+  # the settings PackTuner changes written back into it.
+  def with_synthetic_pack_stats(stats)
+    keys = { 'mwindow_size' => :window_size, 'mwindow_mapped_limit' => :mapped_limit, 'mwindow_file_limit' => :file_limit }
+
+    Rugged::Settings.stub(:pack_stats, -> { stats.dup }) do
+      Rugged::Settings.stub(:[]=, ->(option, value) { stats[keys.fetch(option)] = value }) do
+        yield
+      end
+    end
+  end
+
+  def test_pack_tuner_grows_settings_in_order
+    mb = 1024 * 1024
+    stats = { window_size: mb, mapped_limit: 32 * mb, file_limit: 8, open_files: 8, window_hits: 0, window_misses: 0 }
+
+    with_synthetic_pack_stats(stats) do
+      tuner = Rugged::PackTuner.new(memory_limit: 256 * mb, max_open_files: 64)
+
+      tune = lambda do |hits, misses|
+        stats[:window_hits] += hits
+        stats[:window_misses] += misses
+        tuner.tune
+      end
+
+      # Too few lookups, or enough of them hitting, change nothing
+      assert_equal({}, tune.(10, 10))
+      assert_equal({}, tune.(990, 10))
+
+      # While every allowed pack file is open, the file limit grows first
+      [16, 32, 64].each do |limit|
+        assert_equal({ 'mwindow_file_limit' => limit }, tune.(50, 50))
+        stats[:open_files] = limit
+      end
+
+      # Then the mapped limit, up to the memory ceiling
+      [64, 128, 256].each do |limit|
+        assert_equal({ 'mwindow_mapped_limit' => limit * mb }, tune.(50, 50))
+      end
+
+      # And finally the window size, while windows stay small next to it
+      [2, 4, 8, 16, 32].each do |size|
+        assert_equal({ 'mwindow_size' => size * mb }, tune.(50, 50))
+      end
+
+      assert_equal({}, tune.(50, 50))
+      assert_equal({ window_size: 32 * mb, mapped_limit: 256 * mb, file_limit: 64 },
+        stats.slice(:window_size, :mapped_limit, :file_limit))
+    end
+  end
+
+  def test_pack_tuner_skips_the_file_limit_when_files_are_not_the_bottleneck
+    mb = 1024 * 1024
+    stats = { window_size: mb, mapped_limit: 32 * mb, file_limit: 8, open_files: 3, window_hits: 0, window_misses: 0 }
+
+    with_synthetic_pack_stats(stats) do
+      tuner = Rugged::PackTuner.new(memory_limit: 256 * mb, max_open_files: 64)
+      stats[:window_misses] += 100
+
+      assert_equal({ 'mwindow_mapped_limit' => 64 * mb }, tuner.tune)
+    end
+  end
 end
@@ -1,5 +1,6 @@
 require 'tempfile'
 require 'tmpdir'
+require 'open3'
 require 'minitest/autorun'
 require 'rugged'
 require 'pp'
@@ -25,6 +26,55 @@ module Rugged
       super
     end
 
+    # Whether libgit2's allocations carry the headers needed for
+    # Rugged.allocation_tracking and the pool allocator. They can only be
+    # turned on at startup, with RUGGED_ALLOCATOR=accounting or pool, so
+    # the suite normally runs without them.
+    def allocation_headers?
+      %w[accounting pool].include?(ENV['RUGGED_ALLOCATOR'])
+    end
+
+    # Run the current test again in a child process started with
+    # RUGGED_ALLOCATOR=+mode+, and assert that it passed there.
+    def rerun_with_allocator(mode = "accounting")
+      out, status = Open3.capture2e({ "RUGGED_ALLOCATOR" => mode },
+        RbConfig.ruby, "-I", File.expand_path("../../lib", __FILE__), "-I", __dir__,
+        method(name).source_location[0], "-n", name)
+
+      assert status.success?, out
+      assert_match(/\b1 runs\b/, out)
+    end
+
+    # Assert that running the block allocates at most +objects+ Ruby objects
+    # and, if given, at most +native_bytes+ bytes through libgit2's allocator.
+    # Native allocations can only be counted with allocation headers.
+    #
+    # The block runs once beforehand so that lazily-initialized state (method
+    # caches, interned symbols, libgit2 globals) isn't counted.
+    def assert_allocations(objects:, native_bytes: nil)
+      yield
+
+      if native_bytes
+        Rugged.reset_allocation_stats
+        Rugged.allocation_tracking = true
+      end
+      allocated = GC.stat(:total_allocated_objects)
+
+      yield
+
+      allocated = GC.stat(:total_allocated_objects) - allocated
+      Rugged.allocation_tracking = false if native_bytes
+
+      assert_operator allocated, :<=, objects, "Ruby object allocations over budget"
+
+      if native_bytes
+        bytes = Rugged.allocation_stats.each_value.sum { |site| site[:allocated_bytes] }
+        assert_operator bytes, :<=, native_bytes, "native allocations over budget"
+      end
+    ensure
+      Rugged.allocation_tracking = false if native_bytes
+    end
+
     module FixtureRepo
       # Create a new, empty repository.
       def self.empty(*args)
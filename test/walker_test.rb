@@ -60,6 +60,70 @@ class WalkerTest < Rugged::TestCase
     assert_equal ["5b5b025afb0b4c913b4c338a42934a3863bf3644"], oids
   end
 
+  def test_walk_revlist_in_batches
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    batches = @walker.each_batch(size: 3).to_a
+    assert_equal [3, 1], batches.map(&:length)
+    assert_equal @walker.each_oid.to_a, batches.flatten
+  end
+
+  def test_walk_revlist_in_batches_with_limit_and_offset
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    batches = @walker.each_batch(size: 1, offset: 1, limit: 2).to_a
+    assert_equal [["4a202b346bb0fb0db7eff3cffeb3c70babbd2045"], ["5b5b025afb0b4c913b4c338a42934a3863bf3644"]], batches
+  end
+
+  def test_walk_revlist_in_batches_while_another_thread_is_busy
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    expected = @walker.each_oid.to_a
+
+    # The spinning thread keeps thread-switch interrupts pending
+    done = false
+    spinner = Thread.new { nil until done }
+
+    50.times do
+      @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+      assert_equal expected, @walker.each_batch(size: 1).to_a.flatten
+
+      batches = Rugged::Walker.walk(@repo, show: "9fd738e8f7967c078dceed8190330fc8648ee56a", fields: [:oid], batch: 1)
+      assert_equal expected, batches.flat_map { |batch| batch.map(&:first) }
+
+      batches = Rugged::Walker.walk(@repo, show: "9fd738e8f7967c078dceed8190330fc8648ee56a", batch: 1)
+      assert_equal expected, batches.flat_map { |batch| batch.map(&:oid) }
+    end
+  ensure
+    done = true
+    spinner.join if spinner
+  end
+
+  def test_walk_revlist_in_batches_rejects_invalid_size
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    assert_raises(ArgumentError) { @walker.each_batch(size: 0) {} }
+  end
+
+  def test_walk_revlist_with_fields
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    commits = @walker.each.to_a
+    tuples = @walker.each(fields: [:oid, :time, :author_email, :parent_ids, :summary]).to_a
+
+    assert_equal commits.length, tuples.length
+    commits.zip(tuples).each do |commit, tuple|
+      assert tuple.frozen?
+      assert_equal [commit.oid, commit.epoch_time, commit.author[:email], commit.parent_ids, commit.summary], tuple
+    end
+  end
+
+  def test_walk_revlist_with_fields_and_limit
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    tuples = @walker.each(fields: [:oid], offset: 2, limit: 1).to_a
+    assert_equal [["5b5b025afb0b4c913b4c338a42934a3863bf3644"]], tuples
+  end
+
+  def test_walk_revlist_with_unknown_field
+    @walker.push("9fd738e8f7967c078dceed8190330fc8648ee56a")
+    assert_raises(ArgumentError) { @walker.each(fields: [:bogus]) {} }
+  end
+
   def test_walk_push_range
     @walker.push_range("HEAD~2..HEAD")
     data = @walker.each.to_a
@@ -168,6 +232,16 @@ class WalkerTest < Rugged::TestCase
     assert_equal 1, amount
   end
 
+  def test_walk_api_with_batch
+    batches = []
+    Rugged::Walker.walk(@repo, show: "9fd738e8f7967c078dceed8190330fc8648ee56a", batch: 2) do |commits|
+      batches << commits
+    end
+
+    assert_equal [2, 2], batches.map(&:length)
+    assert batches.flatten.all? { |c| c.is_a?(Rugged::Commit) }
+  end
+
   def test_push_hide_commit
     @walker.push(@repo.lookup("9fd738e8f7967c078dceed8190330fc8648ee56a"))
     @walker.hide(@repo.lookup("5b5b025afb0b4c913b4c338a42934a3863bf3644"))